@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "arena.h"
+
+//Free pages of ARENA_PAGE_SIZE shared by the arenas of a thread.
+//Pages pooled by a thread that exits are not reclaimed.
+static __thread ArenaPage *page_pool = NULL;
+static __thread int page_pool_size = 0;
+
+static ArenaPage *get_page(size_t size) {
+	if (size <= ARENA_PAGE_SIZE && page_pool != NULL) {
+		ArenaPage *page = page_pool;
+
+		page_pool = page->next;
+		page_pool_size -= 1;
+
+		return page;
+	}
+
+	if (size < ARENA_PAGE_SIZE) {
+		size = ARENA_PAGE_SIZE;
+	}
+
+	ArenaPage *page = malloc(sizeof(ArenaPage) + size);
+
+	assert(page != NULL);
+
+	page->size = size;
+
+	return page;
+}
+
+static void put_page(ArenaPage *page) {
+	if (page->size != ARENA_PAGE_SIZE || page_pool_size >= ARENA_POOL_MAX_PAGES) {
+		free(page);
+
+		return;
+	}
+
+	page->next = page_pool;
+	page_pool = page;
+	page_pool_size += 1;
+}
+
+/*
+ * Returns memory aligned to ARENA_ALIGNMENT. Never fails.
+ */
+void *arenaAlloc(Arena *arena, size_t size) {
+	size_t offset = (arena->used + ARENA_ALIGNMENT - 1) & ~(size_t) (ARENA_ALIGNMENT - 1);
+
+	if (arena->page == NULL || offset + size > arena->page->size) {
+		ArenaPage *page = get_page(size);
+
+		page->next = arena->page;
+		arena->page = page;
+		offset = 0;
+	}
+
+	arena->used = offset + size;
+
+	return arena->page->data + offset;
+}
+
+/*
+ * Copies length bytes and adds a NUL.
+ */
+char *arenaStrndup(Arena *arena, const char *str, size_t length) {
+	char *copy = arenaAlloc(arena, length + 1);
+
+	memcpy(copy, str, length);
+	copy[length] = '\0';
+
+	return copy;
+}
+
+ArenaMark arenaMark(Arena *arena) {
+	ArenaMark mark = {arena->page, arena->used};
+
+	return mark;
+}
+
+/*
+ * Releases everything allocated since the mark was taken. Only the
+ * pages added since then are touched.
+ */
+void arenaRelease(Arena *arena, ArenaMark mark) {
+	while (arena->page != mark.page) {
+		ArenaPage *page = arena->page;
+
+		assert(page != NULL); //Mark from another arena?
+
+		arena->page = page->next;
+		put_page(page);
+	}
+
+	arena->used = mark.used;
+}
+
+void arenaReset(Arena *arena) {
+	ArenaMark empty = {NULL, 0};
+
+	arenaRelease(arena, empty);
+}
+
+/*
+ * Frees the pages kept by the pool.
+ */
+void arenaTrimPool() {
+	while (page_pool != NULL) {
+		ArenaPage *page = page_pool;
+
+		page_pool = page->next;
+		free(page);
+	}
+
+	page_pool_size = 0;
+}
@@ -0,0 +1,46 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+#define ARENA_PAGE_SIZE 16384
+//Free pages kept by each thread's pool
+#define ARENA_POOL_MAX_PAGES 256
+#define ARENA_ALIGNMENT 16
+
+typedef struct _ArenaPage {
+	//Next older page
+	struct _ArenaPage *next;
+	//Usable bytes. Larger than a pool page for big allocations.
+	size_t size;
+	char data[] __attribute__((aligned(ARENA_ALIGNMENT)));
+} ArenaPage;
+
+/*
+ * Bump allocator. Memory is never freed piece by piece. Everything
+ * allocated after a mark is released at once by arenaRelease().
+ * Pages come from a pool per thread, so arenas of different threads
+ * do not race. A page released on another thread joins that thread's
+ * pool. A zero filled Arena is empty and ready to use. An Arena must
+ * be used by one thread at a time.
+ */
+typedef struct _Arena {
+	//Newest page
+	ArenaPage *page;
+	//Bytes used in the newest page
+	size_t used;
+} Arena;
+
+typedef struct _ArenaMark {
+	ArenaPage *page;
+	size_t used;
+} ArenaMark;
+
+void *arenaAlloc(Arena *arena, size_t size);
+char *arenaStrndup(Arena *arena, const char *str, size_t length);
+ArenaMark arenaMark(Arena *arena);
+void arenaRelease(Arena *arena, ArenaMark mark);
+void arenaReset(Arena *arena);
+void arenaTrimPool();
+
+#endif
@@ -9,11 +9,47 @@
 #include <netdb.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
 #include "socket-framework.h"
+#include "unix-socket.h"
 
 #define DIE(value, message) if (value < 0) {perror(message); abort();}
 
-void _info(const char* fmt, ...);
+//Events fetched by one epoll_wait()
+#define CLIENT_LOOP_BATCH 256
+//Delay before racing the next address (RFC 8305)
+#define CONNECT_ATTEMPT_DELAY 250
+#define MAX_CONNECT_ATTEMPTS 16
+
+/*
+ * Addresses of a host tried in parallel while a client connects.
+ * The client's own fd is one attempt. The others are driven by the
+ * ClientLoop as hidden clients until one of them connects.
+ */
+typedef struct _ConnectRace {
+	struct addrinfo *res;
+	struct addrinfo *addresses[MAX_CONNECT_ATTEMPTS];
+	int address_count;
+	int next_address;
+	//When the next address is started in milliseconds
+	long long next_start;
+	//Oldest first
+	Client *attempts[MAX_CONNECT_ATTEMPTS];
+	int attempt_count;
+} ConnectRace;
+
+void _trace(const char* fmt, ...);
+int write_client_data(Client *cli_state, char **buffer_start);
+
+static long long now_ms();
+static int order_addresses(struct addrinfo *res, struct addrinfo **list);
+static int start_attempt(struct addrinfo *ai);
 
 Client*
 newClient(const char *host, int port) {
@@ -21,6 +57,7 @@ newClient(const char *host, int port) {
 
 	cstate = (Client*) calloc(1, sizeof(Client));
 	cstate->read_write_flag = RW_STATE_NONE;
+	cstate->fd = -1;
 	strncpy(cstate->host, host, sizeof(cstate->host));
 	cstate->port = port;
 
@@ -29,8 +66,79 @@ newClient(const char *host, int port) {
 	return cstate;
 }
 
+/*
+ * Closes the attempts still racing the client's own fd.
+ */
+static void end_race(Client *cstate) {
+	ConnectRace *race = cstate->race;
+
+	if (race == NULL) {
+		return;
+	}
+
+	cstate->race = NULL;
+
+	for (int i = 0; i < race->attempt_count; ++i) {
+		Client *attempt = race->attempts[i];
+
+		if (attempt->loop != NULL) {
+			clientLoopRemove(attempt->loop, attempt);
+		}
+
+		close(attempt->fd);
+		deleteClient(attempt);
+	}
+
+	freeaddrinfo(race->res);
+	free(race);
+}
+
+/*
+ * Starts the next address that accepts a connect(). Returns the
+ * socket or -1 once every address has been tried.
+ */
+static int start_next(ConnectRace *race) {
+	while (race->next_address < race->address_count) {
+		int sock = start_attempt(race->addresses[race->next_address++]);
+
+		if (sock >= 0) {
+			return sock;
+		}
+	}
+
+	return -1;
+}
+
+/*
+ * Starts a non-blocking connect to the client's host. Every address
+ * family is resolved. The first address to accept a connect() is
+ * the client's fd. A ClientLoop races the rest, a new one every
+ * CONNECT_ATTEMPT_DELAY ms or as soon as one fails, and keeps the
+ * first connection to succeed. Name resolution blocks. Returns the
+ * socket or -1.
+ */
 int clientMakeConnection(Client *cstate) {
-	_info("Connecting to %s:%d", cstate->host, cstate->port);
+	if (cstate->unix_type != 0) {
+		_trace("Connecting to %s", cstate->host);
+
+		int sock = unixConnect(cstate->host, cstate->unix_type);
+
+		if (sock < 0) {
+			perror("Failed to connect to unix socket.");
+
+			return -1;
+		}
+
+		cstate->fd = sock;
+
+		return cstate->fd;
+	}
+
+	_trace("Connecting to %s:%d", cstate->host, cstate->port);
+
+	end_race(cstate);
+	cstate->fd = -1;
+	cstate->is_connected = 0;
 
 	char port_str[128];
 
@@ -39,82 +147,257 @@ int clientMakeConnection(Client *cstate) {
 	struct addrinfo hints, *res;
 
 	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = PF_INET;
+	hints.ai_family = AF_UNSPEC;
 	hints.ai_socktype = SOCK_STREAM;
-	_info("Resolving name...");
-	int status = getaddrinfo(cstate->host, port_str, &hints, &res);
-	DIE(status, "Failed to resolve address.");
-	if (res == NULL) {
-		_info("Failed to resolve address: %s", cstate->host);
-		exit(-1);
+	_trace("Resolving name...");
+	if (getaddrinfo(cstate->host, port_str, &hints, &res) != 0 || res == NULL) {
+		_trace("Failed to resolve address: %s", cstate->host);
+
+		return -1;
 	}
 
-	int sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-	DIE(sock, "Failed to open socket.");
+	ConnectRace *race = calloc(1, sizeof(ConnectRace));
 
-	status = fcntl(sock, F_SETFL, O_NONBLOCK);
-	DIE(status, "Failed to set non blocking mode for socket.");
+	assert(race != NULL);
 
-	status = connect(sock, res->ai_addr, res->ai_addrlen);
-	_info("Asynchronous connection initiated.");
-	if (status < 0 && errno != EINPROGRESS) {
+	race->res = res;
+	race->address_count = order_addresses(res, race->addresses);
+
+	int sock = start_next(race);
+
+	if (sock < 0) {
 		perror("Failed to connect to port.");
-		close(sock);
+		freeaddrinfo(res);
+		free(race);
 
 		return -1;
 	}
 
-	freeaddrinfo(res);
+	_trace("Asynchronous connection initiated.");
+
+	if (race->next_address < race->address_count) {
+		race->next_start = now_ms() + CONNECT_ATTEMPT_DELAY;
+		cstate->race = race;
+	} else {
+		freeaddrinfo(res);
+		free(race);
+	}
 
 	cstate->fd = sock;
 
 	return cstate->fd;
 }
 
+/*
+ * Alternates address families, starting with the family of the
+ * first result, so a broken family does not delay the other.
+ */
+static int order_addresses(struct addrinfo *res, struct addrinfo **list) {
+	struct addrinfo *first[MAX_CONNECT_ATTEMPTS], *second[MAX_CONNECT_ATTEMPTS];
+	int first_count = 0, second_count = 0, count = 0;
+
+	for (struct addrinfo *ai = res; ai != NULL; ai = ai->ai_next) {
+		if (ai->ai_family == res->ai_family) {
+			if (first_count < MAX_CONNECT_ATTEMPTS) {
+				first[first_count++] = ai;
+			}
+		} else if (second_count < MAX_CONNECT_ATTEMPTS) {
+			second[second_count++] = ai;
+		}
+	}
+
+	for (int i = 0; count < MAX_CONNECT_ATTEMPTS &&
+		(i < first_count || i < second_count); ++i) {
+		if (i < first_count) {
+			list[count++] = first[i];
+		}
+		if (i < second_count && count < MAX_CONNECT_ATTEMPTS) {
+			list[count++] = second[i];
+		}
+	}
+
+	return count;
+}
+
+static int start_attempt(struct addrinfo *ai) {
+	int sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+
+	if (sock < 0) {
+		return -1;
+	}
+
+	int status = fcntl(sock, F_SETFL, O_NONBLOCK);
+	DIE(status, "Failed to set non blocking mode for socket.");
+
+	if (connect(sock, ai->ai_addr, ai->ai_addrlen) < 0 && errno != EINPROGRESS) {
+		close(sock);
+
+		return -1;
+	}
+
+	return sock;
+}
+
+/*
+ * Client of an AF_UNIX server. Check fd for failure. type must be
+ * SOCK_STREAM since fixed length reads would truncate SOCK_SEQPACKET
+ * messages.
+ */
+Client*
+newUnixClient(const char *path, int type) {
+	assert(type == SOCK_STREAM);
+
+	Client *cstate = (Client*) calloc(1, sizeof(Client));
+
+	assert(cstate != NULL);
+	assert(strlen(path) < sizeof(cstate->host));
+
+	cstate->read_write_flag = RW_STATE_NONE;
+	cstate->fd = -1;
+	strcpy(cstate->host, path);
+	cstate->unix_type = type;
+
+	clientMakeConnection(cstate);
+
+	return cstate;
+}
+
+static void stop_on_connect(Client *cstate) {
+	clientLoopStop(cstate->loop);
+}
+
+/*
+ * Connects within timeout milliseconds by running the client alone
+ * in a private ClientLoop. Addresses are raced as described for
+ * clientMakeConnection(). Returns the socket or -1.
+ *
+ * Blocks the caller, so do not call it from a ClientLoop callback.
+ * Clients driven by a ClientLoop should use newClient() and the
+ * loop's connect_timeout instead.
+ */
+int clientConnectWithDeadline(Client *cstate, int timeout) {
+	if (cstate->unix_type != 0) {
+		//Local connections complete at once
+		if (clientMakeConnection(cstate) < 0) {
+			return -1;
+		}
+
+		cstate->is_connected = 1;
+
+		return cstate->fd;
+	}
+
+	if (clientMakeConnection(cstate) < 0) {
+		return -1;
+	}
+
+	ClientLoop *loop = newClientLoop();
+	void (*on_server_connect)(Client*) = cstate->on_server_connect;
+	void (*on_server_disconnect)(Client*) = cstate->on_server_disconnect;
+
+	loop->connect_timeout = timeout;
+	cstate->on_server_connect = stop_on_connect;
+	cstate->on_server_disconnect = NULL;
+
+	if (clientLoopAdd(loop, cstate) == 0) {
+		clientLoopRun(loop);
+
+		//Still there if it connected
+		if (cstate->loop == loop) {
+			clientLoopRemove(loop, cstate);
+		}
+	} else {
+		end_race(cstate);
+		close(cstate->fd);
+		cstate->fd = -1;
+	}
+
+	cstate->on_server_connect = on_server_connect;
+	cstate->on_server_disconnect = on_server_disconnect;
+	deleteClientLoop(loop);
+
+	if (!cstate->is_connected) {
+		_trace("Connect to %s failed.", cstate->host);
+
+		return -1;
+	}
+
+	return cstate->fd;
+}
+
+/*
+ * Like newClient() but the connection is complete on return.
+ * Returns NULL if it could not be made within timeout milliseconds.
+ * Blocks. See clientConnectWithDeadline().
+ */
+Client*
+newClientWithDeadline(const char *host, int port, int timeout) {
+	Client *cstate = (Client*) calloc(1, sizeof(Client));
+
+	assert(cstate != NULL);
+
+	cstate->read_write_flag = RW_STATE_NONE;
+	cstate->fd = -1;
+	strncpy(cstate->host, host, sizeof(cstate->host) - 1);
+	cstate->port = port;
+
+	if (clientConnectWithDeadline(cstate, timeout) < 0) {
+		free(cstate);
+
+		return NULL;
+	}
+
+	return cstate;
+}
+
+/*
+ * Remove the client from its ClientLoop first. Safe to call from the
+ * client's ClientLoop callbacks. The memory is then freed once the
+ * callback returns to the loop.
+ */
 void
 deleteClient(Client *cstate) {
+	assert(cstate->loop == NULL);
+
+	if (cstate->dispatching) {
+		cstate->delete_pending = 1;
+
+		return;
+	}
+
+	end_race(cstate);
+	arenaReset(&cstate->arena);
 	free(cstate);
 }
 
 int
 handle_server_read(Client *cli_state) {
         if (!(cli_state->read_write_flag & RW_STATE_WRITE)) {
-                _info("Socket is not trying to write.");
+                _trace("Socket is not trying to write.");
                 return -1;
         }
-        if (cli_state->write_buffer == NULL) {
-                _info("Write buffer not setup.");
+        if (cli_state->write_buffer == NULL && cli_state->write_iov == NULL) {
+                _trace("Write buffer not setup.");
                 return -1;
         }
         if (cli_state->write_length == cli_state->write_completed) {
-                _info("Write was already completed.");
+                _trace("Write was already completed.");
                 return -1;
         }
 
-        char *buffer_start = cli_state->write_buffer + cli_state->write_completed;
-        int bytesWritten = write(cli_state->fd,
-                buffer_start,
-                cli_state->write_length - cli_state->write_completed);
-        _info("Written %d of %d bytes", bytesWritten, cli_state->write_length);
-        if (bytesWritten < 0) {
-                if (errno != EAGAIN && errno != EWOULDBLOCK) {
-                        return -1;
-                }
-                //Write will block. Not an error.
-                _info("Write block detected.");
+        char *buffer_start;
+        int bytesWritten = write_client_data(cli_state, &buffer_start);
 
-                return 0;
-        }
-        if (bytesWritten == 0) {
-                //Client has disconnected. We convert that to an error.
-                return -1;
+        if (bytesWritten <= 0) {
+                return bytesWritten;
         }
 
-        cli_state->write_completed += bytesWritten;
-
         if (cli_state->on_write) {
                 cli_state->on_write(cli_state, buffer_start, bytesWritten);
         }
+        if (cli_state->delete_pending) {
+                return bytesWritten;
+        }
         if (cli_state->write_completed == cli_state->write_length) {
                 //Write is completed. Cancel further write.
 		clientCancelWrite(cli_state);
@@ -138,9 +421,9 @@ handle_server_write(Client *cli_state) {
 			&ch, sizeof(char));
 
 		if (bytesRead == 0) {
-			_info("Orderly disconnect detected.");
+			_trace("Orderly disconnect detected.");
 		} else {
-			_info("Unexpected out of band incoming data.");
+			_trace("Unexpected out of band incoming data.");
 			abort();
 		}
 
@@ -156,14 +439,14 @@ handle_server_write(Client *cli_state) {
                 buffer_start,
                 cli_state->read_length - cli_state->read_completed);
 
-        _info("Read %d of %d bytes", bytesRead, cli_state->read_length);
+        _trace("Read %d of %d bytes", bytesRead, cli_state->read_length);
 
         if (bytesRead < 0) {
                 if (errno != EAGAIN && errno != EWOULDBLOCK) {
                         return -1;
                 }
                 //Read will block. Not an error.
-                _info("Read block detected.");
+                _trace("Read block detected.");
                 return 0;
         }
         if (bytesRead == 0) {
@@ -178,6 +461,9 @@ handle_server_write(Client *cli_state) {
         if (cli_state->on_read) {
                 cli_state->on_read(cli_state, buffer_start, bytesRead);
         }
+        if (cli_state->delete_pending) {
+                return bytesRead;
+        }
         if (read_finished) {
                 //Read is completed. Cancel further read.
 		clientCancelRead(cli_state);
@@ -196,6 +482,11 @@ clientLoop(Client *cstate) {
         struct timeval timeout;
 
 	while (1) {
+		if (cstate->fd < 0) {
+			//Closed by a callback and not reconnected
+			break;
+		}
+
 		FD_ZERO(&readFdSet);
 		FD_ZERO(&writeFdSet);
 
@@ -219,7 +510,7 @@ clientLoop(Client *cstate) {
                 int numEvents = select(FD_SETSIZE, &readFdSet, &writeFdSet, NULL, &timeout);
                 DIE(numEvents, "select() failed.");
 		if (numEvents == 0) {
-			_info("select() timed out.");
+			_trace("select() timed out.");
 
                         break;
                 }
@@ -230,12 +521,15 @@ clientLoop(Client *cstate) {
 				close(cstate->fd);
 				cstate->fd = -1;
 				cstate->is_connected = 0;
-				_info("Orderly server disconnect.");
+				_trace("Orderly server disconnect.");
 				if (cstate->on_server_disconnect) {
 					cstate->on_server_disconnect(cstate);
 				}
 				continue;
 			}
+			if (cstate->fd < 0) {
+				continue;
+			}
 		}
 		if (FD_ISSET(cstate->fd, &writeFdSet)) {
 			if (cstate->is_connected == 0) {
@@ -252,11 +546,11 @@ clientLoop(Client *cstate) {
 					break;
 				}
 				cstate->is_connected = 1;
-				_info("Asynchronous connection completed.");
+				_trace("Asynchronous connection completed.");
 			} else {
 				int status = handle_server_read(cstate);
 				if (status < 1) {
-					_info("Unexpected server disconnect.");
+					_trace("Unexpected server disconnect.");
 					close(cstate->fd);
 					cstate->fd = -1;
 					cstate->is_connected = 0;
@@ -273,3 +567,677 @@ clientLoop(Client *cstate) {
 		close(cstate->fd);
 	}
 }
+
+static long long now_ms() {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (long long) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void list_remove(ClientList *list, Client *cstate) {
+	if (cstate->timeout_prev != NULL) {
+		cstate->timeout_prev->timeout_next = cstate->timeout_next;
+	} else {
+		list->first = cstate->timeout_next;
+	}
+	if (cstate->timeout_next != NULL) {
+		cstate->timeout_next->timeout_prev = cstate->timeout_prev;
+	} else {
+		list->last = cstate->timeout_prev;
+	}
+
+	cstate->timeout_prev = cstate->timeout_next = NULL;
+}
+
+static void list_append(ClientList *list, Client *cstate) {
+	cstate->timeout_next = NULL;
+	cstate->timeout_prev = list->last;
+
+	if (list->last != NULL) {
+		list->last->timeout_next = cstate;
+	} else {
+		list->first = cstate;
+	}
+
+	list->last = cstate;
+}
+
+static ClientList *timeout_list(Client *cstate) {
+	return cstate->is_connected ?
+		&cstate->loop->connected : &cstate->loop->connecting;
+}
+
+/*
+ * Moves the client to the end of its list. Every list is ordered by
+ * last activity, so timeouts are found by looking at the front.
+ */
+static void mark_activity(Client *cstate) {
+	ClientList *list = timeout_list(cstate);
+
+	cstate->last_activity = now_ms();
+
+	list_remove(list, cstate);
+	list_append(list, cstate);
+}
+
+static int wanted_events(Client *cstate) {
+	//Always read. A server disconnect shows up as a read.
+	int events = POLLIN;
+
+	if ((cstate->read_write_flag & RW_STATE_WRITE) || cstate->is_connected == 0) {
+		events |= POLLOUT;
+	}
+
+	return events;
+}
+
+#ifdef __linux__
+static int to_epoll(int events) {
+	return ((events & POLLIN) ? EPOLLIN : 0) | ((events & POLLOUT) ? EPOLLOUT : 0);
+}
+#endif
+
+/*
+ * Called when the client schedules or cancels a write so that the
+ * loop polls for the right events.
+ */
+void clientLoopUpdate(Client *cstate) {
+	ClientLoop *loop = cstate->loop;
+	int events = wanted_events(cstate);
+
+	if (events == cstate->loop_events) {
+		return;
+	}
+
+	cstate->loop_events = events;
+
+#ifdef __linux__
+	if (loop->poll_fd >= 0) {
+		struct epoll_event ev;
+
+		ev.events = to_epoll(events);
+		ev.data.ptr = cstate;
+
+		int status = epoll_ctl(loop->poll_fd, EPOLL_CTL_MOD, cstate->fd, &ev);
+		DIE(status, "epoll_ctl() failed.");
+
+		return;
+	}
+#endif
+
+	((struct pollfd*) loop->poll_events)[cstate->loop_index].events = events;
+}
+
+ClientLoop *newClientLoop() {
+	ClientLoop *loop = calloc(1, sizeof(ClientLoop));
+
+	assert(loop != NULL);
+
+	loop->poll_fd = -1;
+	loop->connect_timeout = 10000;
+	loop->idle_timeout = -1;
+
+#ifdef __linux__
+	loop->poll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->poll_fd < 0) {
+		perror("epoll_create1() failed. Using poll().");
+	} else {
+		loop->poll_events = calloc(CLIENT_LOOP_BATCH, sizeof(struct epoll_event));
+		assert(loop->poll_events != NULL);
+	}
+#endif
+
+	return loop;
+}
+
+/*
+ * Clients still in the loop are removed but not closed.
+ */
+void deleteClientLoop(ClientLoop *loop) {
+	while (loop->client_count > 0) {
+		Client *cstate = loop->clients[loop->client_count - 1];
+
+		//Race attempts go with their owner
+		if (cstate != NULL && cstate->race_owner == NULL) {
+			clientLoopRemove(loop, cstate);
+		}
+
+		loop->client_count -= 1;
+	}
+
+	if (loop->poll_fd >= 0) {
+		close(loop->poll_fd);
+	}
+
+	free(loop->clients);
+	free(loop->poll_events);
+	free(loop);
+}
+
+/*
+ * Adds a client created with newClient(). The connect timeout
+ * starts now.
+ */
+int clientLoopAdd(ClientLoop *loop, Client *cstate) {
+	assert(cstate->loop == NULL);
+
+	if (cstate->fd < 0) {
+		return -1;
+	}
+
+	if (loop->client_count == loop->capacity) {
+		loop->capacity = loop->capacity == 0 ? 64 : 2 * loop->capacity;
+		loop->clients = realloc(loop->clients, loop->capacity * sizeof(Client*));
+		assert(loop->clients != NULL);
+
+		if (loop->poll_fd < 0) {
+			loop->poll_events = realloc(loop->poll_events,
+				loop->capacity * sizeof(struct pollfd));
+			assert(loop->poll_events != NULL);
+		}
+	}
+
+	cstate->loop = loop;
+	cstate->loop_index = loop->client_count;
+	cstate->loop_events = wanted_events(cstate);
+
+#ifdef __linux__
+	if (loop->poll_fd >= 0) {
+		struct epoll_event ev;
+
+		ev.events = to_epoll(cstate->loop_events);
+		ev.data.ptr = cstate;
+
+		if (epoll_ctl(loop->poll_fd, EPOLL_CTL_ADD, cstate->fd, &ev) < 0) {
+			perror("epoll_ctl() failed.");
+			cstate->loop = NULL;
+
+			return -1;
+		}
+	}
+#endif
+
+	if (loop->poll_fd < 0) {
+		struct pollfd *pfd = (struct pollfd*) loop->poll_events + loop->client_count;
+
+		pfd->fd = cstate->fd;
+		pfd->events = cstate->loop_events;
+		pfd->revents = 0;
+	}
+
+	loop->clients[loop->client_count] = cstate;
+	loop->client_count += 1;
+
+	cstate->last_activity = now_ms();
+
+	if (cstate->race_owner == NULL) {
+		list_append(timeout_list(cstate), cstate);
+	}
+	if (cstate->race != NULL) {
+		cstate->race->next_start = cstate->last_activity + CONNECT_ATTEMPT_DELAY;
+	}
+
+	return 0;
+}
+
+/*
+ * Stops driving the client. The socket is left open but addresses
+ * still racing it are given up. Safe to call from a callback.
+ */
+void clientLoopRemove(ClientLoop *loop, Client *cstate) {
+	assert(cstate->loop == loop);
+
+	end_race(cstate);
+
+	if (cstate->race_owner == NULL) {
+		list_remove(timeout_list(cstate), cstate);
+	}
+
+#ifdef __linux__
+	if (loop->poll_fd >= 0) {
+		struct epoll_event *events = loop->poll_events;
+
+		if (cstate->fd >= 0) {
+			epoll_ctl(loop->poll_fd, EPOLL_CTL_DEL, cstate->fd, NULL);
+		}
+
+		//The client may be freed before the rest of the batch is seen
+		for (int i = 0; i < loop->batch_count; ++i) {
+			if (events[i].data.ptr == cstate) {
+				events[i].data.ptr = NULL;
+			}
+		}
+	}
+#endif
+
+	if (loop->poll_fd < 0) {
+		((struct pollfd*) loop->poll_events)[cstate->loop_index].fd = -1;
+	}
+
+	//Slot is reclaimed after the current dispatch
+	loop->clients[cstate->loop_index] = NULL;
+	loop->removed = 1;
+
+	cstate->loop = NULL;
+}
+
+static void compact_clients(ClientLoop *loop) {
+	int count = 0;
+
+	for (int i = 0; i < loop->client_count; ++i) {
+		Client *cstate = loop->clients[i];
+
+		if (cstate == NULL) {
+			continue;
+		}
+
+		if (loop->poll_fd < 0) {
+			struct pollfd *pfd = loop->poll_events;
+
+			pfd[count] = pfd[i];
+		}
+
+		cstate->loop_index = count;
+		loop->clients[count] = cstate;
+		count += 1;
+	}
+
+	loop->client_count = count;
+	loop->removed = 0;
+}
+
+static void close_client(ClientLoop *loop, Client *cstate) {
+	clientLoopRemove(loop, cstate);
+
+	close(cstate->fd);
+	cstate->fd = -1;
+	cstate->is_connected = 0;
+
+	if (cstate->on_server_disconnect) {
+		cstate->on_server_disconnect(cstate);
+	}
+}
+
+/*
+ * Moves a connecting client onto another socket of its race.
+ */
+static void replace_fd(ClientLoop *loop, Client *cstate, int fd) {
+#ifdef __linux__
+	if (loop->poll_fd >= 0) {
+		struct epoll_event ev;
+
+		epoll_ctl(loop->poll_fd, EPOLL_CTL_DEL, cstate->fd, NULL);
+
+		ev.events = to_epoll(cstate->loop_events);
+		ev.data.ptr = cstate;
+
+		int status = epoll_ctl(loop->poll_fd, EPOLL_CTL_ADD, fd, &ev);
+		DIE(status, "epoll_ctl() failed.");
+	}
+#endif
+
+	if (loop->poll_fd < 0) {
+		((struct pollfd*) loop->poll_events)[cstate->loop_index].fd = fd;
+	}
+
+	close(cstate->fd);
+	cstate->fd = fd;
+}
+
+/*
+ * Takes an attempt out of the race and the loop. Returns its socket.
+ */
+static int take_attempt(ClientLoop *loop, ConnectRace *race, Client *attempt) {
+	int fd = attempt->fd;
+	int i = 0;
+
+	while (race->attempts[i] != attempt) {
+		++i;
+	}
+
+	race->attempt_count -= 1;
+	memmove(race->attempts + i, race->attempts + i + 1,
+		(race->attempt_count - i) * sizeof(Client*));
+
+	clientLoopRemove(loop, attempt);
+	attempt->fd = -1;
+	deleteClient(attempt);
+
+	return fd;
+}
+
+/*
+ * Starts the next address of a race as a hidden client.
+ */
+static void add_attempt(ClientLoop *loop, Client *cstate, long long now) {
+	ConnectRace *race = cstate->race;
+	int sock = start_next(race);
+
+	race->next_start = now + CONNECT_ATTEMPT_DELAY;
+
+	if (sock < 0) {
+		return;
+	}
+
+	Client *attempt = calloc(1, sizeof(Client));
+
+	assert(attempt != NULL);
+
+	attempt->fd = sock;
+	attempt->read_write_flag = RW_STATE_NONE;
+	attempt->race_owner = cstate;
+
+	if (clientLoopAdd(loop, attempt) < 0) {
+		close(sock);
+		free(attempt);
+
+		return;
+	}
+
+	race->attempts[race->attempt_count++] = attempt;
+}
+
+/*
+ * Replaces the failed socket of a connecting client with its oldest
+ * pending attempt or the next address. Returns -1 if none is left.
+ */
+static int retry_connect(ClientLoop *loop, Client *cstate) {
+	ConnectRace *race = cstate->race;
+	int fd = -1;
+
+	if (race == NULL) {
+		return -1;
+	}
+
+	if (race->attempt_count > 0) {
+		fd = take_attempt(loop, race, race->attempts[0]);
+	} else {
+		fd = start_next(race);
+		race->next_start = now_ms() + CONNECT_ATTEMPT_DELAY;
+	}
+
+	if (fd < 0) {
+		end_race(cstate);
+
+		return -1;
+	}
+
+	_trace("Connecting %s to the next address.", cstate->host);
+	replace_fd(loop, cstate, fd);
+
+	return 0;
+}
+
+static void connection_made(ClientLoop *loop, Client *cstate) {
+	end_race(cstate);
+
+	list_remove(&loop->connecting, cstate);
+	cstate->is_connected = 1;
+	list_append(&loop->connected, cstate);
+	mark_activity(cstate);
+	clientLoopUpdate(cstate);
+
+	_trace("Asynchronous connection completed.");
+
+	if (cstate->on_server_connect) {
+		cstate->on_server_connect(cstate);
+	}
+}
+
+/*
+ * An attempt that wins hands its socket to the owner. One that fails
+ * lets the next address start at once.
+ */
+static void dispatch_attempt(ClientLoop *loop, Client *attempt, int writable) {
+	Client *cstate = attempt->race_owner;
+	ConnectRace *race = cstate->race;
+	int valopt = 0;
+	socklen_t lon = sizeof(int);
+
+	if (getsockopt(attempt->fd, SOL_SOCKET, SO_ERROR, (void*)(&valopt), &lon) == 0 &&
+		valopt == 0) {
+		if (writable) {
+			replace_fd(loop, cstate, take_attempt(loop, race, attempt));
+			connection_made(loop, cstate);
+		}
+
+		return;
+	}
+
+	_trace("Connect attempt failed: %s", strerror(valopt));
+	close(take_attempt(loop, race, attempt));
+
+	//Do not wait for the delay after a failure
+	race->next_start = 0;
+}
+
+static void dispatch_events(ClientLoop *loop, Client *cstate, int readable, int writable) {
+	if (cstate->race_owner != NULL) {
+		dispatch_attempt(loop, cstate, writable);
+
+		return;
+	}
+
+	if (writable && cstate->is_connected == 0) {
+		int valopt = 0;
+		socklen_t lon = sizeof(int);
+
+		if (getsockopt(cstate->fd, SOL_SOCKET, SO_ERROR, (void*)(&valopt), &lon) < 0 ||
+			valopt != 0) {
+			_trace("Error connecting to server: %s.", strerror(valopt));
+
+			if (retry_connect(loop, cstate) < 0) {
+				close_client(loop, cstate);
+			}
+
+			return;
+		}
+
+		connection_made(loop, cstate);
+
+		return;
+	}
+
+	if (readable) {
+		mark_activity(cstate);
+
+		if (handle_server_write(cstate) < 0) {
+			_trace("Orderly server disconnect.");
+			close_client(loop, cstate);
+
+			return;
+		}
+
+		if (cstate->loop != loop) {
+			//Removed by a callback
+			return;
+		}
+	}
+
+	if (writable && (cstate->read_write_flag & RW_STATE_WRITE)) {
+		mark_activity(cstate);
+
+		if (handle_server_read(cstate) < 0) {
+			_trace("Unexpected server disconnect.");
+			close_client(loop, cstate);
+		}
+	}
+}
+
+/*
+ * A callback may remove and delete the client. Freeing waits until
+ * the callback has returned here.
+ */
+static void handle_events(ClientLoop *loop, Client *cstate, int readable, int writable) {
+	cstate->dispatching = 1;
+	dispatch_events(loop, cstate, readable, writable);
+	cstate->dispatching = 0;
+
+	if (cstate->delete_pending) {
+		deleteClient(cstate);
+	}
+}
+
+/*
+ * Closes clients at the front of a list that have been quiet for
+ * too long. Returns the milliseconds until the next one expires or
+ * -1 if none will.
+ */
+static long long expire_clients(ClientLoop *loop, ClientList *list, int timeout, long long now) {
+	if (timeout < 0) {
+		return -1;
+	}
+
+	while (list->first != NULL) {
+		Client *cstate = list->first;
+		long long remaining = cstate->last_activity + timeout - now;
+
+		if (remaining > 0) {
+			return remaining;
+		}
+
+		_trace("Client %d timed out.", cstate->fd);
+		close_client(loop, cstate);
+	}
+
+	return -1;
+}
+
+/*
+ * Returns the sooner of two waits where -1 is forever.
+ */
+static long long sooner(long long a, long long b) {
+	if (a < 0) {
+		return b;
+	}
+	if (b < 0) {
+		return a;
+	}
+
+	return a < b ? a : b;
+}
+
+/*
+ * Starts the next address of every connecting client whose attempt
+ * delay has passed. Returns the milliseconds until the next start
+ * or -1 if none is left.
+ */
+static long long race_clients(ClientLoop *loop, long long now) {
+	long long wait = -1;
+
+	for (Client *cstate = loop->connecting.first; cstate != NULL;
+		cstate = cstate->timeout_next) {
+		ConnectRace *race = cstate->race;
+
+		if (race == NULL) {
+			continue;
+		}
+
+		if (race->next_address < race->address_count && now >= race->next_start) {
+			add_attempt(loop, cstate, now);
+		}
+		if (race->next_address < race->address_count) {
+			wait = sooner(wait, race->next_start - now);
+		}
+	}
+
+	return wait;
+}
+
+static int next_wait(ClientLoop *loop) {
+	long long now = now_ms();
+	long long wait = expire_clients(loop, &loop->connecting, loop->connect_timeout, now);
+
+	wait = sooner(wait, expire_clients(loop, &loop->connected, loop->idle_timeout, now));
+	wait = sooner(wait, race_clients(loop, now));
+
+	return (int) wait;
+}
+
+/*
+ * Runs until clientLoopStop() is called or no clients are left.
+ */
+void clientLoopRun(ClientLoop *loop) {
+	loop->continue_loop = 1;
+
+	while (loop->continue_loop) {
+		int wait = next_wait(loop);
+
+		if (loop->removed) {
+			compact_clients(loop);
+		}
+
+		if (loop->client_count == 0) {
+			break;
+		}
+
+#ifdef __linux__
+		if (loop->poll_fd >= 0) {
+			struct epoll_event *events = loop->poll_events;
+			int count = epoll_wait(loop->poll_fd, events, CLIENT_LOOP_BATCH, wait);
+
+			if (count < 0 && errno == EINTR) {
+				continue;
+			}
+			DIE(count, "epoll_wait() failed.");
+
+			loop->batch_count = count;
+
+			for (int i = 0; i < count && loop->continue_loop; ++i) {
+				Client *cstate = events[i].data.ptr;
+
+				//Removed earlier in this batch
+				if (cstate == NULL) {
+					continue;
+				}
+
+				handle_events(loop, cstate,
+					(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) != 0,
+					(events[i].events & (EPOLLOUT | EPOLLERR)) != 0);
+			}
+
+			loop->batch_count = 0;
+
+			continue;
+		}
+#endif
+
+		int count = poll(loop->poll_events, loop->client_count, wait);
+
+		if (count < 0 && errno == EINTR) {
+			continue;
+		}
+		DIE(count, "poll() failed.");
+
+		//Clients added by callbacks are not polled yet
+		int polled = loop->client_count;
+
+		for (int i = 0; i < polled && count > 0 && loop->continue_loop; ++i) {
+			//Reloaded every time. Callbacks may add clients.
+			struct pollfd *pfd = (struct pollfd*) loop->poll_events + i;
+			Client *cstate = loop->clients[i];
+			int revents = pfd->revents;
+
+			if (cstate == NULL || revents == 0) {
+				continue;
+			}
+
+			count -= 1;
+			pfd->revents = 0;
+
+			handle_events(loop, cstate,
+				(revents & (POLLIN | POLLHUP | POLLERR)) != 0,
+				(revents & (POLLOUT | POLLERR)) != 0);
+		}
+	}
+
+	if (loop->removed) {
+		compact_clients(loop);
+	}
+}
+
+void clientLoopStop(ClientLoop *loop) {
+	loop->continue_loop = 0;
+}
@@ -0,0 +1,332 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+
+#include "client-pipeline.h"
+
+void _trace(const char* fmt, ...);
+
+static void arm_read(Pipeline *pipeline) {
+	Client *cstate = pipeline->client;
+
+	if (cstate->fd < 0 || (cstate->read_write_flag & RW_STATE_READ)) {
+		return;
+	}
+
+	clientScheduleRead(cstate, pipeline->read_buffer + pipeline->read_length,
+		pipeline->read_capacity - pipeline->read_length);
+}
+
+/*
+ * Writes as many queued requests as the depth allows with one
+ * scatter-gather write. Requests move to the sent list right away
+ * so that responses are always matched in the order of the list.
+ */
+static void flush(Pipeline *pipeline) {
+	Client *cstate = pipeline->client;
+	int count = 0;
+
+	if (cstate->fd < 0 || (cstate->read_write_flag & RW_STATE_WRITE)) {
+		return;
+	}
+
+	while (pipeline->queued_first != NULL && count < PIPELINE_MAX_IOV &&
+		pipeline->sent_count < pipeline->depth) {
+		PipelineRequest *request = pipeline->queued_first;
+
+		pipeline->queued_first = request->next;
+		if (pipeline->queued_first == NULL) {
+			pipeline->queued_last = NULL;
+		}
+
+		request->next = NULL;
+		if (pipeline->sent_last == NULL) {
+			pipeline->sent_first = request;
+		} else {
+			pipeline->sent_last->next = request;
+		}
+		pipeline->sent_last = request;
+		pipeline->sent_count += 1;
+
+		pipeline->iov[count].iov_base = request->data;
+		pipeline->iov[count].iov_len = request->length;
+		count += 1;
+	}
+
+	if (count > 0) {
+		_trace("Pipelining %d requests.", count);
+		clientScheduleWriteV(cstate, pipeline->iov, count);
+	}
+}
+
+static void fail_requests(Pipeline *pipeline, PipelineRequest *request) {
+	while (request != NULL) {
+		PipelineRequest *next = request->next;
+
+		if (request->on_response != NULL) {
+			request->on_response(pipeline, request->context, NULL, 0);
+		}
+
+		free(request->data);
+		free(request);
+
+		request = next;
+	}
+}
+
+/*
+ * Closes a connection whose stream is out of step with the sent
+ * list. Late responses would otherwise be matched to new requests.
+ * The owner reconnects the Client.
+ */
+static void drop_connection(Pipeline *pipeline) {
+	Client *cstate = pipeline->client;
+
+	if (cstate->fd < 0) {
+		return;
+	}
+
+	_trace("Closing pipelined connection %d.", cstate->fd);
+
+	if (cstate->loop != NULL) {
+		clientLoopRemove(cstate->loop, cstate);
+	}
+
+	close(cstate->fd);
+	cstate->fd = -1;
+	cstate->is_connected = 0;
+}
+
+static void report_error(Pipeline *pipeline) {
+	pipelineFail(pipeline);
+
+	if (pipeline->on_error != NULL) {
+		pipeline->on_error(pipeline);
+	}
+}
+
+/*
+ * Hands every complete response in the read buffer to the oldest
+ * sent request. Returns -1 if the stream can not be framed.
+ */
+static int deliver_responses(Pipeline *pipeline) {
+	size_t offset = 0;
+
+	while (offset < pipeline->read_length) {
+		if (pipeline->sent_first == NULL) {
+			_trace("Response without a request.");
+
+			return -1;
+		}
+
+		ssize_t length = pipeline->frame(pipeline, pipeline->read_buffer + offset,
+			pipeline->read_length - offset);
+
+		if (length < 0) {
+			return -1;
+		}
+		if (length == 0) {
+			break;
+		}
+
+		PipelineRequest *request = pipeline->sent_first;
+
+		pipeline->sent_first = request->next;
+		if (pipeline->sent_first == NULL) {
+			pipeline->sent_last = NULL;
+		}
+		pipeline->sent_count -= 1;
+
+		if (request->on_response != NULL) {
+			request->on_response(pipeline, request->context,
+				pipeline->read_buffer + offset, length);
+		}
+
+		free(request->data);
+		free(request);
+
+		offset += length;
+	}
+
+	//Keep the partial response at the front
+	if (offset > 0) {
+		memmove(pipeline->read_buffer, pipeline->read_buffer + offset,
+			pipeline->read_length - offset);
+		pipeline->read_length -= offset;
+	}
+
+	if (pipeline->read_length == pipeline->read_capacity) {
+		//A response larger than the buffer
+		pipeline->read_capacity *= 2;
+		pipeline->read_buffer = realloc(pipeline->read_buffer, pipeline->read_capacity);
+		assert(pipeline->read_buffer != NULL);
+	}
+
+	return 0;
+}
+
+static void on_read(Client *cstate, char *buffer, size_t length) {
+	Pipeline *pipeline = cstate->data;
+
+	pipeline->read_length += length;
+
+	if (deliver_responses(pipeline) < 0) {
+		drop_connection(pipeline);
+		report_error(pipeline);
+
+		return;
+	}
+
+	//Read into the space after the partial response
+	clientCancelRead(cstate);
+	arm_read(pipeline);
+
+	//Responses free up depth
+	flush(pipeline);
+}
+
+static void on_read_completed(Client *cstate) {
+	//The buffer filled up. on_read() has already made room.
+	arm_read(cstate->data);
+}
+
+static void on_write_completed(Client *cstate) {
+	flush(cstate->data);
+}
+
+static void on_server_disconnect(Client *cstate) {
+	report_error(cstate->data);
+}
+
+/*
+ * The Client may still be connecting. Its data and callbacks are
+ * taken over by the pipeline.
+ */
+Pipeline *newPipeline(Client *cstate, PipelineFrame frame) {
+	Pipeline *pipeline = calloc(1, sizeof(Pipeline));
+
+	assert(pipeline != NULL);
+
+	pipeline->client = cstate;
+	pipeline->frame = frame;
+	pipeline->depth = PIPELINE_DEFAULT_DEPTH;
+	pipeline->read_capacity = PIPELINE_READ_BUFFER_SIZE;
+	pipeline->read_buffer = malloc(pipeline->read_capacity);
+	assert(pipeline->read_buffer != NULL);
+
+	cstate->data = pipeline;
+	cstate->on_read = on_read;
+	cstate->on_read_completed = on_read_completed;
+	cstate->on_write = NULL;
+	cstate->on_write_completed = on_write_completed;
+	cstate->on_server_disconnect = on_server_disconnect;
+
+	arm_read(pipeline);
+
+	return pipeline;
+}
+
+/*
+ * Outstanding requests are failed, which closes the connection if
+ * any were sent. Must not be called from a response callback. The
+ * Client is not deleted.
+ */
+void deletePipeline(Pipeline *pipeline) {
+	Client *cstate = pipeline->client;
+
+	pipeline->on_error = NULL;
+	pipelineFail(pipeline);
+
+	clientCancelRead(cstate);
+	clientCancelWrite(cstate);
+	cstate->data = NULL;
+	cstate->on_read = NULL;
+	cstate->on_read_completed = NULL;
+	cstate->on_write_completed = NULL;
+	cstate->on_server_disconnect = NULL;
+
+	free(pipeline->read_buffer);
+	free(pipeline);
+}
+
+/*
+ * Queues a copy of a request. on_response is called with the
+ * response once it arrives. Returns -1 if the Client has no
+ * connection, including one closed after a failure.
+ */
+int pipelineSend(Pipeline *pipeline, const char *data, size_t length,
+	void (*on_response)(Pipeline *pipeline, void *context, char *response, size_t length),
+	void *context) {
+	if (pipeline->client->fd < 0) {
+		return -1;
+	}
+
+	PipelineRequest *request = malloc(sizeof(PipelineRequest));
+
+	assert(request != NULL);
+
+	request->data = malloc(length);
+	assert(request->data != NULL);
+	memcpy(request->data, data, length);
+
+	request->length = length;
+	request->context = context;
+	request->on_response = on_response;
+	request->next = NULL;
+
+	if (pipeline->queued_last == NULL) {
+		pipeline->queued_first = request;
+	} else {
+		pipeline->queued_last->next = request;
+	}
+	pipeline->queued_last = request;
+
+	flush(pipeline);
+
+	return 0;
+}
+
+/*
+ * Fails every sent and queued request. Bytes of a partial response
+ * are dropped. Used when the connection is lost. If requests were
+ * sent the connection is closed, since their responses may still
+ * arrive. pipelineSend() then fails until the Client reconnects.
+ */
+void pipelineFail(Pipeline *pipeline) {
+	//Callbacks may queue new requests
+	PipelineRequest *sent = pipeline->sent_first;
+	PipelineRequest *queued = pipeline->queued_first;
+
+	if (sent != NULL) {
+		//Includes a write cut short below
+		drop_connection(pipeline);
+	}
+
+	pipeline->sent_first = pipeline->sent_last = NULL;
+	pipeline->queued_first = pipeline->queued_last = NULL;
+	pipeline->sent_count = 0;
+	pipeline->read_length = 0;
+
+	if (pipeline->client->read_write_flag & RW_STATE_WRITE) {
+		//The iovec array points into the failed requests
+		clientCancelWrite(pipeline->client);
+	}
+	if (pipeline->client->read_write_flag & RW_STATE_READ) {
+		clientCancelRead(pipeline->client);
+		arm_read(pipeline);
+	}
+
+	fail_requests(pipeline, sent);
+	fail_requests(pipeline, queued);
+}
+
+/*
+ * Frames newline terminated responses.
+ */
+ssize_t pipelineFrameLine(Pipeline *pipeline, const char *buffer, size_t length) {
+	const char *end = memchr(buffer, '\n', length);
+
+	return end == NULL ? 0 : end - buffer + 1;
+}
@@ -0,0 +1,75 @@
+#ifndef CLIENT_PIPELINE_H
+#define CLIENT_PIPELINE_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "socket-framework.h"
+
+#define PIPELINE_READ_BUFFER_SIZE 16384
+//Requests gathered into one writev()
+#define PIPELINE_MAX_IOV 64
+//Requests written but not yet answered
+#define PIPELINE_DEFAULT_DEPTH 128
+
+struct _Pipeline;
+
+/*
+ * Owns a copy of the request bytes. response is NULL if the
+ * connection failed before the response arrived.
+ */
+typedef struct _PipelineRequest {
+	char *data;
+	size_t length;
+	void *context;
+	void (*on_response)(struct _Pipeline *pipeline, void *context, char *response, size_t length);
+	struct _PipelineRequest *next;
+} PipelineRequest;
+
+/*
+ * Returns the length of the response at the start of buffer, 0 if
+ * more data is needed or -1 if the data can not be framed.
+ */
+typedef ssize_t (*PipelineFrame)(struct _Pipeline *pipeline, const char *buffer, size_t length);
+
+/*
+ * Writes queued requests back to back over one Client connection
+ * without waiting for responses. Responses are split out of the
+ * stream by the framing function and handed to the requests in the
+ * order they were sent. The pipeline takes over the Client's
+ * callbacks.
+ */
+typedef struct _Pipeline {
+	Client *client;
+	PipelineFrame frame;
+	//Maximum requests in flight
+	int depth;
+
+	//Queued and not yet written
+	PipelineRequest *queued_first;
+	PipelineRequest *queued_last;
+	//Written or being written. Oldest first.
+	PipelineRequest *sent_first;
+	PipelineRequest *sent_last;
+	int sent_count;
+
+	struct iovec iov[PIPELINE_MAX_IOV];
+
+	char *read_buffer;
+	size_t read_capacity;
+	size_t read_length;
+
+	void *data;
+	//After a disconnect or a framing error. The Client is closed.
+	void (*on_error)(struct _Pipeline *pipeline);
+} Pipeline;
+
+Pipeline *newPipeline(Client *cstate, PipelineFrame frame);
+void deletePipeline(Pipeline *pipeline);
+int pipelineSend(Pipeline *pipeline, const char *data, size_t length,
+	void (*on_response)(Pipeline *pipeline, void *context, char *response, size_t length),
+	void *context);
+void pipelineFail(Pipeline *pipeline);
+ssize_t pipelineFrameLine(Pipeline *pipeline, const char *buffer, size_t length);
+
+#endif
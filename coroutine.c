@@ -0,0 +1,375 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "coroutine.h"
+
+//Free stacks of this thread. The first word of a free stack links
+//to the next.
+static __thread char *stack_pool = NULL;
+static __thread int stack_pool_size = 0;
+static __thread size_t page_size = 0;
+//NULL on the main stack
+static __thread Coroutine *current = NULL;
+
+static size_t guard_size() {
+	if (page_size == 0) {
+		page_size = sysconf(_SC_PAGESIZE);
+	}
+
+	return page_size;
+}
+
+static char *get_stack() {
+	if (stack_pool != NULL) {
+		char *stack = stack_pool;
+
+		stack_pool = *(char**) (stack + guard_size());
+		stack_pool_size -= 1;
+
+		return stack;
+	}
+
+	char *stack = mmap(NULL, guard_size() + CO_STACK_SIZE, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+
+	if (stack == MAP_FAILED) {
+		perror("Failed to map coroutine stack.");
+		abort();
+	}
+
+	//Overflow faults instead of corrupting the heap
+	if (mprotect(stack, guard_size(), PROT_NONE) < 0) {
+		perror("Failed to protect stack guard page.");
+		abort();
+	}
+
+	return stack;
+}
+
+static void put_stack(char *stack) {
+	if (stack_pool_size >= CO_STACK_POOL_MAX) {
+		munmap(stack, guard_size() + CO_STACK_SIZE);
+
+		return;
+	}
+
+	*(char**) (stack + guard_size()) = stack_pool;
+	stack_pool = stack;
+	stack_pool_size += 1;
+}
+
+//Called from assembly
+__attribute__((used)) static void co_main() {
+	Coroutine *co = current;
+
+	co->fn(co->arg);
+	co->finished = 1;
+
+	coYield();
+
+	//A finished coroutine is never resumed
+	abort();
+}
+
+#if defined(__x86_64__)
+
+void coroutine_switch(void **save_sp, void *sp);
+void coroutine_start();
+
+/*
+ * Saves the callee saved registers and the SSE and x87 control words
+ * on the current stack and switches to sp. coroutine_start calls
+ * co_main() with a 16 byte aligned stack.
+ */
+__asm__(
+	".text\n"
+	".globl coroutine_switch\n"
+	".hidden coroutine_switch\n"
+	".type coroutine_switch, @function\n"
+	"coroutine_switch:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $8, %rsp\n"
+	"	stmxcsr (%rsp)\n"
+	"	fnstcw 4(%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq %rsi, %rsp\n"
+	"	ldmxcsr (%rsp)\n"
+	"	fldcw 4(%rsp)\n"
+	"	addq $8, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	".size coroutine_switch, .-coroutine_switch\n"
+	".globl coroutine_start\n"
+	".hidden coroutine_start\n"
+	".type coroutine_start, @function\n"
+	"coroutine_start:\n"
+	"	call co_main\n"
+	"	ud2\n"
+	".size coroutine_start, .-coroutine_start\n"
+);
+
+static void init_context(Coroutine *co) {
+	uintptr_t top = (uintptr_t) (co->stack + guard_size() + CO_STACK_SIZE);
+	void **sp = (void**) ((top & ~(uintptr_t) 15) - 80);
+	unsigned int control[2];
+
+	//Start with the caller's floating point modes
+	__asm__ volatile ("stmxcsr %0" : "=m" (control[0]));
+	__asm__ volatile ("fnstcw %0" : "=m" (control[1]));
+
+	memcpy(sp, control, sizeof(control));
+	//r15, r14, r13, r12, rbx and rbp
+	for (int i = 1; i <= 6; ++i) {
+		sp[i] = NULL;
+	}
+	sp[7] = (void*) coroutine_start;
+
+	co->sp = sp;
+}
+
+static void switch_to(Coroutine *co) {
+	coroutine_switch(&co->caller_sp, co->sp);
+}
+
+static void switch_back(Coroutine *co) {
+	coroutine_switch(&co->sp, co->caller_sp);
+}
+
+#else
+
+static void init_context(Coroutine *co) {
+	int status = getcontext(&co->context);
+
+	if (status < 0) {
+		perror("getcontext() failed.");
+		abort();
+	}
+
+	co->context.uc_stack.ss_sp = co->stack + guard_size();
+	co->context.uc_stack.ss_size = CO_STACK_SIZE;
+	co->context.uc_link = NULL;
+
+	makecontext(&co->context, co_main, 0);
+}
+
+static void switch_to(Coroutine *co) {
+	swapcontext(&co->caller, &co->context);
+}
+
+static void switch_back(Coroutine *co) {
+	swapcontext(&co->context, &co->caller);
+}
+
+#endif
+
+/*
+ * Creates a suspended coroutine. Call coResume() to run it.
+ */
+Coroutine *newCoroutine(void (*fn)(void *arg), void *arg) {
+	Coroutine *co = calloc(1, sizeof(Coroutine));
+
+	assert(co != NULL);
+
+	co->stack = get_stack();
+	co->fn = fn;
+	co->arg = arg;
+
+	init_context(co);
+
+	return co;
+}
+
+/*
+ * Frees a coroutine that has not finished. Its stack is dropped
+ * without unwinding, so anything it holds is leaked.
+ */
+void deleteCoroutine(Coroutine *co) {
+	assert(co != current);
+
+	put_stack(co->stack);
+	free(co);
+}
+
+/*
+ * Runs the coroutine until it yields or returns. A coroutine that
+ * returns is freed. Returns 0 then and 1 otherwise.
+ */
+int coResume(Coroutine *co) {
+	assert(!co->finished);
+	assert(co != current);
+
+	co->previous = current;
+	current = co;
+
+	switch_to(co);
+
+	current = co->previous;
+
+	if (co->finished) {
+		deleteCoroutine(co);
+
+		return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Suspends the running coroutine. coResume() returns to its caller.
+ */
+void coYield() {
+	Coroutine *co = current;
+
+	assert(co != NULL); //Not in a coroutine?
+
+	switch_back(co);
+}
+
+Coroutine *coCurrent() {
+	return current;
+}
+
+/*
+ * Creates a coroutine and runs it until it first suspends. Returns
+ * NULL if it has already finished.
+ */
+Coroutine *coSpawn(void (*fn)(void *arg), void *arg) {
+	Coroutine *co = newCoroutine(fn, arg);
+
+	return coResume(co) ? co : NULL;
+}
+
+static void on_co_ready(SocketRec *rec) {
+	Coroutine *co = rec->coroutine;
+
+	rec->coroutine = NULL;
+
+	//Leave the other callback to its owner
+	if (rec->onReadable == on_co_ready) {
+		rec->onReadable = NULL;
+	}
+	if (rec->onWritable == on_co_ready) {
+		rec->onWritable = NULL;
+	}
+
+	coResume(co);
+}
+
+/*
+ * Called by the pump before it frees a record with a suspended
+ * coroutine, whether removed or freed by pumpStop(). The coroutine's
+ * coRead() or coWrite() returns -1 with errno ECANCELED. The record
+ * is still valid while the coroutine runs but removing it again does
+ * nothing.
+ */
+void coCancelWait(SocketRec *rec) {
+	assert(rec->flag_for_delete);
+
+	if (rec->coroutine != NULL) {
+		on_co_ready(rec);
+	}
+}
+
+static int is_cancelled(SocketRec *rec) {
+	if (rec->flag_for_delete) {
+		errno = ECANCELED;
+
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Reads through pumpRead(). Suspends the coroutine until the socket
+ * has data. Returns 0 at end of stream and -1 with errno on error.
+ * The coroutine owns onReadable while it waits.
+ */
+ssize_t coRead(SocketRec *rec, void *buffer, size_t length) {
+	assert(current != NULL);
+
+	while (1) {
+		if (is_cancelled(rec)) {
+			return -1;
+		}
+
+		ssize_t result = pumpRead(rec, buffer, length);
+
+		if (result >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+			return result;
+		}
+
+		rec->coroutine = current;
+		rec->onReadable = on_co_ready;
+
+		coYield();
+	}
+}
+
+/*
+ * Writes all of the buffer. Suspends the coroutine whenever the
+ * socket would block. Returns length or -1 with errno on error.
+ * The data goes out directly rather than through write_buffer, so
+ * rate_limit and the write budget do not apply.
+ */
+ssize_t coWrite(SocketRec *rec, const void *buffer, size_t length) {
+	assert(current != NULL);
+	assert(rec->write_buffer == NULL && rec->write_queue_first == NULL);
+
+	size_t written = 0;
+
+	while (written < length) {
+		if (is_cancelled(rec)) {
+			return -1;
+		}
+
+		ssize_t result = write(rec->socket, (const char*) buffer + written,
+			length - written);
+
+		if (result > 0) {
+			written += result;
+
+			continue;
+		}
+		if (result < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+			return -1;
+		}
+
+		rec->coroutine = current;
+		rec->onWritable = on_co_ready;
+
+		coYield();
+	}
+
+	return written;
+}
+
+/*
+ * Unmaps the stacks kept by the pool.
+ */
+void coTrimStackPool() {
+	while (stack_pool != NULL) {
+		char *stack = stack_pool;
+
+		stack_pool = *(char**) (stack + guard_size());
+		munmap(stack, guard_size() + CO_STACK_SIZE);
+	}
+
+	stack_pool_size = 0;
+}
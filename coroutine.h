@@ -0,0 +1,55 @@
+#ifndef COROUTINE_H
+#define COROUTINE_H
+
+#include <sys/types.h>
+
+#include "event-pump.h"
+
+#if !defined(__x86_64__)
+#include <ucontext.h>
+#endif
+
+//Usable stack. A guard page below it catches overflow.
+#define CO_STACK_SIZE (64 * 1024)
+//Free stacks kept for reuse by each thread
+#define CO_STACK_POOL_MAX 64
+
+/*
+ * Stackful coroutine. Lets a handler read and write a socket as a
+ * sequence of calls instead of a state machine. coRead() and
+ * coWrite() suspend when the socket would block and the pump resumes
+ * the coroutine once it is ready. On x86_64 switching saves only the
+ * callee saved registers. Other targets use ucontext. Each thread
+ * has its own stack pool and running coroutine. A coroutine must be
+ * resumed on the thread that created it.
+ */
+typedef struct _Coroutine {
+#if defined(__x86_64__)
+	void *sp;
+	void *caller_sp;
+#else
+	ucontext_t context;
+	ucontext_t caller;
+#endif
+	//Start of the mapping. The guard page comes first.
+	char *stack;
+	void (*fn)(void *arg);
+	void *arg;
+	int finished;
+	//Coroutine that resumed this one
+	struct _Coroutine *previous;
+	void *data;
+} Coroutine;
+
+Coroutine *newCoroutine(void (*fn)(void *arg), void *arg);
+void deleteCoroutine(Coroutine *co);
+int coResume(Coroutine *co);
+void coYield();
+Coroutine *coCurrent();
+Coroutine *coSpawn(void (*fn)(void *arg), void *arg);
+ssize_t coRead(SocketRec *rec, void *buffer, size_t length);
+ssize_t coWrite(SocketRec *rec, const void *buffer, size_t length);
+void coCancelWait(SocketRec *rec);
+void coTrimStackPool();
+
+#endif
@@ -9,7 +9,12 @@
 #include <netdb.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <time.h>
+#include <sys/uio.h>
 #include "event-pump.h"
+#include "frame-codec.h"
+#include "coroutine.h"
+#include "unix-socket.h"
 
 #define DIE(value, message) if (value < 0) {perror(message); abort();}
 
@@ -22,6 +27,8 @@
 #endif
 
 static void perform_pending_socket_removal(EventPump *pump);
+static void clear_sockets(EventPump *pump);
+static void check_low_watermark(SocketRec *rec);
 
 static int check_connect_status(int fd) {
 	int valopt;
@@ -38,14 +45,167 @@ static int check_connect_status(int fd) {
 	return 1;
 }
 
+/*
+ * Buckets start full.
+ */
+TokenBucket *newTokenBucket(long rate, long burst) {
+	TokenBucket *bucket = calloc(1, sizeof(TokenBucket));
+
+	assert(bucket != NULL);
+	assert(rate > 0 && burst > 0);
+
+	bucket->rate = rate;
+	bucket->burst = burst;
+	bucket->tokens = burst;
+	bucket->updated = pumpNow();
+
+	return bucket;
+}
+
+/*
+ * No socket or pump may use the bucket any more.
+ */
+void deleteTokenBucket(TokenBucket *bucket) {
+	free(bucket);
+}
+
+static void refill_bucket(TokenBucket *bucket, long long now) {
+	long long elapsed = now - bucket->updated;
+
+	if (elapsed <= 0) {
+		return;
+	}
+
+	long long tokens = bucket->tokens + elapsed * bucket->rate / 1000;
+
+	bucket->tokens = tokens > bucket->burst ? bucket->burst : tokens;
+	bucket->updated = now;
+}
+
+static void unlink_throttled(SocketRec *rec) {
+	if (rec->prev_throttled != NULL) {
+		rec->prev_throttled->next_throttled = rec->next_throttled;
+	} else {
+		rec->pump->throttled = rec->next_throttled;
+	}
+
+	if (rec->next_throttled != NULL) {
+		rec->next_throttled->prev_throttled = rec->prev_throttled;
+	}
+
+	rec->prev_throttled = rec->next_throttled = NULL;
+	rec->write_throttled = 0;
+}
+
+static void on_throttle_timer(PumpTimer *timer) {
+	EventPump *pump = timer->data;
+
+	pump->throttle_timer = NULL;
+
+	//Sockets still out of tokens throttle again on their next write
+	while (pump->throttled != NULL) {
+		unlink_throttled(pump->throttled);
+	}
+}
+
+static void throttle(SocketRec *rec, TokenBucket *bucket, long needed) {
+	EventPump *pump = rec->pump;
+	long wait = (needed - bucket->tokens) * 1000 / bucket->rate + 1;
+	long long deadline = pumpNow() + wait;
+
+	_info("Throttling %d for %ld ms\n", rec->socket, wait);
+
+	if (rec->write_throttled == 0) {
+		rec->write_throttled = 1;
+		rec->prev_throttled = NULL;
+		rec->next_throttled = pump->throttled;
+
+		if (pump->throttled != NULL) {
+			pump->throttled->prev_throttled = rec;
+		}
+		pump->throttled = rec;
+	}
+
+	if (pump->throttle_timer != NULL) {
+		if (pump->throttle_timer->deadline <= deadline) {
+			return;
+		}
+
+		pumpCancelTimer(pump->throttle_timer);
+	}
+
+	pump->throttle_timer = pumpAddTimer(pump, wait, on_throttle_timer, pump);
+}
+
+/*
+ * Returns how many of the wanted bytes the socket's and the pump's
+ * buckets and the socket's write budget allow right now. Throttles
+ * the socket if a bucket is empty.
+ */
+static size_t write_allowance(SocketRec *rec, size_t wanted) {
+	TokenBucket *buckets[2] = {rec->rate_limit, rec->pump->rate_limit};
+	long long now = 0;
+
+	for (int i = 0; i < 2; ++i) {
+		TokenBucket *bucket = buckets[i];
+
+		if (bucket == NULL) {
+			continue;
+		}
+
+		if (now == 0) {
+			now = pumpNow();
+		}
+		refill_bucket(bucket, now);
+
+		long needed = bucket->burst < PUMP_THROTTLE_MIN_WRITE ?
+			bucket->burst : PUMP_THROTTLE_MIN_WRITE;
+
+		if ((size_t) bucket->tokens < wanted && bucket->tokens < needed) {
+			throttle(rec, bucket, needed);
+
+			return 0;
+		}
+
+		if ((size_t) bucket->tokens < wanted) {
+			wanted = bucket->tokens;
+		}
+	}
+
+	if (rec->pump->write_budget != 0 && rec->write_budget_left < wanted) {
+		//The rest goes out next iteration
+		wanted = rec->write_budget_left;
+	}
+
+	return wanted;
+}
+
+static void account_write(SocketRec *rec, size_t length) {
+	if (rec->pump->write_budget != 0) {
+		rec->write_budget_left -= length;
+	}
+	if (rec->rate_limit != NULL) {
+		rec->rate_limit->tokens -= length;
+	}
+	if (rec->pump->rate_limit != NULL) {
+		rec->pump->rate_limit->tokens -= length;
+	}
+}
+
 static int write_pending_data(SocketRec *rec) {
 	assert(rec->write_buffer != NULL);
 	assert(rec->write_length > rec->write_completed);
 
+	size_t length = write_allowance(rec, rec->write_length - rec->write_completed);
+
+	if (length == 0) {
+		return 0;
+	}
+
 	char *buffer_start = rec->write_buffer + rec->write_completed;
 	int bytesWritten = write(rec->socket,
 		buffer_start,
-		rec->write_length - rec->write_completed);
+		length);
 
 	_info("Written %d of %zu bytes\n", bytesWritten, rec->write_length);
 
@@ -65,23 +225,287 @@ static int write_pending_data(SocketRec *rec) {
 	}
 
 	rec->write_completed += bytesWritten;
+	account_write(rec, bytesWritten);
 
 	if (rec->write_completed == rec->write_length) {
 		pumpCancelWrite(rec);
+		check_low_watermark(rec);
 
 		if (rec->onWriteCompleted != NULL) {
 			rec->onWriteCompleted(rec);
 		}
+	} else {
+		check_low_watermark(rec);
 	}
 
 	return 0;
 }
 
+/*
+ * Writes as much of the write queue as the socket takes with one
+ * writev(). Buffers are released as they complete. On error the
+ * queue is dropped. The reader will see the disconnect.
+ */
+static int write_queued_data(SocketRec *rec) {
+	struct iovec iov[PUMP_WRITE_IOV_MAX];
+	int count = 0;
+	size_t allowed = write_allowance(rec, rec->write_queue_length);
+
+	if (allowed == 0) {
+		return 0;
+	}
+
+	for (PumpWrite *w = rec->write_queue_first;
+		w != NULL && count < PUMP_WRITE_IOV_MAX && allowed > 0; w = w->next) {
+		size_t length = w->buffer->length - w->offset;
+
+		if (length > allowed) {
+			length = allowed;
+		}
+
+		iov[count].iov_base = w->buffer->data + w->offset;
+		iov[count].iov_len = length;
+		allowed -= length;
+		count += 1;
+	}
+
+	ssize_t bytesWritten = writev(rec->socket, iov, count);
+
+	_info("Written %zd of %zu queued bytes\n", bytesWritten, rec->write_queue_length);
+
+	if (bytesWritten < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+			return 0;
+		}
+
+		pumpClearWriteQueue(rec);
+
+		return -1;
+	}
+
+	rec->write_queue_length -= bytesWritten;
+	account_write(rec, bytesWritten);
+
+	size_t remaining = bytesWritten;
+
+	while (rec->write_queue_first != NULL) {
+		PumpWrite *w = rec->write_queue_first;
+		size_t left = w->buffer->length - w->offset;
+
+		if (remaining < left) {
+			w->offset += remaining;
+			break;
+		}
+
+		remaining -= left;
+		rec->write_queue_first = w->next;
+		sharedBufferRelease(w->buffer);
+		free(w);
+	}
+
+	if (rec->write_queue_first == NULL) {
+		rec->write_queue_last = NULL;
+	}
+
+	//May queue more data
+	check_low_watermark(rec);
+
+	if (rec->write_queue_first == NULL && rec->onWriteCompleted != NULL) {
+		rec->onWriteCompleted(rec);
+	}
+
+	return 0;
+}
+
+long long pumpNow() {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (long long) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void swap_timers(EventPump *pump, int i, int j) {
+	PumpTimer *timer = pump->timers[i];
+
+	pump->timers[i] = pump->timers[j];
+	pump->timers[j] = timer;
+	pump->timers[i]->index = i;
+	pump->timers[j]->index = j;
+}
+
+static void sift_up(EventPump *pump, int i) {
+	while (i > 0) {
+		int parent = (i - 1) / 2;
+
+		if (pump->timers[parent]->deadline <= pump->timers[i]->deadline) {
+			break;
+		}
+
+		swap_timers(pump, i, parent);
+		i = parent;
+	}
+}
+
+static void sift_down(EventPump *pump, int i) {
+	while (1) {
+		int smallest = i;
+		int left = 2 * i + 1;
+		int right = left + 1;
+
+		if (left < pump->timer_count &&
+			pump->timers[left]->deadline < pump->timers[smallest]->deadline) {
+			smallest = left;
+		}
+		if (right < pump->timer_count &&
+			pump->timers[right]->deadline < pump->timers[smallest]->deadline) {
+			smallest = right;
+		}
+		if (smallest == i) {
+			break;
+		}
+
+		swap_timers(pump, i, smallest);
+		i = smallest;
+	}
+}
+
+static void remove_timer(EventPump *pump, PumpTimer *timer) {
+	int i = timer->index;
+
+	assert(i >= 0 && i < pump->timer_count && pump->timers[i] == timer);
+
+	pump->timer_count -= 1;
+
+	if (i != pump->timer_count) {
+		swap_timers(pump, i, pump->timer_count);
+		sift_down(pump, i);
+		sift_up(pump, i);
+	}
+
+	timer->index = -1;
+}
+
+/*
+ * Calls the timer after at least the given number of
+ * milliseconds. The timer can not be cancelled from its own
+ * callback. Add a new one to repeat.
+ */
+PumpTimer *pumpAddTimer(EventPump *pump, long milliseconds,
+	void (*onTimer)(PumpTimer *timer), void *data) {
+	PumpTimer *timer = calloc(1, sizeof(PumpTimer));
+
+	assert(timer != NULL);
+
+	if (pump->timer_count == pump->timer_capacity) {
+		pump->timer_capacity = pump->timer_capacity == 0 ?
+			16 : 2 * pump->timer_capacity;
+		pump->timers = realloc(pump->timers,
+			pump->timer_capacity * sizeof(PumpTimer*));
+		assert(pump->timers != NULL);
+	}
+
+	timer->deadline = pumpNow() + milliseconds;
+	timer->onTimer = onTimer;
+	timer->data = data;
+	timer->pump = pump;
+	timer->index = pump->timer_count;
+
+	pump->timers[pump->timer_count] = timer;
+	pump->timer_count += 1;
+	sift_up(pump, timer->index);
+
+	return timer;
+}
+
+void pumpCancelTimer(PumpTimer *timer) {
+	remove_timer(timer->pump, timer);
+	free(timer);
+}
+
+static void run_timers(EventPump *pump) {
+	long long now = pumpNow();
+
+	while (pump->timer_count > 0 && pump->timers[0]->deadline <= now &&
+		pump->status == PUMP_STATUS_RUNNING) {
+		PumpTimer *timer = pump->timers[0];
+
+		remove_timer(pump, timer);
+		timer->onTimer(timer);
+		free(timer);
+	}
+}
+
+/*
+ * Dispatch visits every socket once, starting at start and wrapping
+ * around. Returns NULL after the last one.
+ */
+static ListNode *next_in_round(List *sockets, ListNode *n, ListNode *start) {
+	ListNode *next = n->next != NULL ? n->next : sockets->first;
+
+	return next == start ? NULL : next;
+}
+
+/*
+ * Reads from the socket within its budget for the iteration. Returns
+ * -1 with errno set to EAGAIN once the budget is spent. The socket
+ * stays readable and is dispatched again next iteration.
+ */
+ssize_t pumpRead(SocketRec *rec, void *buffer, size_t length) {
+	size_t budget = rec->pump->read_budget;
+
+	if (budget != 0) {
+		if (rec->read_budget_left == 0) {
+			errno = EAGAIN;
+
+			return -1;
+		}
+		if (length > rec->read_budget_left) {
+			length = rec->read_budget_left;
+		}
+	}
+
+	ssize_t bytesRead = read(rec->socket, buffer, length);
+
+	if (budget != 0 && bytesRead > 0) {
+		rec->read_budget_left -= bytesRead;
+	}
+
+	return bytesRead;
+}
+
+static WorkPool *get_work_pool(EventPump *pump) {
+	if (pump->work_pool == NULL) {
+		pump->work_pool = newWorkPool(pump->work_threads);
+	}
+
+	return pump->work_pool;
+}
+
+/*
+ * Runs work on one of pump->work_threads threads. done is called
+ * on the pump's thread during dispatch.
+ */
+void pumpSubmitWork(EventPump *pump, void (*work)(void *arg),
+	void (*done)(void *arg), void *arg) {
+	workPoolSubmit(get_work_pool(pump), work, done, arg);
+}
+
+/*
+ * Reads a range of a file on the pump's worker threads. on_chunk
+ * is called on the pump's thread. See FileReader.
+ */
+FileReader *pumpReadFile(EventPump *pump, int fd, off_t offset, off_t length,
+	void (*on_chunk)(FileReader *reader, char *data, ssize_t length), void *data) {
+	return newFileReader(get_work_pool(pump), fd, offset, length, on_chunk, data);
+}
+
 static void pump_loop(EventPump *pump) {
         fd_set readFdSet, writeFdSet;
         struct timeval timeout;
 
 	pump->status = PUMP_STATUS_RUNNING;
+	pump->last_activity = pumpNow();
 
 	while (pump->status == PUMP_STATUS_RUNNING) {
 
@@ -100,13 +524,19 @@ static void pump_loop(EventPump *pump) {
 			assert(rec->socket >= 0);
 
 			rec->fd_was_set = 0;
+			rec->read_budget_left = pump->read_budget;
+			rec->write_budget_left = pump->write_budget;
 
 			if (rec->onAccept != NULL || rec->onReadable != NULL) {
 				FD_SET(rec->socket, &readFdSet);
 				rec->fd_was_set = 1;
 			}
 
-			if (rec->onWritable != NULL || rec->onConnect != NULL || rec->write_buffer != NULL) {
+			int has_output = rec->write_buffer != NULL || rec->write_queue_first != NULL;
+
+			//A throttled socket would be writable at once and spin
+			if (rec->onConnect != NULL ||
+				(rec->write_throttled == 0 && (rec->onWritable != NULL || has_output))) {
 				FD_SET(rec->socket, &writeFdSet);
 				rec->fd_was_set = 1;
 			}
@@ -115,22 +545,67 @@ static void pump_loop(EventPump *pump) {
 				rec->socket : highest_socket;
 		}
 
-    timeout.tv_sec = pump->timeout;
-    timeout.tv_usec = 0;
+		int work_fd = -1;
+
+		if (pump->work_pool != NULL) {
+			work_fd = workPoolNotifyFd(pump->work_pool);
+			FD_SET(work_fd, &readFdSet);
+			highest_socket = work_fd > highest_socket ? work_fd : highest_socket;
+		}
+
+		//Wake up for the idle timeout or the earliest timer
+		long long now = pumpNow();
+		long long idle_deadline = pump->last_activity + (long long) pump->timeout * 1000;
+		long long wait = idle_deadline - now;
+
+		if (pump->timer_count > 0 && pump->timers[0]->deadline - now < wait) {
+			wait = pump->timers[0]->deadline - now;
+		}
+		if (wait < 0) {
+			wait = 0;
+		}
+
+		timeout.tv_sec = wait / 1000;
+		timeout.tv_usec = (wait % 1000) * 1000;
 
 		_info("Selecting for events in %zu sockets.\n", pump->sockets->size);
     int numEvents = select(highest_socket + 1, &readFdSet, &writeFdSet, NULL, &timeout);
+    if (numEvents < 0 && errno == EINTR) {
+      continue;
+    }
     DIE(numEvents, "select() failed.");
 
+		if (numEvents > 0) {
+			pump->last_activity = pumpNow();
+		}
+
 		pump->phase = PUMP_PHASE_DISPATCH;
 
+		run_timers(pump);
+
+		if (work_fd >= 0 && numEvents > 0 && FD_ISSET(work_fd, &readFdSet) &&
+			pump->status == PUMP_STATUS_RUNNING) {
+			workPoolProcessCompletions(pump->work_pool);
+		}
+
+		if (pump->status != PUMP_STATUS_RUNNING) {
+			break;
+		}
+
 		if (numEvents == 0) {
+			//Timers do not count as activity
+			if (pumpNow() < idle_deadline) {
+				continue;
+			}
+
 			_info("select() timed out.\n");
+			pump->last_activity = pumpNow();
 
-			for (ListNode *n = pump->sockets->first; n != NULL; n = n->next) {
+			for (ListNode *n = pump->sockets->first;
+				n != NULL && pump->status == PUMP_STATUS_RUNNING; n = n->next) {
 				SocketRec *rec = n->data;
 
-				if (rec->fd_was_set == 0) {
+				if (rec->fd_was_set == 0 || rec->flag_for_delete == 1) {
 					continue;
 				}
 
@@ -142,14 +617,34 @@ static void pump_loop(EventPump *pump) {
 			continue; //Timeout
     }
 
-		//Dispatch
-		for (ListNode *n = pump->sockets->first; n != NULL; n = n->next) {
+		//Dispatch round robin so that no socket is always first
+		ListNode *start = pump->next_dispatch != NULL ?
+			pump->next_dispatch->node : pump->sockets->first;
+		int dispatched = 0;
+
+		pump->next_dispatch = NULL;
+
+		for (ListNode *n = start; n != NULL && pump->status == PUMP_STATUS_RUNNING;
+			n = next_in_round(pump->sockets, n, start)) {
 			SocketRec *rec = n->data;
 
-			if (rec->fd_was_set == 0) {
+			//Skip records removed by an earlier callback
+			if (rec->fd_was_set == 0 || rec->flag_for_delete == 1) {
+				continue;
+			}
+
+			if (!FD_ISSET(rec->socket, &writeFdSet) && !FD_ISSET(rec->socket, &readFdSet)) {
 				continue;
 			}
 
+			if (pump->dispatch_budget != 0 && dispatched == pump->dispatch_budget) {
+				//Still ready at the next select()
+				pump->next_dispatch = rec;
+				break;
+			}
+
+			dispatched += 1;
+
 			//Process writable state
 			if (FD_ISSET(rec->socket, &writeFdSet)) {
 				_info("Socket writable: %d\n", rec->socket);
@@ -161,8 +656,13 @@ static void pump_loop(EventPump *pump) {
 					if (rec->onWritable != NULL) {
 						rec->onWritable(rec);
 					}
-					if (rec->write_buffer != NULL) {
+					if (rec->write_throttled) {
+						//Throttled by onWritable
+					} else if (rec->write_buffer != NULL) {
 						write_pending_data(rec);
+					} else if (rec->write_queue_first != NULL &&
+						rec->flag_for_delete == 0) {
+						write_queued_data(rec);
 					}
 				}
 			}
@@ -186,8 +686,16 @@ static void pump_loop(EventPump *pump) {
 				}
 			}
 		}
+
+		if (pump->next_dispatch == NULL && start != NULL && start->next != NULL) {
+			pump->next_dispatch = start->next->data;
+		}
 	}
 
+	//Deferred by pumpStop() during dispatch
+	pump->phase = PUMP_PHASE_FDSET;
+	clear_sockets(pump);
+
 	pump->status = PUMP_STATUS_STOPPED;
 }
 
@@ -205,13 +713,28 @@ static SocketRec *newSocketRec() {
 	rec->onTimeout = NULL;
 	rec->onConnect = NULL;
 	rec->onWriteCompleted = NULL;
+	rec->onWriteHighWatermark = NULL;
+	rec->onWriteLowWatermark = NULL;
 	rec->fd_was_set = 0;
 	rec->flag_for_delete = 0;
 
 	return rec;
 }
 
+/*
+ * Wakes a coroutine suspended on the record before it is freed. Its
+ * coRead() or coWrite() fails. Removing the record again is a no-op.
+ */
+static void cancel_coroutine(SocketRec *rec) {
+	if (rec->coroutine != NULL) {
+		rec->flag_for_delete = 1;
+		coCancelWait(rec);
+	}
+}
+
 static void deleteSocketRec(SocketRec *rec) {
+	assert(rec->coroutine == NULL);
+
 	rec->socket = -1;
 	rec->data = NULL;
 	rec->write_buffer = NULL;
@@ -222,6 +745,18 @@ static void deleteSocketRec(SocketRec *rec) {
 	rec->onTimeout = NULL;
 	rec->onConnect = NULL;
 	rec->onWriteCompleted = NULL;
+	rec->onWriteHighWatermark = NULL;
+	rec->onWriteLowWatermark = NULL;
+	pumpClearWriteQueue(rec);
+	arenaReset(&rec->arena);
+
+	if (rec->codec != NULL) {
+		deleteFrameCodec(rec->codec);
+	}
+
+	//Caught by pumpRemoveSocket() if the record is used again
+	rec->pump = NULL;
+	rec->node = NULL;
 
 	free(rec);
 }
@@ -230,9 +765,31 @@ static void clear_sockets(EventPump *pump) {
 	while (pump->sockets->first != NULL) {
 		SocketRec *rec = pump->sockets->first->data;
 
+		if (rec->flag_for_delete == 0) {
+			//pumpRemoveSocket() from the callback is a no-op
+			rec->flag_for_delete = 1;
+
+			if (rec->onRemoved != NULL) {
+				//May remove other records
+				rec->onRemoved(rec);
+			}
+		}
+
+		cancel_coroutine(rec);
+
+		if (rec->write_throttled) {
+			unlink_throttled(rec);
+		}
+
+		ListNode *node = rec->node;
+
 		deleteSocketRec(rec);
-		listRemoveNode(pump->sockets, pump->sockets->first);
+		listRemoveNode(pump->sockets, node);
 	}
+
+	//Records removed above are already freed
+	pump->removed = NULL;
+	pump->next_dispatch = NULL;
 }
 
 EventPump *newEventPump() {
@@ -242,6 +799,9 @@ EventPump *newEventPump() {
 	pump->sockets = newList();
 
 	pump->timeout = 10; //Seconds
+	pump->read_budget = PUMP_READ_BUDGET;
+	pump->write_budget = PUMP_WRITE_BUDGET;
+	pump->work_threads = WORK_POOL_DEFAULT_THREADS;
 
 	return pump;
 }
@@ -258,13 +818,26 @@ int pumpStop(EventPump *pump) {
 	assert(pump->status == PUMP_STATUS_RUNNING);
 
 	pump->status = PUMP_STATUS_STOP_REQUESTED;
-	clear_sockets(pump);
+
+	if (pump->phase != PUMP_PHASE_DISPATCH) {
+		clear_sockets(pump);
+	}
 
 	return 1;
 }
 
 void deleteEventPump(EventPump *pump) {
 	clear_sockets(pump);
+
+	if (pump->work_pool != NULL) {
+		deleteWorkPool(pump->work_pool);
+	}
+
+	for (int i = 0; i < pump->timer_count; ++i) {
+		free(pump->timers[i]);
+	}
+	free(pump->timers);
+
 	deleteList(pump->sockets);
 	free(pump);
 }
@@ -277,66 +850,73 @@ SocketRec *pumpRegisterSocket(EventPump *pump, int socket, void *data) {
 	rec->pump = pump;
 
 	listAddLast(pump->sockets, rec);
+	rec->node = pump->sockets->last;
 
 	return rec;
 }
 
-static void remove_socket(EventPump *pump, ListNode *n) {
+static void remove_socket(EventPump *pump, SocketRec *rec) {
 	assert(pump->phase != PUMP_PHASE_DISPATCH);
 
-	SocketRec *rec = n->data;
-
 	_info("Removing socket record: %p\n", rec);
 
-	//Destroy the record
-	deleteSocketRec(rec);
+	cancel_coroutine(rec);
+
+	if (pump->next_dispatch == rec) {
+		pump->next_dispatch = rec->node->next != NULL ? rec->node->next->data : NULL;
+	}
 
 	//Removed from list managed sockets
-	listRemoveNode(pump->sockets, n);
+	listRemoveNode(pump->sockets, rec->node);
+
+	if (rec->write_throttled) {
+		unlink_throttled(rec);
+	}
+
+	//Destroy the record
+	deleteSocketRec(rec);
 }
 
+/*
+ * Frees records removed during dispatch. Costs nothing if none
+ * were.
+ */
 static void perform_pending_socket_removal(EventPump *pump) {
 	assert(pump->phase != PUMP_PHASE_DISPATCH);
 
-	for (ListNode *n = pump->sockets->first; n != NULL;) {
-		SocketRec *rec = n->data;
-
-		if (rec->flag_for_delete == 1) {
-			ListNode *nextNode = n->next;
-			remove_socket(pump, n);
+	while (pump->removed != NULL) {
+		SocketRec *rec = pump->removed;
 
-			n = nextNode;
-		} else {
-			n = n->next;
-		}
+		pump->removed = rec->next_removed;
+		remove_socket(pump, rec);
 	}
 }
 
-void *pumpRemoveSocket(EventPump *pump, SocketRec *recToRemove) {
-	void *data = NULL;
+void *pumpRemoveSocket(EventPump *pump, SocketRec *rec) {
+	//Record of another pump or already freed? Freed records are
+	//poisoned by deleteSocketRec().
+	assert(rec->pump == pump && rec->node != NULL);
 
-	for (ListNode *n = pump->sockets->first; n != NULL; n = n->next) {
-		SocketRec *rec = n->data;
-
-		if (rec == recToRemove) {
-			data = rec->data;
-			/*
-			 * We can not remove the record if the pump is
-			 * in the middle of any list iteration.
-			 */
-			if (pump->phase == PUMP_PHASE_DISPATCH) {
-				_info("Flagging socket record for later removal: %p\n", rec);
-				rec->flag_for_delete = 1;
-			} else {
-				remove_socket(pump, n);
-			}
+	void *data = rec->data;
 
-			return data;
-		}
+	if (rec->flag_for_delete) {
+		//Removal is already under way
+		return data;
 	}
 
-	_info("pumpRemoveSocket received invalid socket.");
-	abort();
+	/*
+	 * We can not remove the record if the pump is
+	 * in the middle of any list iteration. The flag makes
+	 * the dispatch loop skip it until then.
+	 */
+	if (pump->phase == PUMP_PHASE_DISPATCH) {
+		_info("Flagging socket record for later removal: %p\n", rec);
+		rec->flag_for_delete = 1;
+		rec->next_removed = pump->removed;
+		pump->removed = rec;
+	} else {
+		remove_socket(pump, rec);
+	}
 
 	return data;
 }
@@ -350,21 +930,41 @@ SocketRec * pumpRegisterClient(EventPump *pump, const char *host, const char *po
 	hints.ai_family = PF_INET;
 	hints.ai_socktype = SOCK_STREAM;
 
+	//Blocks while the name is resolved
 	int status = getaddrinfo(host, port, &hints, &res);
-	DIE(status, "Failed to resolve address.");
-	if (res == NULL) {
-		_info("Failed to resolve address: %s\n", host);
-		abort();
+
+	if (status != 0 || res == NULL) {
+		_info("Failed to resolve address %s: %s\n", host, gai_strerror(status));
+
+		return NULL;
 	}
 
-	int sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-	DIE(sock, "Failed to open socket.");
+	SocketRec *rec = pumpRegisterAddress(pump, res->ai_addr, res->ai_addrlen, data);
 
-	status = fcntl(sock, F_SETFL, O_NONBLOCK);
+	freeaddrinfo(res);
+
+	return rec;
+}
+
+/*
+ * Starts connecting to a resolved address without blocking. onConnect
+ * reports the result. Returns NULL if the connection can not be
+ * started.
+ */
+SocketRec *pumpRegisterAddress(EventPump *pump, const struct sockaddr *address,
+	socklen_t length, void *data) {
+	int sock = socket(address->sa_family, SOCK_STREAM, 0);
+
+	if (sock < 0) {
+		perror("Failed to open socket.");
+
+		return NULL;
+	}
+
+	int status = fcntl(sock, F_SETFL, O_NONBLOCK);
 	DIE(status, "Failed to set non blocking mode for socket.");
 
-	status = connect(sock, res->ai_addr, res->ai_addrlen);
-	freeaddrinfo(res);
+	status = connect(sock, address, length);
 
 	_info("Asynchronous connection initiated.\n");
 	if (status < 0 && errno != EINPROGRESS) {
@@ -406,6 +1006,111 @@ SocketRec * pumpRegisterServer(EventPump *pump, int port, void *data) {
 	return pumpRegisterSocket(pump, sock, data);
 }
 
+/*
+ * Listens on an AF_UNIX path. type is SOCK_STREAM or SOCK_SEQPACKET.
+ * A path starting with @ is in the abstract namespace.
+ */
+SocketRec *pumpRegisterUnixServer(EventPump *pump, const char *path, int type, void *data) {
+	int sock = unixListen(path, type);
+	DIE(sock, "Failed to listen on unix socket.");
+
+	return pumpRegisterSocket(pump, sock, data);
+}
+
+/*
+ * Returns NULL if the connection is refused. onConnect is still
+ * called since the socket is writable right away.
+ */
+SocketRec *pumpRegisterUnixClient(EventPump *pump, const char *path, int type, void *data) {
+	_info("Connecting to %s\n", path);
+
+	int sock = unixConnect(path, type);
+
+	if (sock < 0) {
+		perror("Failed to connect to unix socket.");
+
+		return NULL;
+	}
+
+	return pumpRegisterSocket(pump, sock, data);
+}
+
+/*
+ * Registers both ends of a new socketpair(). Useful to talk to
+ * another thread's pump. Returns -1 on error.
+ */
+int pumpRegisterSocketPair(EventPump *pump, int type, SocketRec *pair[2], void *data) {
+	int fds[2];
+
+	if (unixSocketPair(type, fds) < 0) {
+		perror("Failed to create socket pair.");
+
+		return -1;
+	}
+
+	pair[0] = pumpRegisterSocket(pump, fds[0], data);
+	pair[1] = pumpRegisterSocket(pump, fds[1], data);
+
+	return 0;
+}
+
+/*
+ * Bytes given to the pump for the socket and not yet written.
+ */
+size_t pumpPendingBytes(SocketRec *rec) {
+	size_t pending = rec->write_queue_length;
+
+	if (rec->write_buffer != NULL) {
+		pending += rec->write_length - rec->write_completed;
+	}
+
+	return pending;
+}
+
+static void check_high_watermark(SocketRec *rec) {
+	if (rec->write_high_watermark == 0 || rec->write_above_high ||
+		pumpPendingBytes(rec) <= rec->write_high_watermark) {
+		return;
+	}
+
+	_info("High watermark reached: %d\n", rec->socket);
+
+	rec->write_above_high = 1;
+
+	if (rec->onWriteHighWatermark != NULL) {
+		rec->onWriteHighWatermark(rec);
+	}
+}
+
+static void check_low_watermark(SocketRec *rec) {
+	if (!rec->write_above_high || pumpPendingBytes(rec) > rec->write_low_watermark) {
+		return;
+	}
+
+	_info("Low watermark reached: %d\n", rec->socket);
+
+	rec->write_above_high = 0;
+
+	if (rec->onWriteLowWatermark != NULL) {
+		rec->onWriteLowWatermark(rec);
+	}
+}
+
+/*
+ * A producer would typically stop reading its source in
+ * onWriteHighWatermark and resume in onWriteLowWatermark. The low
+ * mark must be below the high mark.
+ */
+void pumpSetWatermarks(SocketRec *rec, size_t low, size_t high) {
+	assert(high == 0 || low < high);
+
+	rec->write_low_watermark = low;
+	rec->write_high_watermark = high;
+
+	check_high_watermark(rec);
+	check_low_watermark(rec);
+}
+
 int pumpScheduleWrite(SocketRec *rec, char *buffer, size_t length) {
 	if (rec->write_buffer != NULL) {
 		_info("A write is already in progress.\n");
@@ -417,6 +1122,8 @@ int pumpScheduleWrite(SocketRec *rec, char *buffer, size_t length) {
 	rec->write_length = length;
 	rec->write_completed = 0;
 
+	check_high_watermark(rec);
+
 	return 0;
 }
 
@@ -426,3 +1133,107 @@ int pumpCancelWrite(SocketRec *rec) {
 
 	return 0;
 }
+
+/*
+ * Copies the data. If data is NULL the caller fills the buffer in.
+ * The caller holds the only reference.
+ */
+SharedBuffer *newSharedBuffer(const char *data, size_t length) {
+	SharedBuffer *buffer = malloc(sizeof(SharedBuffer) + length);
+
+	assert(buffer != NULL);
+
+	buffer->refcount = 1;
+	buffer->length = length;
+
+	if (data != NULL) {
+		memcpy(buffer->data, data, length);
+	}
+
+	return buffer;
+}
+
+SharedBuffer *sharedBufferRetain(SharedBuffer *buffer) {
+	buffer->refcount += 1;
+
+	return buffer;
+}
+
+void sharedBufferRelease(SharedBuffer *buffer) {
+	assert(buffer->refcount > 0);
+
+	buffer->refcount -= 1;
+
+	if (buffer->refcount == 0) {
+		free(buffer);
+	}
+}
+
+/*
+ * Adds a reference to the buffer and queues it for writing. Queued
+ * buffers go out in order after any pumpScheduleWrite() buffer.
+ * onWriteCompleted is called when the queue drains.
+ */
+void pumpQueueWrite(SocketRec *rec, SharedBuffer *buffer) {
+	if (buffer->length == 0) {
+		return;
+	}
+
+	PumpWrite *w = malloc(sizeof(PumpWrite));
+
+	assert(w != NULL);
+
+	w->buffer = sharedBufferRetain(buffer);
+	w->offset = 0;
+	w->next = NULL;
+
+	if (rec->write_queue_last == NULL) {
+		rec->write_queue_first = w;
+	} else {
+		rec->write_queue_last->next = w;
+	}
+	rec->write_queue_last = w;
+	rec->write_queue_length += buffer->length;
+
+	check_high_watermark(rec);
+}
+
+/*
+ * Queues one buffer on many sockets. Memory used is that of the
+ * payload plus a small record per socket. Records flagged for
+ * removal are skipped. Returns the number of sockets queued.
+ */
+int pumpBroadcast(EventPump *pump, SocketRec **recs, int count, SharedBuffer *buffer) {
+	int queued = 0;
+
+	for (int i = 0; i < count; ++i) {
+		assert(recs[i]->pump == pump);
+
+		if (recs[i]->flag_for_delete == 0) {
+			pumpQueueWrite(recs[i], buffer);
+			queued += 1;
+		}
+	}
+
+	return queued;
+}
+
+/*
+ * Drops unwritten buffers, including a partly written one.
+ */
+void pumpClearWriteQueue(SocketRec *rec) {
+	while (rec->write_queue_first != NULL) {
+		PumpWrite *w = rec->write_queue_first;
+
+		rec->write_queue_first = w->next;
+		sharedBufferRelease(w->buffer);
+		free(w);
+	}
+
+	rec->write_queue_last = NULL;
+	rec->write_queue_length = 0;
+	//Dropped bytes will not be written. No low watermark callback.
+	if (pumpPendingBytes(rec) <= rec->write_low_watermark) {
+		rec->write_above_high = 0;
+	}
+}
@@ -1,4 +1,13 @@
+#ifndef EVENT_PUMP_H
+#define EVENT_PUMP_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
 #include "../Cute/List.h"
+#include "arena.h"
+#include "work-pool.h"
+#include "file-reader.h"
 
 #define PUMP_STATUS_STOPPED 0
 #define PUMP_STATUS_RUNNING 1
@@ -7,7 +16,48 @@
 #define PUMP_PHASE_FDSET 1
 #define PUMP_PHASE_DISPATCH 2
 
+//Buffers written by one writev() from a write queue
+#define PUMP_WRITE_IOV_MAX 64
+//A rate limited socket waits for this many tokens rather than
+//write a few bytes at a time
+#define PUMP_THROTTLE_MIN_WRITE 4096
+//Default bytes a socket may read or write per pump iteration
+#define PUMP_READ_BUDGET 65536
+#define PUMP_WRITE_BUDGET 65536
+
 struct _EventPump;
+struct _Coroutine;
+struct _FrameCodec;
+
+/*
+ * Immutable reference counted payload. Can be queued on many
+ * sockets at once. Freed when the last reference is released.
+ */
+typedef struct _SharedBuffer {
+	int refcount;
+	size_t length;
+	char data[];
+} SharedBuffer;
+
+/*
+ * Limits egress to rate bytes per second with bursts of up to burst
+ * bytes. One bucket can be shared by many sockets, for example all
+ * connections of a tenant.
+ */
+typedef struct _TokenBucket {
+	long rate;
+	long burst;
+	long tokens;
+	//Milliseconds
+	long long updated;
+} TokenBucket;
+
+typedef struct _PumpWrite {
+	SharedBuffer *buffer;
+	//Bytes of the buffer already written
+	size_t offset;
+	struct _PumpWrite *next;
+} PumpWrite;
 
 typedef struct _SocketRec {
 	int socket;
@@ -18,6 +68,39 @@ typedef struct _SocketRec {
 	size_t write_completed;
 	int flag_for_delete;
 	int fd_was_set;
+	//Node in pump->sockets
+	ListNode *node;
+	//Next record waiting to be freed after dispatch
+	struct _SocketRec *next_removed;
+	//Shared buffers written after write_buffer, oldest first
+	PumpWrite *write_queue_first;
+	PumpWrite *write_queue_last;
+	size_t write_queue_length;
+	/*
+	 * onWriteHighWatermark is called when unwritten bytes rise
+	 * above write_high_watermark and onWriteLowWatermark when they
+	 * fall back to write_low_watermark. 0 disables.
+	 */
+	size_t write_high_watermark;
+	size_t write_low_watermark;
+	int write_above_high;
+	//Optional. Shapes write_buffer and write queue output.
+	TokenBucket *rate_limit;
+	//Write interest is off until the pump refills the buckets
+	int write_throttled;
+	//Neighbours in pump->throttled
+	struct _SocketRec *prev_throttled;
+	struct _SocketRec *next_throttled;
+	//Left in this iteration. See EventPump read_budget.
+	size_t read_budget_left;
+	size_t write_budget_left;
+	//Released with the record
+	Arena arena;
+	//Suspended in coRead() or coWrite(). Resumed with an error
+	//before the record is freed.
+	struct _Coroutine *coroutine;
+	//Set by pumpSetFrameCodec(). Freed with the record.
+	struct _FrameCodec *codec;
 
 	void (*onAccept)
 		(struct _SocketRec *rec, int accepted_socket);
@@ -31,14 +114,70 @@ typedef struct _SocketRec {
 		(struct _SocketRec *rec);
 	void (*onWriteCompleted)
 		(struct _SocketRec *rec);
+	void (*onWriteHighWatermark)
+		(struct _SocketRec *rec);
+	void (*onWriteLowWatermark)
+		(struct _SocketRec *rec);
+	//Called before pumpStop() or deleteEventPump() frees a record
+	//that was not removed with pumpRemoveSocket()
+	void (*onRemoved)
+		(struct _SocketRec *rec);
 } SocketRec;
 
+/*
+ * One shot timer. Owned by the pump and freed after it fires or is
+ * cancelled.
+ */
+typedef struct _PumpTimer {
+	//Monotonic time in milliseconds
+	long long deadline;
+	//Position in the pump's heap. -1 once fired.
+	int index;
+	void *data;
+	struct _EventPump *pump;
+
+	void (*onTimer)
+		(struct _PumpTimer *timer);
+} PumpTimer;
+
 typedef struct _EventPump {
 	int status;
+	//Seconds without socket events before onTimeout is called
 	time_t timeout;
+	//Milliseconds. Last select() that reported events.
+	long long last_activity;
 	int control_pipe[2];
 	List *sockets;
+	//Removed during dispatch. Freed before the next select().
+	SocketRec *removed;
 	int phase;
+	//Min heap ordered by deadline
+	PumpTimer **timers;
+	int timer_count;
+	int timer_capacity;
+	//Optional. Shapes output of all sockets.
+	TokenBucket *rate_limit;
+	//Clears write_throttled once tokens are available
+	PumpTimer *throttle_timer;
+	//Records with write_throttled set
+	SocketRec *throttled;
+	/*
+	 * Bytes each socket may move per iteration through pumpRead()
+	 * and pump managed writes. A socket with more work is served
+	 * again in the next iteration after the others. 0 is unlimited.
+	 */
+	size_t read_budget;
+	size_t write_budget;
+	/*
+	 * Ready sockets whose callbacks run per iteration. The rest
+	 * are dispatched first in the next iteration. 0 is unlimited.
+	 */
+	int dispatch_budget;
+	//Where the next dispatch starts. Advances every iteration.
+	SocketRec *next_dispatch;
+	//Created by the first pumpSubmitWork()
+	WorkPool *work_pool;
+	int work_threads;
 } EventPump;
 
 EventPump *newEventPump();
@@ -49,5 +188,31 @@ int pumpStart(EventPump *pump);
 int pumpStop(EventPump *pump);
 int pumpScheduleWrite(SocketRec *rec, char *buffer, size_t length);
 int pumpCancelWrite(SocketRec *rec);
+SharedBuffer *newSharedBuffer(const char *data, size_t length);
+SharedBuffer *sharedBufferRetain(SharedBuffer *buffer);
+void sharedBufferRelease(SharedBuffer *buffer);
+void pumpQueueWrite(SocketRec *rec, SharedBuffer *buffer);
+int pumpBroadcast(EventPump *pump, SocketRec **recs, int count, SharedBuffer *buffer);
+void pumpClearWriteQueue(SocketRec *rec);
+size_t pumpPendingBytes(SocketRec *rec);
+TokenBucket *newTokenBucket(long rate, long burst);
+void deleteTokenBucket(TokenBucket *bucket);
+void pumpSetWatermarks(SocketRec *rec, size_t low, size_t high);
 SocketRec * pumpRegisterServer(EventPump *pump, int port, void *data);
 SocketRec * pumpRegisterClient(EventPump *pump, const char *host, const char *port, void *data);
+SocketRec *pumpRegisterAddress(EventPump *pump, const struct sockaddr *address,
+	socklen_t length, void *data);
+SocketRec *pumpRegisterUnixServer(EventPump *pump, const char *path, int type, void *data);
+SocketRec *pumpRegisterUnixClient(EventPump *pump, const char *path, int type, void *data);
+int pumpRegisterSocketPair(EventPump *pump, int type, SocketRec *pair[2], void *data);
+PumpTimer *pumpAddTimer(EventPump *pump, long milliseconds,
+	void (*onTimer)(PumpTimer *timer), void *data);
+void pumpCancelTimer(PumpTimer *timer);
+long long pumpNow();
+ssize_t pumpRead(SocketRec *rec, void *buffer, size_t length);
+void pumpSubmitWork(EventPump *pump, void (*work)(void *arg),
+	void (*done)(void *arg), void *arg);
+FileReader *pumpReadFile(EventPump *pump, int fd, off_t offset, off_t length,
+	void (*on_chunk)(FileReader *reader, char *data, ssize_t length), void *data);
+
+#endif
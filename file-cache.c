@@ -0,0 +1,517 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include "file-cache.h"
+#include "http-response.h"
+
+#define WATCH_MASK (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | \
+	IN_MOVE_SELF | IN_DELETE_SELF)
+
+void _trace(const char* fmt, ...);
+
+typedef struct {
+	int encoding;
+	const char *suffix;
+	const char *name;
+} Variant;
+
+//In order of preference
+static const Variant variant_types[FILE_CACHE_VARIANTS] = {
+	{HTTP_ENCODING_BR, ".br", "br"},
+	{HTTP_ENCODING_ZSTD, ".zst", "zstd"},
+	{HTTP_ENCODING_GZIP, ".gz", "gzip"}
+};
+
+static unsigned int hash_path(const char *path, size_t length) {
+	//FNV-1a
+	unsigned int hash = 2166136261u;
+
+	for (size_t i = 0; i < length; ++i) {
+		hash ^= (unsigned char) path[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+static FileCacheEntry **find_bucket(FileCache *cache, unsigned int hash) {
+	return cache->buckets + (hash & (cache->bucket_count - 1));
+}
+
+static FileCacheEntry *find_entry(FileCache *cache, const char *path,
+	size_t path_length, unsigned int hash) {
+	for (FileCacheEntry *e = *find_bucket(cache, hash); e != NULL; e = e->hash_next) {
+		if (e->hash == hash && e->path_length == path_length &&
+			memcmp(e->path, path, path_length) == 0) {
+			return e;
+		}
+	}
+
+	return NULL;
+}
+
+static FileCacheEntry **find_watch_bucket(FileCache *cache, int watch) {
+	return cache->watches + (watch & (cache->bucket_count - 1));
+}
+
+//Returns a cached file or variant with the watch
+static FileCacheEntry *find_watch(FileCache *cache, int watch) {
+	for (FileCacheEntry *e = *find_watch_bucket(cache, watch); e != NULL; e = e->watch_next) {
+		if (e->watch == watch) {
+			return e;
+		}
+	}
+
+	return NULL;
+}
+
+static void link_watch(FileCache *cache, FileCacheEntry *e) {
+	if (e->watch >= 0) {
+		FileCacheEntry **bucket = find_watch_bucket(cache, e->watch);
+
+		e->watch_next = *bucket;
+		*bucket = e;
+	}
+}
+
+static void unlink_watch(FileCache *cache, FileCacheEntry *e) {
+	if (e->watch >= 0) {
+		FileCacheEntry **p = find_watch_bucket(cache, e->watch);
+
+		while (*p != e) {
+			p = &(*p)->watch_next;
+		}
+		*p = e->watch_next;
+	}
+}
+
+static void free_entry(FileCache *cache, FileCacheEntry *e) {
+	assert(e->refcount == 0);
+	assert(e->cached == 0);
+
+	_trace("Closing cached file: %s", e->path);
+
+	for (int i = 0; i < FILE_CACHE_VARIANTS; ++i) {
+		if (e->variants[i] != NULL) {
+			free_entry(cache, e->variants[i]);
+		}
+	}
+
+#ifdef __linux__
+	//Paths to the same inode share a watch
+	if (e->watch >= 0 && cache->notify_fd >= 0 && find_watch(cache, e->watch) == NULL) {
+		inotify_rm_watch(cache->notify_fd, e->watch);
+	}
+#endif
+
+	if (e->map != NULL) {
+		munmap(e->map, e->st.st_size);
+	}
+
+	close(e->fd);
+	free(e->headers);
+	free(e->path);
+	free(e);
+}
+
+/*
+ * Takes an entry out of the cache. The entry is freed when the
+ * last user releases it.
+ */
+static void remove_entry(FileCache *cache, FileCacheEntry *e) {
+	assert(e->cached == 1);
+
+	FileCacheEntry **p = find_bucket(cache, e->hash);
+
+	while (*p != e) {
+		p = &(*p)->hash_next;
+	}
+	*p = e->hash_next;
+
+	unlink_watch(cache, e);
+	for (int i = 0; i < FILE_CACHE_VARIANTS; ++i) {
+		if (e->variants[i] != NULL) {
+			unlink_watch(cache, e->variants[i]);
+		}
+	}
+
+	cache->slots[e->slot] = NULL;
+	cache->entry_count -= 1;
+	cache->memory_used -= e->memory;
+	e->cached = 0;
+
+	if (e->refcount == 0) {
+		free_entry(cache, e);
+	}
+}
+
+static int evict_one(FileCache *cache) {
+	//Two sweeps clear every reference bit at most once
+	for (int i = 0; i < 2 * cache->max_entries; ++i) {
+		FileCacheEntry *e = cache->slots[cache->hand];
+
+		cache->hand = (cache->hand + 1) % cache->max_entries;
+
+		if (e == NULL || e->refcount > 0) {
+			continue;
+		}
+		if (e->referenced) {
+			e->referenced = 0;
+
+			continue;
+		}
+
+		_trace("Evicting cached file: %s", e->path);
+		remove_entry(cache, e);
+
+		return 1;
+	}
+
+	return 0;
+}
+
+static int make_room(FileCache *cache, size_t memory) {
+	if (memory > cache->memory_budget) {
+		return -1;
+	}
+
+	while (cache->entry_count == cache->max_entries ||
+		cache->memory_used + memory > cache->memory_budget) {
+		if (!evict_one(cache)) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void insert_entry(FileCache *cache, FileCacheEntry *e) {
+	FileCacheEntry **bucket = find_bucket(cache, e->hash);
+
+	for (int i = 0; i < cache->max_entries; ++i) {
+		if (cache->slots[i] == NULL) {
+			e->slot = i;
+			cache->slots[i] = e;
+
+			break;
+		}
+	}
+
+	e->hash_next = *bucket;
+	*bucket = e;
+	e->cached = 1;
+
+	link_watch(cache, e);
+	for (int i = 0; i < FILE_CACHE_VARIANTS; ++i) {
+		if (e->variants[i] != NULL) {
+			link_watch(cache, e->variants[i]);
+		}
+	}
+
+	cache->entry_count += 1;
+	cache->memory_used += e->memory;
+}
+
+static char *build_headers(FileCacheEntry *e, const char *encoding, int vary) {
+	char tmp[256];
+	char date[HTTP_DATE_LENGTH + 1];
+	int length;
+
+	httpFormatDate(e->st.st_mtime, date);
+
+	length = snprintf(tmp, sizeof(tmp), "Content-Length: %lld\r\n",
+		(long long) e->st.st_size);
+	e->entity_offset = length;
+	length += snprintf(tmp + length, sizeof(tmp) - length,
+		"Last-Modified: %s\r\nAccept-Ranges: bytes\r\n", date);
+
+	if (encoding != NULL) {
+		length += snprintf(tmp + length, sizeof(tmp) - length,
+			"Content-Encoding: %s\r\n", encoding);
+	}
+	if (vary) {
+		length += snprintf(tmp + length, sizeof(tmp) - length,
+			"Vary: Accept-Encoding\r\n");
+	}
+
+	e->headers_length = length;
+
+	return strdup(tmp);
+}
+
+static FileCacheEntry *open_entry(const char *path, size_t path_length) {
+	FileCacheEntry *e = calloc(1, sizeof(FileCacheEntry));
+
+	assert(e != NULL);
+
+	e->path = strndup(path, path_length);
+	e->path_length = path_length;
+	e->watch = -1;
+	e->slot = -1;
+	e->fd = open(e->path, O_RDONLY);
+
+	if (e->fd < 0 || fstat(e->fd, &e->st) < 0 || !S_ISREG(e->st.st_mode)) {
+		if (e->fd >= 0) {
+			close(e->fd);
+		}
+		free(e->path);
+		free(e);
+
+		return NULL;
+	}
+
+	return e;
+}
+
+/*
+ * Maps the file and sets up change notification. Returns the
+ * memory charged for the entry.
+ */
+static size_t prepare_entry(FileCache *cache, FileCacheEntry *e) {
+	size_t memory = sizeof(FileCacheEntry) + e->path_length + e->headers_length;
+
+	if (cache->map_files && e->st.st_size > 0 &&
+		memory + e->st.st_size <= cache->memory_budget) {
+		e->map = mmap(NULL, e->st.st_size, PROT_READ, MAP_SHARED, e->fd, 0);
+
+		if (e->map == MAP_FAILED) {
+			perror("Failed to map cached file.");
+			e->map = NULL;
+		} else {
+			memory += e->st.st_size;
+		}
+	}
+
+#ifdef __linux__
+	if (cache->notify_fd >= 0) {
+		e->watch = inotify_add_watch(cache->notify_fd, e->path, WATCH_MASK);
+	}
+#endif
+
+	return memory;
+}
+
+/*
+ * Looks for precompressed siblings of the file. This is done once
+ * when the file is loaded so that cache hits cost no system calls.
+ */
+static int load_variants(FileCacheEntry *e) {
+	int found = 0;
+	char *path = malloc(e->path_length + 8);
+
+	assert(path != NULL);
+
+	for (int i = 0; i < FILE_CACHE_VARIANTS; ++i) {
+		int length = sprintf(path, "%s%s", e->path, variant_types[i].suffix);
+
+		e->variants[i] = open_entry(path, length);
+
+		if (e->variants[i] != NULL) {
+			e->variants[i]->encoding = variant_types[i].encoding;
+			e->variants[i]->owner = e;
+			found = 1;
+		}
+	}
+
+	free(path);
+
+	return found;
+}
+
+static FileCacheEntry *load_entry(FileCache *cache, const char *path,
+	size_t path_length, unsigned int hash) {
+	FileCacheEntry *e = open_entry(path, path_length);
+
+	if (e == NULL) {
+		return NULL;
+	}
+
+	e->hash = hash;
+
+	int vary = cache->precompressed && load_variants(e);
+
+	e->headers = build_headers(e, NULL, vary);
+	e->memory = prepare_entry(cache, e);
+
+	for (int i = 0; i < FILE_CACHE_VARIANTS; ++i) {
+		FileCacheEntry *variant = e->variants[i];
+
+		if (variant != NULL) {
+			variant->headers = build_headers(variant, variant_types[i].name, 1);
+			e->memory += prepare_entry(cache, variant);
+		}
+	}
+
+	return e;
+}
+
+FileCache *newFileCache(size_t memory_budget, int max_entries) {
+	assert(max_entries > 0);
+
+	FileCache *cache = calloc(1, sizeof(FileCache));
+
+	assert(cache != NULL);
+
+	//Power of two so that we can mask the hash
+	cache->bucket_count = 1;
+	while (cache->bucket_count < 2 * max_entries) {
+		cache->bucket_count *= 2;
+	}
+
+	cache->buckets = calloc(cache->bucket_count, sizeof(FileCacheEntry*));
+	cache->watches = calloc(cache->bucket_count, sizeof(FileCacheEntry*));
+	cache->slots = calloc(max_entries, sizeof(FileCacheEntry*));
+	assert(cache->buckets != NULL && cache->watches != NULL && cache->slots != NULL);
+
+	cache->max_entries = max_entries;
+	cache->memory_budget = memory_budget;
+	cache->map_files = 1;
+	cache->precompressed = 1;
+	cache->notify_fd = -1;
+
+#ifdef __linux__
+	cache->notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (cache->notify_fd < 0) {
+		perror("inotify_init1() failed. Cached files will not be refreshed.");
+	}
+#endif
+
+	return cache;
+}
+
+void deleteFileCache(FileCache *cache) {
+	for (int i = 0; i < cache->max_entries; ++i) {
+		FileCacheEntry *e = cache->slots[i];
+
+		if (e != NULL) {
+			//Every entry must be released first
+			assert(e->refcount == 0);
+			remove_entry(cache, e);
+		}
+	}
+
+	if (cache->notify_fd >= 0) {
+		close(cache->notify_fd);
+	}
+
+	free(cache->slots);
+	free(cache->watches);
+	free(cache->buckets);
+	free(cache);
+}
+
+/*
+ * Returns the entry for path or NULL if the file can not be
+ * opened. A hit costs no system calls. The entry stays valid
+ * until it is released with fileCacheRelease().
+ */
+FileCacheEntry *fileCacheAcquire(FileCache *cache, const char *path, size_t path_length) {
+	unsigned int hash = hash_path(path, path_length);
+	FileCacheEntry *e = find_entry(cache, path, path_length, hash);
+
+	if (e != NULL) {
+		e->referenced = 1;
+		e->refcount += 1;
+
+		return e;
+	}
+
+	e = load_entry(cache, path, path_length, hash);
+
+	if (e == NULL) {
+		return NULL;
+	}
+
+	e->refcount = 1;
+	e->referenced = 1;
+
+	if (make_room(cache, e->memory) == 0) {
+		insert_entry(cache, e);
+	} else {
+		//Too big or everything is in use. Serve it uncached.
+		_trace("File not cached: %s", e->path);
+	}
+
+	return e;
+}
+
+void fileCacheRelease(FileCache *cache, FileCacheEntry *e) {
+	assert(e->refcount > 0);
+
+	e->refcount -= 1;
+
+	if (e->refcount == 0 && e->cached == 0) {
+		free_entry(cache, e);
+	}
+}
+
+/*
+ * Returns the most preferred precompressed variant the client
+ * accepts or the entry itself. The variant is valid as long as the
+ * entry is held.
+ */
+FileCacheEntry *fileCacheSelectVariant(FileCacheEntry *e, int accepted_encodings) {
+	for (int i = 0; i < FILE_CACHE_VARIANTS; ++i) {
+		if (e->variants[i] != NULL && (accepted_encodings & e->variants[i]->encoding)) {
+			return e->variants[i];
+		}
+	}
+
+	return e;
+}
+
+/*
+ * The descriptor becomes readable when a cached file changes.
+ * Call fileCacheProcessEvents() then. Returns -1 if change
+ * notification is not available.
+ */
+int fileCacheNotifyFd(FileCache *cache) {
+	return cache->notify_fd;
+}
+
+void fileCacheProcessEvents(FileCache *cache) {
+#ifdef __linux__
+	char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+	while (1) {
+		ssize_t length = read(cache->notify_fd, buffer, sizeof(buffer));
+
+		if (length <= 0) {
+			if (length < 0 && errno != EAGAIN) {
+				perror("Failed to read file change events.");
+			}
+
+			return;
+		}
+
+		for (char *p = buffer; p < buffer + length;) {
+			struct inotify_event *event = (struct inotify_event*) p;
+
+			FileCacheEntry *e;
+
+			//Paths to the same inode share the watch
+			while ((e = find_watch(cache, event->wd)) != NULL) {
+				if (e->owner != NULL) {
+					e = e->owner;
+				}
+
+				_trace("Cached file changed: %s", e->path);
+				remove_entry(cache, e);
+			}
+
+			p += sizeof(struct inotify_event) + event->len;
+		}
+	}
+#endif
+}
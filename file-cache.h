@@ -0,0 +1,72 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <stddef.h>
+#include <sys/stat.h>
+
+#define FILE_CACHE_VARIANTS 3
+
+typedef struct _FileCacheEntry {
+	char *path;
+	size_t path_length;
+	unsigned int hash;
+	int fd;
+	struct stat st;
+	//Pre-rendered headers. Content-Length comes first and the
+	//headers describing the entity start at entity_offset.
+	char *headers;
+	size_t headers_length;
+	size_t entity_offset;
+	//NULL if the file is not mapped
+	void *map;
+	//HTTP_ENCODING_* of a precompressed variant. 0 for the original.
+	int encoding;
+	//Precompressed siblings (.br, .zst, .gz) found on load
+	struct _FileCacheEntry *variants[FILE_CACHE_VARIANTS];
+	//Bytes charged against the cache's memory budget
+	size_t memory;
+	int watch;
+	//Entry whose variant this is. NULL for the entry itself.
+	struct _FileCacheEntry *owner;
+	//Next cached file with a watch in the same watches bucket
+	struct _FileCacheEntry *watch_next;
+	int refcount;
+	int referenced;
+	int cached;
+	int slot;
+	struct _FileCacheEntry *hash_next;
+} FileCacheEntry;
+
+/*
+ * Caches open files, their metadata and pre-built response
+ * headers keyed by path. Eviction uses the CLOCK algorithm.
+ * Entries in use are never evicted. Changes to cached files are
+ * picked up through inotify on Linux.
+ */
+typedef struct _FileCache {
+	FileCacheEntry **buckets;
+	int bucket_count;
+	//Cached files and variants by inotify watch. Same size as buckets.
+	FileCacheEntry **watches;
+	FileCacheEntry **slots;
+	int max_entries;
+	int entry_count;
+	int hand;
+	size_t memory_budget;
+	size_t memory_used;
+	//Set to 0 to skip mmap() of cached files
+	int map_files;
+	//Set to 0 to skip looking for precompressed siblings
+	int precompressed;
+	int notify_fd;
+} FileCache;
+
+FileCache *newFileCache(size_t memory_budget, int max_entries);
+void deleteFileCache(FileCache *cache);
+FileCacheEntry *fileCacheAcquire(FileCache *cache, const char *path, size_t path_length);
+void fileCacheRelease(FileCache *cache, FileCacheEntry *entry);
+FileCacheEntry *fileCacheSelectVariant(FileCacheEntry *entry, int accepted_encodings);
+int fileCacheNotifyFd(FileCache *cache);
+void fileCacheProcessEvents(FileCache *cache);
+
+#endif
@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "file-reader.h"
+
+static void free_reader(FileReader *reader) {
+	for (int i = 0; i < FILE_READER_BUFFERS; ++i) {
+		free(reader->chunks[i].buffer);
+	}
+
+	close(reader->fd);
+	free(reader);
+}
+
+//Worker thread
+static void read_chunk(void *arg) {
+	FileChunk *chunk = arg;
+
+	chunk->result = pread(chunk->reader->fd, chunk->buffer, chunk->length, chunk->offset);
+	chunk->error = errno;
+}
+
+static void deliver(FileReader *reader) {
+	FileChunk *chunk = reader->chunks + reader->current;
+
+	if (reader->delivered || reader->finished || chunk->state == CHUNK_LOADING) {
+		return;
+	}
+
+	reader->delivered = 1;
+
+	if (chunk->state == CHUNK_EMPTY) {
+		//Nothing left to load
+		reader->finished = 1;
+		reader->on_chunk(reader, NULL, 0);
+	} else if (chunk->result > 0) {
+		reader->on_chunk(reader, chunk->buffer, chunk->result);
+	} else {
+		//A read of 0 means the file has shrunk
+		reader->finished = 1;
+		errno = chunk->result < 0 ? chunk->error : EIO;
+		reader->on_chunk(reader, NULL, -1);
+	}
+}
+
+//Loop thread
+static void on_chunk_read(void *arg) {
+	FileChunk *chunk = arg;
+	FileReader *reader = chunk->reader;
+
+	chunk->state = CHUNK_READY;
+	reader->in_flight -= 1;
+
+	if (reader->deleted) {
+		if (reader->in_flight == 0) {
+			free_reader(reader);
+		}
+
+		return;
+	}
+
+	deliver(reader);
+}
+
+static void load_chunk(FileReader *reader, FileChunk *chunk) {
+	if (reader->next_offset >= reader->end) {
+		chunk->state = CHUNK_EMPTY;
+
+		return;
+	}
+
+	off_t remaining = reader->end - reader->next_offset;
+
+	chunk->offset = reader->next_offset;
+	chunk->length = remaining < (off_t) reader->chunk_size ?
+		(size_t) remaining : reader->chunk_size;
+	chunk->state = CHUNK_LOADING;
+	reader->next_offset += chunk->length;
+	reader->in_flight += 1;
+
+	workPoolSubmit(reader->pool, read_chunk, on_chunk_read, chunk);
+}
+
+/*
+ * Starts reading length bytes of fd at offset. All buffers start
+ * loading right away. on_chunk is never called from here. Returns
+ * NULL if the descriptor can not be duplicated.
+ */
+FileReader *newFileReader(WorkPool *pool, int fd, off_t offset, off_t length,
+	void (*on_chunk)(FileReader *reader, char *data, ssize_t length), void *data) {
+	FileReader *reader = calloc(1, sizeof(FileReader));
+
+	assert(reader != NULL);
+	assert(length > 0);
+
+	reader->fd = dup(fd);
+
+	if (reader->fd < 0) {
+		perror("Failed to duplicate file descriptor.");
+		free(reader);
+
+		return NULL;
+	}
+
+	reader->pool = pool;
+	reader->next_offset = offset;
+	reader->end = offset + length;
+	reader->chunk_size = FILE_READER_CHUNK_SIZE;
+	reader->on_chunk = on_chunk;
+	reader->data = data;
+
+	//The kernel reads ahead further for sequential access
+	posix_fadvise(reader->fd, offset, length, POSIX_FADV_SEQUENTIAL);
+
+	for (int i = 0; i < FILE_READER_BUFFERS; ++i) {
+		reader->chunks[i].reader = reader;
+		reader->chunks[i].buffer = malloc(reader->chunk_size);
+		assert(reader->chunks[i].buffer != NULL);
+	}
+	for (int i = 0; i < FILE_READER_BUFFERS; ++i) {
+		load_chunk(reader, reader->chunks + i);
+	}
+
+	return reader;
+}
+
+/*
+ * Can be called from on_chunk. Reads in progress finish in the
+ * background.
+ */
+void deleteFileReader(FileReader *reader) {
+	if (reader->in_flight > 0) {
+		reader->deleted = 1;
+
+		return;
+	}
+
+	free_reader(reader);
+}
+
+/*
+ * Hands back the current chunk. Its buffer starts loading the
+ * chunk after the ones already loading. The next chunk is
+ * delivered right away if it is ready.
+ */
+void fileReaderNext(FileReader *reader) {
+	assert(reader->delivered);
+	assert(!reader->finished);
+
+	FileChunk *chunk = reader->chunks + reader->current;
+
+	reader->current = (reader->current + 1) % FILE_READER_BUFFERS;
+	reader->delivered = 0;
+
+	load_chunk(reader, chunk);
+	deliver(reader);
+}
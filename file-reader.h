@@ -0,0 +1,61 @@
+#ifndef FILE_READER_H
+#define FILE_READER_H
+
+#include <sys/types.h>
+
+#include "work-pool.h"
+
+#define FILE_READER_CHUNK_SIZE 65536
+#define FILE_READER_BUFFERS 2
+
+typedef enum {
+	CHUNK_EMPTY,
+	CHUNK_LOADING,
+	CHUNK_READY
+} FileChunkState;
+
+typedef struct _FileChunk {
+	struct _FileReader *reader;
+	FileChunkState state;
+	off_t offset;
+	size_t length;
+	//Result of the read and errno if it failed
+	ssize_t result;
+	int error;
+	char *buffer;
+} FileChunk;
+
+/*
+ * Reads a range of a file in chunks on a WorkPool. While the
+ * consumer writes one chunk the next one is already being read.
+ * on_chunk gets each chunk in file order. The data stays valid
+ * until fileReaderNext() is called. The end of the range is
+ * reported with length 0 and a failed read with -1 and errno.
+ */
+typedef struct _FileReader {
+	WorkPool *pool;
+	//Our own copy. The caller may close theirs.
+	int fd;
+	//Offset of the next chunk to load
+	off_t next_offset;
+	off_t end;
+	size_t chunk_size;
+	FileChunk chunks[FILE_READER_BUFFERS];
+	//Chunk to be delivered next
+	int current;
+	//on_chunk was called for the current chunk
+	int delivered;
+	int finished;
+	int in_flight;
+	//Freed by the last read to complete
+	int deleted;
+	void (*on_chunk)(struct _FileReader *reader, char *data, ssize_t length);
+	void *data;
+} FileReader;
+
+FileReader *newFileReader(WorkPool *pool, int fd, off_t offset, off_t length,
+	void (*on_chunk)(FileReader *reader, char *data, ssize_t length), void *data);
+void deleteFileReader(FileReader *reader);
+void fileReaderNext(FileReader *reader);
+
+#endif
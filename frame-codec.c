@@ -0,0 +1,283 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include <errno.h>
+
+#include "frame-codec.h"
+
+FrameCodec *newFrameCodec(FrameFormat format) {
+	FrameCodec *codec = calloc(1, sizeof(FrameCodec));
+
+	assert(codec != NULL);
+
+	codec->format = format;
+	codec->max_frame = FRAME_MAX_DEFAULT;
+	codec->capacity = FRAME_BUFFER_SIZE;
+	codec->buffer = malloc(codec->capacity);
+
+	assert(codec->buffer != NULL);
+
+	return codec;
+}
+
+void deleteFrameCodec(FrameCodec *codec) {
+	free(codec->buffer);
+	free(codec);
+}
+
+/*
+ * Reads a length prefix. Returns its size in bytes, 0 if more data
+ * is needed and -1 if it is malformed.
+ */
+static int decode_prefix(FrameFormat format, const unsigned char *data, size_t length,
+	uint64_t *frame_length) {
+	switch (format) {
+	case FRAME_U16:
+		if (length < 2) {
+			return 0;
+		}
+
+		*frame_length = ((uint64_t) data[0] << 8) | data[1];
+
+		return 2;
+	case FRAME_U32:
+		if (length < 4) {
+			return 0;
+		}
+
+		*frame_length = ((uint64_t) data[0] << 24) | ((uint64_t) data[1] << 16) |
+			((uint64_t) data[2] << 8) | data[3];
+
+		return 4;
+	case FRAME_VARINT: {
+		uint64_t value = 0;
+
+		for (int i = 0; i < FRAME_VARINT_MAX; ++i) {
+			if ((size_t) i == length) {
+				return 0;
+			}
+
+			value |= (uint64_t) (data[i] & 0x7f) << (7 * i);
+
+			if ((data[i] & 0x80) == 0) {
+				*frame_length = value;
+
+				return i + 1;
+			}
+		}
+
+		return -1;
+	}
+	default:
+		assert(0);
+
+		return -1;
+	}
+}
+
+/*
+ * Finds up to max_frames complete frames in data. consumed is set to
+ * the bytes they take up including prefixes and delimiters. Returns
+ * the number found or -1 with errno set for a bad frame.
+ */
+int frameDecode(FrameFormat format, size_t max_frame, const char *data, size_t length,
+	FrameSlice *frames, int max_frames, size_t *consumed) {
+	size_t offset = 0;
+	int count = 0;
+
+	while (count < max_frames && offset < length) {
+		const char *start = data + offset;
+		size_t available = length - offset;
+
+		if (format == FRAME_LINE) {
+			const char *end = memchr(start, '\n', available);
+
+			if (end == NULL) {
+				if (available > max_frame) {
+					errno = EMSGSIZE;
+
+					return -1;
+				}
+
+				break;
+			}
+
+			frames[count].data = start;
+			frames[count].length = end - start;
+			offset += end - start + 1;
+		} else {
+			uint64_t frame_length;
+			int prefix = decode_prefix(format, (const unsigned char*) start,
+				available, &frame_length);
+
+			if (prefix < 0) {
+				errno = EPROTO;
+
+				return -1;
+			}
+			if (prefix > 0 && frame_length > max_frame) {
+				errno = EMSGSIZE;
+
+				return -1;
+			}
+			if (prefix == 0 || available - prefix < frame_length) {
+				break;
+			}
+
+			frames[count].data = start + prefix;
+			frames[count].length = frame_length;
+			offset += prefix + frame_length;
+		}
+
+		count += 1;
+	}
+
+	*consumed = offset;
+
+	return count;
+}
+
+/*
+ * Returns a buffer holding data with its prefix or delimiter ready
+ * for pumpQueueWrite() or pumpBroadcast().
+ */
+SharedBuffer *newFrame(FrameFormat format, const char *data, size_t length) {
+	unsigned char prefix[FRAME_VARINT_MAX];
+	size_t prefix_length = 0;
+
+	switch (format) {
+	case FRAME_U16:
+		assert(length <= 0xffff);
+		prefix[0] = length >> 8;
+		prefix[1] = length;
+		prefix_length = 2;
+		break;
+	case FRAME_U32:
+		assert(length <= 0xffffffffUL);
+		prefix[0] = length >> 24;
+		prefix[1] = length >> 16;
+		prefix[2] = length >> 8;
+		prefix[3] = length;
+		prefix_length = 4;
+		break;
+	case FRAME_VARINT: {
+		uint64_t value = length;
+
+		do {
+			prefix[prefix_length] = value & 0x7f;
+			value >>= 7;
+			if (value != 0) {
+				prefix[prefix_length] |= 0x80;
+			}
+			prefix_length += 1;
+		} while (value != 0);
+		break;
+	}
+	case FRAME_LINE:
+		assert(memchr(data, '\n', length) == NULL);
+		break;
+	}
+
+	size_t total = prefix_length + length + (format == FRAME_LINE ? 1 : 0);
+	SharedBuffer *buffer = newSharedBuffer(NULL, total);
+
+	memcpy(buffer->data, prefix, prefix_length);
+	memcpy(buffer->data + prefix_length, data, length);
+
+	if (format == FRAME_LINE) {
+		buffer->data[total - 1] = '\n';
+	}
+
+	return buffer;
+}
+
+static void close_codec(SocketRec *rec, int error) {
+	FrameCodec *codec = rec->codec;
+
+	rec->onReadable = NULL;
+
+	if (codec->onClosed != NULL) {
+		codec->onClosed(rec, error);
+	}
+}
+
+static void on_frame_readable(SocketRec *rec) {
+	FrameCodec *codec = rec->codec;
+
+	if (codec->length == codec->capacity) {
+		//A frame larger than the buffer. Frames are bounded by max_frame.
+		codec->capacity *= 2;
+		codec->buffer = realloc(codec->buffer, codec->capacity);
+		assert(codec->buffer != NULL);
+	}
+
+	ssize_t bytes_read = pumpRead(rec, codec->buffer + codec->length,
+		codec->capacity - codec->length);
+
+	if (bytes_read <= 0) {
+		if (bytes_read == 0) {
+			close_codec(rec, 0);
+		} else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			close_codec(rec, errno);
+		}
+
+		return;
+	}
+
+	codec->length += bytes_read;
+
+	size_t offset = 0;
+
+	while (rec->flag_for_delete == 0 && rec->onReadable == on_frame_readable) {
+		size_t consumed;
+		int count = frameDecode(codec->format, codec->max_frame,
+			codec->buffer + offset, codec->length - offset,
+			codec->frames, FRAME_BATCH_MAX, &consumed);
+
+		if (count < 0) {
+			close_codec(rec, errno);
+
+			return;
+		}
+		if (count == 0) {
+			break;
+		}
+
+		offset += consumed;
+
+		if (codec->onMessages != NULL) {
+			codec->onMessages(rec, codec->frames, count);
+		}
+	}
+
+	//Move the partial frame to the front
+	memmove(codec->buffer, codec->buffer + offset, codec->length - offset);
+	codec->length -= offset;
+}
+
+/*
+ * Decodes everything the socket reads with codec. Takes over
+ * onReadable. The codec is freed with the record.
+ */
+void pumpSetFrameCodec(SocketRec *rec, FrameCodec *codec) {
+	if (rec->codec != NULL && rec->codec != codec) {
+		deleteFrameCodec(rec->codec);
+	}
+
+	rec->codec = codec;
+	rec->onReadable = on_frame_readable;
+}
+
+/*
+ * Queues data as one frame in the format of the record's codec.
+ */
+void pumpSendFrame(SocketRec *rec, const char *data, size_t length) {
+	assert(rec->codec != NULL);
+
+	SharedBuffer *buffer = newFrame(rec->codec->format, data, length);
+
+	pumpQueueWrite(rec, buffer);
+	sharedBufferRelease(buffer);
+}
@@ -0,0 +1,64 @@
+#ifndef FRAME_CODEC_H
+#define FRAME_CODEC_H
+
+#include <sys/types.h>
+
+#include "event-pump.h"
+
+//Initial size of the read buffer. It grows to fit a large frame.
+#define FRAME_BUFFER_SIZE 16384
+//Most frames delivered by one onMessages call
+#define FRAME_BATCH_MAX 64
+#define FRAME_MAX_DEFAULT (16 * 1024 * 1024)
+//Longest varint length prefix
+#define FRAME_VARINT_MAX 10
+
+typedef enum {
+	//Big endian length prefix
+	FRAME_U16,
+	FRAME_U32,
+	//LEB128 length prefix as used by protobuf
+	FRAME_VARINT,
+	//Terminated by \n. The \n is not part of the frame.
+	FRAME_LINE
+} FrameFormat;
+
+//Points into the read buffer
+typedef struct _FrameSlice {
+	const char *data;
+	size_t length;
+} FrameSlice;
+
+/*
+ * Splits the byte stream of a SocketRec into frames. Each read is
+ * decoded in one pass and all complete frames are handed to
+ * onMessages in batches. The slices are valid until onMessages
+ * returns. Owned by the record once set with pumpSetFrameCodec().
+ */
+typedef struct _FrameCodec {
+	FrameFormat format;
+	//Larger frames are an error
+	size_t max_frame;
+	char *buffer;
+	size_t capacity;
+	size_t length;
+	FrameSlice frames[FRAME_BATCH_MAX];
+	void *data;
+
+	void (*onMessages)
+		(SocketRec *rec, FrameSlice *frames, int count);
+	//error is 0 at end of stream. EMSGSIZE or EPROTO for a bad
+	//frame, else the errno of the failed read.
+	void (*onClosed)
+		(SocketRec *rec, int error);
+} FrameCodec;
+
+FrameCodec *newFrameCodec(FrameFormat format);
+void deleteFrameCodec(FrameCodec *codec);
+int frameDecode(FrameFormat format, size_t max_frame, const char *data, size_t length,
+	FrameSlice *frames, int max_frames, size_t *consumed);
+SharedBuffer *newFrame(FrameFormat format, const char *data, size_t length);
+void pumpSetFrameCodec(SocketRec *rec, FrameCodec *codec);
+void pumpSendFrame(SocketRec *rec, const char *data, size_t length);
+
+#endif
@@ -0,0 +1,805 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <assert.h>
+
+#include "http-cache.h"
+
+#define INITIAL_BUCKETS 256
+
+//Not stored. These describe the upstream connection.
+static const char *hop_by_hop[] = {
+	"Connection",
+	"Keep-Alive",
+	"Proxy-Connection",
+	"Transfer-Encoding",
+	"TE",
+	"Trailer",
+	"Upgrade",
+	"Date",
+	"Content-Length"
+};
+
+static unsigned int hash_key(const char *key, size_t length) {
+	unsigned int hash = 2166136261u;
+
+	for (size_t i = 0; i < length; ++i) {
+		hash ^= (unsigned char) key[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+static HTTPCacheEntry **find_bucket(HTTPCache *cache, unsigned int hash) {
+	return cache->buckets + (hash & (cache->bucket_count - 1));
+}
+
+static HTTPCacheEntry *find_entry(HTTPCache *cache, const char *key, size_t length,
+	unsigned int hash) {
+	for (HTTPCacheEntry *e = *find_bucket(cache, hash); e != NULL; e = e->hash_next) {
+		if (e->hash == hash && e->key_length == length &&
+			memcmp(e->key, key, length) == 0) {
+			return e;
+		}
+	}
+
+	return NULL;
+}
+
+static void free_entry(HTTPCacheEntry *e) {
+	assert(e->refcount == 0 && !e->linked);
+
+	//Headers and body share one allocation
+	free(e->headers);
+	free(e->vary);
+	free(e->key);
+	free(e);
+}
+
+static void lru_remove(HTTPCache *cache, HTTPCacheEntry *e) {
+	HTTPCacheSegment *segment = cache->segments + e->segment;
+
+	if (e->lru_prev != NULL) {
+		e->lru_prev->lru_next = e->lru_next;
+	} else {
+		segment->head = e->lru_next;
+	}
+	if (e->lru_next != NULL) {
+		e->lru_next->lru_prev = e->lru_prev;
+	} else {
+		segment->tail = e->lru_prev;
+	}
+
+	segment->memory -= e->memory;
+	cache->memory_used -= e->memory;
+
+	e->lru_prev = e->lru_next = NULL;
+	e->segment = -1;
+}
+
+static void lru_push(HTTPCache *cache, HTTPCacheEntry *e, int index) {
+	HTTPCacheSegment *segment = cache->segments + index;
+
+	e->segment = index;
+	e->lru_prev = NULL;
+	e->lru_next = segment->head;
+
+	if (segment->head != NULL) {
+		segment->head->lru_prev = e;
+	} else {
+		segment->tail = e;
+	}
+
+	segment->head = e;
+	segment->memory += e->memory;
+	cache->memory_used += e->memory;
+}
+
+/*
+ * Records a hit. A second hit promotes an entry to the protected
+ * segment. Protected entries pushed out of its share go back to
+ * probation rather than out of the cache.
+ */
+static void touch(HTTPCache *cache, HTTPCacheEntry *e) {
+	HTTPCacheSegment *protected = cache->segments + HTTP_CACHE_PROTECTED;
+	size_t limit = cache->memory_budget / 100 * cache->protected_percent;
+
+	lru_remove(cache, e);
+	lru_push(cache, e, HTTP_CACHE_PROTECTED);
+
+	while (protected->memory > limit && protected->tail != e) {
+		HTTPCacheEntry *demoted = protected->tail;
+
+		lru_remove(cache, demoted);
+		lru_push(cache, demoted, HTTP_CACHE_PROBATION);
+	}
+}
+
+static void grow_table(HTTPCache *cache) {
+	unsigned int old_count = cache->bucket_count;
+	HTTPCacheEntry **old_buckets = cache->buckets;
+
+	cache->bucket_count *= 2;
+	cache->buckets = calloc(cache->bucket_count, sizeof(HTTPCacheEntry*));
+	assert(cache->buckets != NULL);
+
+	for (unsigned int i = 0; i < old_count; ++i) {
+		HTTPCacheEntry *e = old_buckets[i];
+
+		while (e != NULL) {
+			HTTPCacheEntry *next = e->hash_next;
+			HTTPCacheEntry **bucket = find_bucket(cache, e->hash);
+
+			e->hash_next = *bucket;
+			*bucket = e;
+
+			e = next;
+		}
+	}
+
+	free(old_buckets);
+}
+
+static void insert_bucket(HTTPCache *cache, HTTPCacheEntry *e) {
+	HTTPCacheEntry **bucket = find_bucket(cache, e->hash);
+
+	e->hash_next = *bucket;
+	*bucket = e;
+}
+
+static void remove_bucket(HTTPCache *cache, HTTPCacheEntry *e) {
+	HTTPCacheEntry **p = find_bucket(cache, e->hash);
+
+	while (*p != e) {
+		p = &(*p)->hash_next;
+	}
+
+	*p = e->hash_next;
+	e->hash_next = NULL;
+}
+
+//The table holds a reference to every linked entry
+static void link_entry(HTTPCache *cache, HTTPCacheEntry *e) {
+	if (cache->entry_count >= 2 * (int) cache->bucket_count) {
+		grow_table(cache);
+	}
+
+	insert_bucket(cache, e);
+
+	e->linked = 1;
+	e->refcount += 1;
+	cache->entry_count += 1;
+}
+
+static void unlink_entry(HTTPCache *cache, HTTPCacheEntry *e) {
+	assert(e->linked);
+
+	remove_bucket(cache, e);
+
+	if (e->segment >= 0) {
+		lru_remove(cache, e);
+	}
+
+	e->linked = 0;
+	cache->entry_count -= 1;
+
+	httpCacheRelease(cache, e);
+}
+
+static void make_room(HTTPCache *cache, size_t memory) {
+	while (cache->memory_used + memory > cache->memory_budget) {
+		HTTPCacheEntry *victim = cache->segments[HTTP_CACHE_PROBATION].tail;
+
+		if (victim == NULL) {
+			victim = cache->segments[HTTP_CACHE_PROTECTED].tail;
+		}
+		if (victim == NULL) {
+			break;
+		}
+
+		//Freed once readers release it
+		unlink_entry(cache, victim);
+	}
+}
+
+static HTTPCacheEntry *new_entry(const char *key, size_t length, unsigned int hash, int state) {
+	HTTPCacheEntry *e = calloc(1, sizeof(HTTPCacheEntry));
+
+	assert(e != NULL);
+
+	e->key = malloc(length);
+	assert(e->key != NULL);
+	memcpy(e->key, key, length);
+
+	e->key_length = length;
+	e->hash = hash;
+	e->state = state;
+	e->segment = -1;
+
+	return e;
+}
+
+/*
+ * Method and URL, then the value of every header named in vary, a
+ * list of names each ended by NUL. Returns the length or -1 if the
+ * key does not fit.
+ */
+static int build_key(char *key, HTTPRequest *req, const char *vary) {
+	int length = snprintf(key, HTTP_CACHE_KEY_SIZE, "%.*s %.*s",
+		(int) req->method.length, req->method.data,
+		(int) req->path.length, req->path.data);
+
+	if (length >= HTTP_CACHE_KEY_SIZE) {
+		return -1;
+	}
+
+	if (vary == NULL) {
+		return length;
+	}
+
+	for (const char *name = vary; *name != '\0'; name += strlen(name) + 1) {
+		HTTPString *value = httpFindHeader(req, name);
+
+		length += snprintf(key + length, HTTP_CACHE_KEY_SIZE - length, "\n%.*s",
+			value != NULL ? (int) value->length : 0,
+			value != NULL ? value->data : "");
+
+		if (length >= HTTP_CACHE_KEY_SIZE) {
+			return -1;
+		}
+	}
+
+	return length;
+}
+
+static int has_directive(HTTPString *value, const char *directive) {
+	size_t length = strlen(directive);
+	const char *p = value->data;
+	const char *end = value->data + value->length;
+
+	while (p < end) {
+		const char *comma = memchr(p, ',', end - p);
+
+		if (comma == NULL) {
+			comma = end;
+		}
+
+		HTTPString item = {p, comma - p};
+
+		httpStringTrim(&item);
+
+		if (item.length >= length && strncasecmp(item.data, directive, length) == 0 &&
+			(item.length == length || item.data[length] == '=')) {
+			return 1;
+		}
+
+		p = comma + 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Returns the freshness lifetime in seconds from a response
+ * Cache-Control value. Returns -1 if the response must not be stored
+ * in a shared cache.
+ */
+static long parse_max_age(HTTPString *value) {
+	long max_age = -1;
+	long s_maxage = -1;
+	const char *p = value->data;
+	const char *end = value->data + value->length;
+
+	if (has_directive(value, "no-store") || has_directive(value, "private") ||
+		has_directive(value, "no-cache")) {
+		return -1;
+	}
+
+	while (p < end) {
+		const char *comma = memchr(p, ',', end - p);
+
+		if (comma == NULL) {
+			comma = end;
+		}
+
+		HTTPString item = {p, comma - p};
+		long *target = NULL;
+		size_t skip = 0;
+
+		httpStringTrim(&item);
+
+		if (item.length > 8 && strncasecmp(item.data, "max-age=", 8) == 0) {
+			target = &max_age;
+			skip = 8;
+		} else if (item.length > 9 && strncasecmp(item.data, "s-maxage=", 9) == 0) {
+			target = &s_maxage;
+			skip = 9;
+		}
+
+		if (target != NULL) {
+			long seconds = 0;
+			size_t i;
+
+			for (i = skip; i < item.length && item.data[i] >= '0' &&
+				item.data[i] <= '9' && seconds < 100000000; ++i) {
+				seconds = seconds * 10 + (item.data[i] - '0');
+			}
+
+			if (i == item.length) {
+				*target = seconds;
+			}
+		}
+
+		p = comma + 1;
+	}
+
+	return s_maxage >= 0 ? s_maxage : max_age;
+}
+
+static int is_hop_by_hop(HTTPString *name) {
+	for (size_t i = 0; i < sizeof(hop_by_hop) / sizeof(hop_by_hop[0]); ++i) {
+		if (httpStringEqualsIgnoreCase(name, hop_by_hop[i])) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static int is_cacheable_status(int status) {
+	//Cacheable by default as per RFC 7231. 206 is left out
+	//since ranges are not cached.
+	return status == 200 || status == 204 || status == 301 ||
+		status == 404 || status == 405 || status == 501;
+}
+
+HTTPCache *newHTTPCache(size_t memory_budget) {
+	HTTPCache *cache = calloc(1, sizeof(HTTPCache));
+
+	assert(cache != NULL);
+
+	cache->bucket_count = INITIAL_BUCKETS;
+	cache->buckets = calloc(cache->bucket_count, sizeof(HTTPCacheEntry*));
+	assert(cache->buckets != NULL);
+
+	cache->memory_budget = memory_budget;
+	cache->protected_percent = 80;
+
+	return cache;
+}
+
+/*
+ * All references must have been released.
+ */
+void deleteHTTPCache(HTTPCache *cache) {
+	for (unsigned int i = 0; i < cache->bucket_count; ++i) {
+		while (cache->buckets[i] != NULL) {
+			HTTPCacheEntry *e = cache->buckets[i];
+
+			assert(e->refcount == 1);
+
+			unlink_entry(cache, e);
+		}
+	}
+
+	free(cache->buckets);
+	free(cache);
+}
+
+/*
+ * Looks up a GET request.
+ * HTTP_CACHE_HIT: entry holds a reference to a fresh response.
+ * HTTP_CACHE_MISS: the caller must fetch the response and pass it to
+ * httpCacheComplete(), or call httpCacheAbort(). entry holds a
+ * reference for the caller.
+ * HTTP_CACHE_WAIT: a fetch is in flight. The waiter will be called.
+ * req must stay valid until then.
+ * HTTP_CACHE_BYPASS: the request can not be served from the cache.
+ */
+int httpCacheLookup(HTTPCache *cache, HTTPRequest *req, HTTPCacheEntry **entry,
+	HTTPCacheWaiter *waiter) {
+	char key[HTTP_CACHE_KEY_SIZE];
+	HTTPString *control = httpFindHeader(req, "Cache-Control");
+
+	*entry = NULL;
+
+	if (!httpStringEquals(&req->method, "GET") ||
+		httpFindHeader(req, "Authorization") != NULL ||
+		(control != NULL && (has_directive(control, "no-store") ||
+			has_directive(control, "no-cache")))) {
+		return HTTP_CACHE_BYPASS;
+	}
+
+	int length = build_key(key, req, NULL);
+
+	if (length < 0) {
+		return HTTP_CACHE_BYPASS;
+	}
+
+	unsigned int hash = hash_key(key, length);
+	HTTPCacheEntry *e = find_entry(cache, key, length, hash);
+
+	if (e != NULL && e->state == HTTP_CACHE_VARY) {
+		touch(cache, e);
+
+		length = build_key(key, req, e->vary);
+		if (length < 0) {
+			return HTTP_CACHE_BYPASS;
+		}
+
+		hash = hash_key(key, length);
+		e = find_entry(cache, key, length, hash);
+	}
+
+	if (e != NULL && e->state == HTTP_CACHE_READY && e->expires <= time(NULL)) {
+		unlink_entry(cache, e);
+		e = NULL;
+	}
+
+	if (e != NULL && e->state == HTTP_CACHE_READY) {
+		touch(cache, e);
+
+		e->refcount += 1;
+		*entry = e;
+
+		return HTTP_CACHE_HIT;
+	}
+
+	if (e != NULL) {
+		if (waiter == NULL) {
+			return HTTP_CACHE_BYPASS;
+		}
+
+		//Keep arrival order
+		HTTPCacheWaiter **tail = &e->waiters;
+
+		while (*tail != NULL) {
+			tail = &(*tail)->next;
+		}
+
+		waiter->next = NULL;
+		waiter->request = req;
+		*tail = waiter;
+
+		return HTTP_CACHE_WAIT;
+	}
+
+	e = new_entry(key, length, hash, HTTP_CACHE_FETCHING);
+	link_entry(cache, e);
+
+	e->refcount += 1;
+	*entry = e;
+
+	return HTTP_CACHE_MISS;
+}
+
+/*
+ * Returns the names in a Vary value, each ended by NUL, with an empty
+ * name at the end.
+ */
+static char *parse_vary(HTTPString *vary, size_t *size) {
+	char *names = malloc(vary->length + 2);
+	size_t n = 0;
+	const char *p = vary->data;
+	const char *end = vary->data + vary->length;
+
+	assert(names != NULL);
+
+	while (p < end) {
+		const char *comma = memchr(p, ',', end - p);
+
+		if (comma == NULL) {
+			comma = end;
+		}
+
+		HTTPString name = {p, comma - p};
+
+		httpStringTrim(&name);
+
+		if (name.length > 0) {
+			memcpy(names + n, name.data, name.length);
+			n += name.length;
+			names[n++] = '\0';
+		}
+
+		p = comma + 1;
+	}
+
+	names[n++] = '\0';
+	*size = n;
+
+	return names;
+}
+
+/*
+ * Moves a response that varies on request headers from the plain
+ * URL key to one that includes those headers. The URL key then
+ * holds an entry listing the header names. Returns -1 and changes
+ * nothing if the request's key does not fit.
+ */
+static int apply_vary(HTTPCache *cache, HTTPCacheEntry *e, HTTPRequest *req,
+	const char *names, size_t names_size) {
+	char key[HTTP_CACHE_KEY_SIZE];
+	char variant[HTTP_CACHE_KEY_SIZE];
+	int length = build_key(key, req, NULL);
+	int variant_length = build_key(variant, req, names);
+
+	if (length < 0 || variant_length < 0) {
+		return -1;
+	}
+
+	unsigned int hash = hash_key(key, length);
+	HTTPCacheEntry *marker;
+
+	//Stays linked while it gets a new key
+	remove_bucket(cache, e);
+
+	marker = find_entry(cache, key, length, hash);
+
+	if (marker != NULL && marker->state != HTTP_CACHE_VARY) {
+		//Stored before the URL started to vary
+		unlink_entry(cache, marker);
+		marker = NULL;
+	}
+
+	if (marker == NULL) {
+		marker = new_entry(key, length, hash, HTTP_CACHE_VARY);
+		link_entry(cache, marker);
+	} else {
+		lru_remove(cache, marker);
+		free(marker->vary);
+	}
+
+	marker->vary = malloc(names_size);
+	assert(marker->vary != NULL);
+	memcpy(marker->vary, names, names_size);
+	marker->memory = sizeof(HTTPCacheEntry) + marker->key_length + names_size;
+	lru_push(cache, marker, HTTP_CACHE_PROBATION);
+
+	hash = hash_key(variant, variant_length);
+
+	HTTPCacheEntry *existing = find_entry(cache, variant, variant_length, hash);
+
+	if (existing != NULL) {
+		//An older copy of the same variant
+		unlink_entry(cache, existing);
+	}
+
+	free(e->key);
+	e->key = malloc(variant_length);
+	assert(e->key != NULL);
+	memcpy(e->key, variant, variant_length);
+	e->key_length = variant_length;
+	e->hash = hash;
+
+	insert_bucket(cache, e);
+
+	return 0;
+}
+
+/*
+ * Hands a response to a waiter that coalesced on the URL before the
+ * URL was known to vary. A waiter whose own headers select another
+ * variant looks up again. It may then wait for, or be asked to
+ * fetch, its own variant.
+ */
+static void wake_waiter(HTTPCache *cache, HTTPCacheEntry *e, HTTPCacheWaiter *waiter,
+	const char *names, const char *own_key, int own_length) {
+	if (names != NULL) {
+		char key[HTTP_CACHE_KEY_SIZE];
+		int length = build_key(key, waiter->request, names);
+
+		if (length < 0 || length != own_length || memcmp(key, own_key, length) != 0) {
+			HTTPCacheEntry *entry;
+			int result = httpCacheLookup(cache, waiter->request, &entry, waiter);
+
+			if (result != HTTP_CACHE_WAIT) {
+				waiter->result = result;
+				waiter->on_ready(waiter, entry);
+			}
+
+			return;
+		}
+	}
+
+	e->refcount += 1;
+	waiter->result = HTTP_CACHE_HIT;
+	waiter->on_ready(waiter, e);
+}
+
+/*
+ * Stores the response of a fetch started by a MISS and hands it to
+ * the waiters. head is the upstream status line and headers. The
+ * body must be complete (not chunked). Responses that can not be
+ * cached are still given to the waiters whose requests select the
+ * same variant. The others look up again. The caller keeps its
+ * reference.
+ */
+void httpCacheComplete(HTTPCache *cache, HTTPCacheEntry *e, HTTPRequest *req,
+	const char *head, size_t head_length, const char *body, size_t body_length) {
+	assert(e->state == HTTP_CACHE_FETCHING);
+
+	const char *end = head + head_length;
+	const char *p = memchr(head, '\n', head_length);
+	HTTPString vary = {NULL, 0};
+	long max_age = -1;
+	char content_length[64];
+	int content_length_size = snprintf(content_length, sizeof(content_length),
+		"Content-Length: %zu\r\n", body_length);
+
+	e->status = head_length > 12 && memcmp(head, "HTTP/1.", 7) == 0 ?
+		atoi(head + 9) : 502;
+
+	//Normalizing a line to CRLF can add a byte
+	size_t line_count = 1;
+
+	for (const char *q = p; q != NULL; q = memchr(q + 1, '\n', end - q - 1)) {
+		line_count += 1;
+	}
+
+	e->headers = malloc(head_length + line_count + content_length_size + body_length + 1);
+	assert(e->headers != NULL);
+	e->headers_length = 0;
+
+	while (p != NULL && ++p < end) {
+		const char *line_end = memchr(p, '\n', end - p);
+
+		if (line_end == NULL) {
+			line_end = end;
+		}
+
+		const char *colon = memchr(p, ':', line_end - p);
+
+		if (colon != NULL) {
+			HTTPString name = {p, colon - p};
+			HTTPString value = {colon + 1, line_end - colon - 1};
+
+			if (value.length > 0 && value.data[value.length - 1] == '\r') {
+				value.length -= 1;
+			}
+			httpStringTrim(&value);
+
+			if (httpStringEqualsIgnoreCase(&name, "Cache-Control")) {
+				max_age = parse_max_age(&value);
+			} else if (httpStringEqualsIgnoreCase(&name, "Vary")) {
+				vary = value;
+			}
+
+			if (!is_hop_by_hop(&name)) {
+				memcpy(e->headers + e->headers_length, p, line_end - p);
+				e->headers_length += line_end - p;
+				//Normalize to CRLF
+				if (e->headers[e->headers_length - 1] != '\r') {
+					e->headers[e->headers_length++] = '\r';
+				}
+				e->headers[e->headers_length++] = '\n';
+			}
+		}
+
+		p = line_end;
+	}
+
+	memcpy(e->headers + e->headers_length, content_length, content_length_size);
+	e->headers_length += content_length_size;
+
+	e->body = e->headers + e->headers_length;
+	e->body_length = body_length;
+	memcpy(e->body, body, body_length);
+
+	e->state = HTTP_CACHE_READY;
+	e->memory = sizeof(HTTPCacheEntry) + e->key_length + e->headers_length + body_length;
+
+	int cacheable = e->linked && max_age > 0 &&
+		is_cacheable_status(e->status) &&
+		e->memory <= cache->memory_budget &&
+		!(vary.length == 1 && vary.data[0] == '*');
+
+	char *names = NULL;
+	size_t names_size = 0;
+	char own_key[HTTP_CACHE_KEY_SIZE];
+	int own_length = -1;
+
+	if (vary.length > 0) {
+		names = parse_vary(&vary, &names_size);
+		own_length = build_key(own_key, req, names);
+	}
+
+	if (cacheable && names != NULL && apply_vary(cache, e, req, names, names_size) < 0) {
+		//Key too long to store
+		cacheable = 0;
+	}
+
+	if (cacheable) {
+		e->expires = time(NULL) + max_age;
+
+		make_room(cache, e->memory);
+		lru_push(cache, e, HTTP_CACHE_PROBATION);
+	} else if (e->linked) {
+		unlink_entry(cache, e);
+	}
+
+	HTTPCacheWaiter *waiter = e->waiters;
+
+	e->waiters = NULL;
+
+	while (waiter != NULL) {
+		HTTPCacheWaiter *next = waiter->next;
+
+		wake_waiter(cache, e, waiter, names, own_key, own_length);
+
+		waiter = next;
+	}
+
+	free(names);
+}
+
+/*
+ * The fetch failed. Waiters are called with HTTP_CACHE_FAILED and the
+ * caller's reference is released.
+ */
+void httpCacheAbort(HTTPCache *cache, HTTPCacheEntry *e) {
+	assert(e->state == HTTP_CACHE_FETCHING);
+
+	HTTPCacheWaiter *waiter = e->waiters;
+
+	e->waiters = NULL;
+
+	if (e->linked) {
+		unlink_entry(cache, e);
+	}
+
+	while (waiter != NULL) {
+		HTTPCacheWaiter *next = waiter->next;
+
+		waiter->result = HTTP_CACHE_FAILED;
+		waiter->on_ready(waiter, NULL);
+
+		waiter = next;
+	}
+
+	httpCacheRelease(cache, e);
+}
+
+void httpCacheRelease(HTTPCache *cache, HTTPCacheEntry *e) {
+	assert(e->refcount > 0);
+
+	e->refcount -= 1;
+
+	if (e->refcount == 0) {
+		free_entry(e);
+	}
+}
+
+/*
+ * Writes a cached response. The body is sent straight from the
+ * entry, so the caller must hold its reference until the write
+ * completes. iov must stay valid until then too. A response whose
+ * head can not be rendered is replaced by a 502.
+ */
+int httpCacheServe(HTTPConnection *conn, HTTPCacheEntry *e, struct iovec iov[2]) {
+	int length = httpBuildHeader(conn->header_buffer, sizeof(conn->header_buffer),
+		e->status, conn->keep_alive ? 0 : HTTP_HEADER_CLOSE,
+		e->headers, e->headers_length);
+
+	if (length < 0) {
+		static const char empty[] = "Content-Length: 0\r\n";
+
+		length = httpBuildHeader(conn->header_buffer, sizeof(conn->header_buffer),
+			502, conn->keep_alive ? 0 : HTTP_HEADER_CLOSE, empty, sizeof(empty) - 1);
+		assert(length > 0);
+
+		iov[0].iov_base = conn->header_buffer;
+		iov[0].iov_len = length;
+
+		return httpScheduleWriteV(conn, iov, 1);
+	}
+
+	iov[0].iov_base = conn->header_buffer;
+	iov[0].iov_len = length;
+	iov[1].iov_base = e->body;
+	iov[1].iov_len = e->body_length;
+
+	return httpScheduleWriteV(conn, iov, e->body_length > 0 ? 2 : 1);
+}
@@ -0,0 +1,111 @@
+#ifndef HTTP_CACHE_H
+#define HTTP_CACHE_H
+
+#include <stddef.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#include "http-server.h"
+
+#define HTTP_CACHE_KEY_SIZE 1024
+
+//Results of httpCacheLookup()
+#define HTTP_CACHE_HIT 0
+#define HTTP_CACHE_MISS 1
+#define HTTP_CACHE_WAIT 2
+#define HTTP_CACHE_BYPASS 3
+//Only given to waiters. The fetch they waited for failed.
+#define HTTP_CACHE_FAILED 4
+
+#define HTTP_CACHE_FETCHING 0
+#define HTTP_CACHE_READY 1
+//Lists the Vary headers of a URL. Never returned to callers.
+#define HTTP_CACHE_VARY 2
+
+#define HTTP_CACHE_PROBATION 0
+#define HTTP_CACHE_PROTECTED 1
+
+struct _HTTPCacheEntry;
+
+/*
+ * Waits for a fetch started by another request. Owned by the
+ * caller. on_ready gets the lookup result for the waiter's request
+ * in result and handles it like httpCacheLookup() would. HIT and MISS
+ * come with a reference to entry. BYPASS and FAILED have a NULL
+ * entry. A response that turns out to vary on headers the waiter's
+ * request does not share leads to MISS or BYPASS.
+ */
+typedef struct _HTTPCacheWaiter {
+	void *data;
+	void (*on_ready)(struct _HTTPCacheWaiter *waiter, struct _HTTPCacheEntry *entry);
+	//Set by httpCacheLookup(). Must stay valid while waiting.
+	HTTPRequest *request;
+	int result;
+	struct _HTTPCacheWaiter *next;
+} HTTPCacheWaiter;
+
+typedef struct _HTTPCacheEntry {
+	char *key;
+	size_t key_length;
+	unsigned int hash;
+	int state;
+	int status;
+	//Response headers without hop-by-hop ones. Ends with
+	//Content-Length.
+	char *headers;
+	size_t headers_length;
+	char *body;
+	size_t body_length;
+	//Names of the Vary headers, each NUL terminated, for
+	//HTTP_CACHE_VARY entries
+	char *vary;
+	time_t expires;
+	//Bytes charged against the budget
+	size_t memory;
+	int refcount;
+	//Reachable through the hash table
+	int linked;
+	int segment;
+	HTTPCacheWaiter *waiters;
+	struct _HTTPCacheEntry *hash_next;
+	struct _HTTPCacheEntry *lru_prev;
+	struct _HTTPCacheEntry *lru_next;
+} HTTPCacheEntry;
+
+typedef struct _HTTPCacheSegment {
+	HTTPCacheEntry *head;
+	HTTPCacheEntry *tail;
+	size_t memory;
+} HTTPCacheSegment;
+
+/*
+ * Caches upstream responses keyed by method, URL and the request
+ * headers named by Vary. Freshness comes from Cache-Control. Memory
+ * is bounded by a budget with segmented LRU eviction. New entries
+ * go to the probation segment and move to the protected segment on
+ * a second hit, so a scan of one-off URLs does not flush the hot
+ * set. Only one fetch per key is in flight at a time. Other
+ * requests for the key wait for it.
+ */
+typedef struct _HTTPCache {
+	HTTPCacheEntry **buckets;
+	unsigned int bucket_count;
+	int entry_count;
+	size_t memory_budget;
+	size_t memory_used;
+	//Share of the budget for the protected segment in percent
+	int protected_percent;
+	HTTPCacheSegment segments[2];
+} HTTPCache;
+
+HTTPCache *newHTTPCache(size_t memory_budget);
+void deleteHTTPCache(HTTPCache *cache);
+int httpCacheLookup(HTTPCache *cache, HTTPRequest *req, HTTPCacheEntry **entry,
+	HTTPCacheWaiter *waiter);
+void httpCacheComplete(HTTPCache *cache, HTTPCacheEntry *entry, HTTPRequest *req,
+	const char *head, size_t head_length, const char *body, size_t body_length);
+void httpCacheAbort(HTTPCache *cache, HTTPCacheEntry *entry);
+void httpCacheRelease(HTTPCache *cache, HTTPCacheEntry *entry);
+int httpCacheServe(HTTPConnection *conn, HTTPCacheEntry *entry, struct iovec iov[2]);
+
+#endif
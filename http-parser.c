@@ -0,0 +1,238 @@
+#include <string.h>
+#include <strings.h>
+#include <assert.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "http-parser.h"
+
+#define PARSER_METHOD 0
+#define PARSER_PATH 1
+#define PARSER_VERSION 2
+#define PARSER_REQUEST_LINE_LF 3
+#define PARSER_HEADER_START 4
+#define PARSER_HEADER_NAME 5
+#define PARSER_HEADER_VALUE 6
+#define PARSER_HEADER_LF 7
+#define PARSER_HEAD_END_LF 8
+#define PARSER_DONE 9
+
+int httpStringEquals(HTTPString *str, const char *value) {
+	size_t length = strlen(value);
+
+	return str->length == length && memcmp(str->data, value, length) == 0;
+}
+
+int httpStringEqualsIgnoreCase(HTTPString *str, const char *value) {
+	size_t length = strlen(value);
+
+	return str->length == length && strncasecmp(str->data, value, length) == 0;
+}
+
+/*
+ * Returns the first byte in [p, end) that is either the delimiter
+ * or a control character (CR, LF, TAB, DEL etc.). Returns end if
+ * there is no such byte. Never reads outside [p, end).
+ */
+static const char *scan_token(const char *p, const char *end, char delimiter) {
+#ifdef __SSE2__
+	const __m128i delim = _mm_set1_epi8(delimiter);
+	const __m128i ctrl_max = _mm_set1_epi8(0x1F);
+	const __m128i del = _mm_set1_epi8(0x7F);
+
+	while (end - p >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*) p);
+		//v <= 0x1F unsigned is the same as min(v, 0x1F) == v
+		__m128i ctrl = _mm_cmpeq_epi8(_mm_min_epu8(v, ctrl_max), v);
+		__m128i hit = _mm_or_si128(_mm_cmpeq_epi8(v, delim),
+			_mm_or_si128(ctrl, _mm_cmpeq_epi8(v, del)));
+		int mask = _mm_movemask_epi8(hit);
+
+		if (mask != 0) {
+			return p + __builtin_ctz(mask);
+		}
+
+		p += 16;
+	}
+#endif
+
+	for (; p < end; ++p) {
+		unsigned char c = *p;
+
+		if (c == (unsigned char) delimiter || c < 0x20 || c == 0x7F) {
+			return p;
+		}
+	}
+
+	return end;
+}
+
+static int valid_version(HTTPString *version) {
+	return version->length == 8 &&
+		memcmp(version->data, "HTTP/1.", 7) == 0 &&
+		version->data[7] >= '0' && version->data[7] <= '9';
+}
+
+static void set_string(HTTPString *str, const char *start, const char *end) {
+	str->data = start;
+	str->length = end - start;
+}
+
+void httpStringTrim(HTTPString *str) {
+	while (str->length > 0 &&
+		(str->data[0] == ' ' || str->data[0] == '\t')) {
+		str->data += 1;
+		str->length -= 1;
+	}
+	while (str->length > 0 &&
+		(str->data[str->length - 1] == ' ' || str->data[str->length - 1] == '\t')) {
+		str->length -= 1;
+	}
+}
+
+void httpParserInit(HTTPParser *parser) {
+	parser->state = PARSER_METHOD;
+	parser->position = 0;
+	parser->mark = 0;
+	parser->header_count = 0;
+	parser->head_length = 0;
+	parser->method.data = parser->path.data = parser->version.data = NULL;
+	parser->method.length = parser->path.length = parser->version.length = 0;
+}
+
+/*
+ * Parses length bytes of buffer. Returns HTTP_PARSE_DONE once the
+ * blank line ending the head has been seen. Returns
+ * HTTP_PARSE_INCOMPLETE if more data is needed.
+ */
+int httpParserExecute(HTTPParser *parser, const char *buffer, size_t length) {
+	assert(length >= parser->position);
+
+	const char *p = buffer + parser->position;
+	const char *end = buffer + length;
+	const char *q;
+
+	while (p < end && parser->state != PARSER_DONE) {
+		const char *mark = buffer + parser->mark;
+
+		switch (parser->state) {
+		case PARSER_METHOD:
+			q = scan_token(p, end, ' ');
+			if (q == end) {
+				p = end;
+				break;
+			}
+			if (*q != ' ' || q == mark) {
+				return HTTP_PARSE_ERROR;
+			}
+			set_string(&parser->method, mark, q);
+			p = q + 1;
+			parser->mark = p - buffer;
+			parser->state = PARSER_PATH;
+			break;
+		case PARSER_PATH:
+			q = scan_token(p, end, ' ');
+			if (q == end) {
+				p = end;
+				break;
+			}
+			if (*q != ' ' || q == mark) {
+				return HTTP_PARSE_ERROR;
+			}
+			set_string(&parser->path, mark, q);
+			p = q + 1;
+			parser->mark = p - buffer;
+			parser->state = PARSER_VERSION;
+			break;
+		case PARSER_VERSION:
+			q = scan_token(p, end, '\r');
+			if (q == end) {
+				p = end;
+				break;
+			}
+			set_string(&parser->version, mark, q);
+			if (*q != '\r' || !valid_version(&parser->version)) {
+				return HTTP_PARSE_ERROR;
+			}
+			p = q + 1;
+			parser->state = PARSER_REQUEST_LINE_LF;
+			break;
+		case PARSER_REQUEST_LINE_LF:
+		case PARSER_HEADER_LF:
+			if (*p != '\n') {
+				return HTTP_PARSE_ERROR;
+			}
+			if (parser->state == PARSER_HEADER_LF) {
+				parser->header_count += 1;
+			}
+			p += 1;
+			parser->state = PARSER_HEADER_START;
+			break;
+		case PARSER_HEADER_START:
+			if (*p == '\r') {
+				p += 1;
+				parser->state = PARSER_HEAD_END_LF;
+				break;
+			}
+			//Obsolete line folding is not supported
+			if (*p == ' ' || *p == '\t') {
+				return HTTP_PARSE_ERROR;
+			}
+			if (parser->header_count == HTTP_PARSER_MAX_HEADERS) {
+				return HTTP_PARSE_TOO_MANY_HEADERS;
+			}
+			parser->mark = p - buffer;
+			parser->state = PARSER_HEADER_NAME;
+			break;
+		case PARSER_HEADER_NAME:
+			q = scan_token(p, end, ':');
+			if (q == end) {
+				p = end;
+				break;
+			}
+			if (*q != ':' || q == mark || q[-1] == ' ') {
+				return HTTP_PARSE_ERROR;
+			}
+			set_string(&parser->headers[parser->header_count].name, mark, q);
+			p = q + 1;
+			parser->mark = p - buffer;
+			parser->state = PARSER_HEADER_VALUE;
+			break;
+		case PARSER_HEADER_VALUE:
+			q = scan_token(p, end, '\r');
+			if (q == end) {
+				p = end;
+				break;
+			}
+			if (*q == '\t') {
+				//Tabs are allowed in values
+				p = q + 1;
+				break;
+			}
+			if (*q != '\r') {
+				return HTTP_PARSE_ERROR;
+			}
+			HTTPString *value = &parser->headers[parser->header_count].value;
+			set_string(value, mark, q);
+			httpStringTrim(value);
+			p = q + 1;
+			parser->state = PARSER_HEADER_LF;
+			break;
+		case PARSER_HEAD_END_LF:
+			if (*p != '\n') {
+				return HTTP_PARSE_ERROR;
+			}
+			p += 1;
+			parser->head_length = p - buffer;
+			parser->state = PARSER_DONE;
+			break;
+		}
+	}
+
+	parser->position = p - buffer;
+
+	return parser->state == PARSER_DONE ?
+		HTTP_PARSE_DONE : HTTP_PARSE_INCOMPLETE;
+}
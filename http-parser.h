@@ -0,0 +1,56 @@
+#ifndef HTTP_PARSER_H
+#define HTTP_PARSER_H
+
+#include <stddef.h>
+
+#define HTTP_PARSER_MAX_HEADERS 32
+
+#define HTTP_PARSE_INCOMPLETE 0
+#define HTTP_PARSE_DONE 1
+#define HTTP_PARSE_ERROR -1
+#define HTTP_PARSE_TOO_MANY_HEADERS -2
+
+/*
+ * A slice of the receive buffer. Not NUL terminated.
+ */
+typedef struct _HTTPString {
+	const char *data;
+	size_t length;
+} HTTPString;
+
+typedef struct _HTTPHeader {
+	HTTPString name;
+	HTTPString value;
+} HTTPHeader;
+
+/*
+ * Incremental request head parser. Call httpParserExecute() every
+ * time more data is appended to the receive buffer. The buffer
+ * must keep its address and previously parsed bytes between calls.
+ * Parsing resumes where the last call stopped so every byte is
+ * scanned only once. Nothing is copied. All parsed fields point
+ * into the receive buffer.
+ */
+typedef struct _HTTPParser {
+	int state;
+	//Bytes of the buffer scanned so far
+	size_t position;
+	//Start of the token being parsed
+	size_t mark;
+
+	HTTPString method;
+	HTTPString path;
+	HTTPString version;
+	HTTPHeader headers[HTTP_PARSER_MAX_HEADERS];
+	int header_count;
+	//Length of the request line and headers including the blank line
+	size_t head_length;
+} HTTPParser;
+
+void httpParserInit(HTTPParser *parser);
+int httpParserExecute(HTTPParser *parser, const char *buffer, size_t length);
+int httpStringEquals(HTTPString *str, const char *value);
+int httpStringEqualsIgnoreCase(HTTPString *str, const char *value);
+void httpStringTrim(HTTPString *str);
+
+#endif
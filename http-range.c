@@ -0,0 +1,228 @@
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include <assert.h>
+
+#include "http-range.h"
+
+#define BOUNDARY "sockf_byteranges"
+
+static const char trailer[] = "\r\n--" BOUNDARY "--\r\n";
+
+static int parse_offset(const char *p, const char *end, off_t *value) {
+	long long result = 0;
+
+	if (p == end) {
+		return -1;
+	}
+
+	for (; p < end; ++p) {
+		if (*p < '0' || *p > '9') {
+			return -1;
+		}
+		if (result > (LLONG_MAX - 9) / 10) {
+			return -1;
+		}
+
+		result = result * 10 + (*p - '0');
+	}
+
+	*value = result;
+
+	return 0;
+}
+
+/*
+ * Parses a Range header value for a file of the given size.
+ * Returns the number of satisfiable ranges. Returns 0 if the header
+ * should be ignored (bad syntax, unknown unit or too many ranges)
+ * and -1 if no range can be satisfied.
+ */
+int httpParseRange(HTTPString *value, off_t size, HTTPRange *ranges, int max_ranges) {
+	HTTPString spec = *value;
+
+	httpStringTrim(&spec);
+
+	if (spec.length < 6 || strncasecmp(spec.data, "bytes=", 6) != 0) {
+		return 0;
+	}
+
+	const char *p = spec.data + 6;
+	const char *end = spec.data + spec.length;
+	int count = 0;
+	int seen = 0;
+
+	while (p < end) {
+		const char *comma = memchr(p, ',', end - p);
+
+		if (comma == NULL) {
+			comma = end;
+		}
+
+		HTTPString item = {p, comma - p};
+
+		httpStringTrim(&item);
+		p = comma + 1;
+
+		if (item.length == 0) {
+			continue;
+		}
+
+		seen += 1;
+
+		const char *item_end = item.data + item.length;
+		const char *dash = memchr(item.data, '-', item.length);
+		off_t first, last;
+
+		if (dash == NULL) {
+			return 0;
+		}
+
+		if (dash == item.data) {
+			//Suffix range: the last N bytes
+			if (parse_offset(dash + 1, item_end, &last) < 0) {
+				return 0;
+			}
+			if (last == 0 || size == 0) {
+				continue;
+			}
+
+			first = last >= size ? 0 : size - last;
+			last = size - 1;
+		} else {
+			if (parse_offset(item.data, dash, &first) < 0) {
+				return 0;
+			}
+
+			if (dash + 1 == item_end) {
+				last = size - 1;
+			} else if (parse_offset(dash + 1, item_end, &last) < 0 || last < first) {
+				return 0;
+			}
+
+			if (first >= size) {
+				continue;
+			}
+			if (last >= size) {
+				last = size - 1;
+			}
+		}
+
+		if (count == max_ranges) {
+			//Too many ranges. Serve the whole file.
+			return 0;
+		}
+
+		ranges[count].start = first;
+		ranges[count].length = last - first + 1;
+		count += 1;
+	}
+
+	if (seen == 0) {
+		return 0;
+	}
+
+	return count > 0 ? count : -1;
+}
+
+static void add_segment(HTTPRangeResponse *resp, const char *data, off_t offset, size_t length) {
+	assert(resp->segment_count < HTTP_MAX_SEGMENTS);
+
+	HTTPSegment *segment = resp->segments + resp->segment_count;
+
+	segment->data = data;
+	segment->offset = offset;
+	segment->length = length;
+
+	resp->segment_count += 1;
+}
+
+/*
+ * Works out the status, headers and body segments of the response
+ * to a GET for a file of the given size. headers is the pre-rendered
+ * header block of the whole file. It starts with the Content-Length
+ * line and the entity headers (Last-Modified etc.) start at
+ * entity_offset. Returns the status code.
+ */
+int httpPrepareRangeResponse(HTTPRangeResponse *resp, HTTPRequest *req, off_t size,
+	const char *headers, size_t headers_length, size_t entity_offset) {
+	HTTPRange ranges[HTTP_MAX_RANGES];
+	HTTPString *value = httpFindHeader(req, "Range");
+	int count = 0;
+	int length = 0;
+
+	//We do not validate If-Range. Such requests get the whole file.
+	if (value != NULL && httpFindHeader(req, "If-Range") == NULL &&
+		httpStringEquals(&req->method, "GET")) {
+		count = httpParseRange(value, size, ranges, HTTP_MAX_RANGES);
+	}
+
+	resp->segment_count = 0;
+
+	if (count == 0) {
+		resp->status = 200;
+		resp->headers = headers;
+		resp->headers_length = headers_length;
+
+		if (size > 0) {
+			add_segment(resp, NULL, 0, size);
+		}
+
+		return resp->status;
+	}
+
+	if (count < 0) {
+		resp->status = 416;
+		resp->headers = resp->header_buffer;
+		resp->headers_length = snprintf(resp->header_buffer, sizeof(resp->header_buffer),
+			"Content-Range: bytes */%lld\r\nContent-Length: 0\r\n",
+			(long long) size);
+
+		return resp->status;
+	}
+
+	resp->status = 206;
+
+	if (count == 1) {
+		length = snprintf(resp->header_buffer, sizeof(resp->header_buffer),
+			"Content-Range: bytes %lld-%lld/%lld\r\nContent-Length: %lld\r\n",
+			(long long) ranges[0].start,
+			(long long) (ranges[0].start + ranges[0].length - 1),
+			(long long) size, (long long) ranges[0].length);
+
+		add_segment(resp, NULL, ranges[0].start, ranges[0].length);
+	} else {
+		off_t content_length = 0;
+
+		for (int i = 0; i < count; ++i) {
+			int part_length = snprintf(resp->part_headers[i], HTTP_PART_HEADER_SIZE,
+				"\r\n--" BOUNDARY "\r\nContent-Range: bytes %lld-%lld/%lld\r\n\r\n",
+				(long long) ranges[i].start,
+				(long long) (ranges[i].start + ranges[i].length - 1),
+				(long long) size);
+
+			add_segment(resp, resp->part_headers[i], 0, part_length);
+			add_segment(resp, NULL, ranges[i].start, ranges[i].length);
+			content_length += part_length + ranges[i].length;
+		}
+
+		add_segment(resp, trailer, 0, sizeof(trailer) - 1);
+		content_length += sizeof(trailer) - 1;
+
+		length = snprintf(resp->header_buffer, sizeof(resp->header_buffer),
+			"Content-Type: multipart/byteranges; boundary=" BOUNDARY "\r\n"
+			"Content-Length: %lld\r\n", (long long) content_length);
+	}
+
+	//Keep Last-Modified, Content-Encoding etc.
+	size_t entity_length = headers_length - entity_offset;
+
+	assert(length + entity_length <= sizeof(resp->header_buffer));
+
+	memcpy(resp->header_buffer + length, headers + entity_offset, entity_length);
+	resp->headers = resp->header_buffer;
+	resp->headers_length = length + entity_length;
+
+	return resp->status;
+}
@@ -0,0 +1,47 @@
+#ifndef HTTP_RANGE_H
+#define HTTP_RANGE_H
+
+#include <sys/types.h>
+
+#include "http-server.h"
+
+#define HTTP_MAX_RANGES 8
+//A part header per range, a file segment per range and the trailer
+#define HTTP_MAX_SEGMENTS (2 * HTTP_MAX_RANGES + 1)
+#define HTTP_PART_HEADER_SIZE 128
+
+typedef struct _HTTPRange {
+	off_t start;
+	off_t length;
+} HTTPRange;
+
+/*
+ * A piece of the response body. Either in memory (data is not
+ * NULL) or a range of the file being served.
+ */
+typedef struct _HTTPSegment {
+	const char *data;
+	off_t offset;
+	size_t length;
+} HTTPSegment;
+
+/*
+ * Describes the response to a possibly ranged request for a file.
+ * File data is never copied. Multipart bodies are a list of
+ * segments to be written with scatter-gather I/O or one by one.
+ */
+typedef struct _HTTPRangeResponse {
+	int status;
+	const char *headers;
+	size_t headers_length;
+	HTTPSegment segments[HTTP_MAX_SEGMENTS];
+	int segment_count;
+	char header_buffer[HTTP_HEADER_BUFFER_SIZE];
+	char part_headers[HTTP_MAX_RANGES][HTTP_PART_HEADER_SIZE];
+} HTTPRangeResponse;
+
+int httpParseRange(HTTPString *value, off_t size, HTTPRange *ranges, int max_ranges);
+int httpPrepareRangeResponse(HTTPRangeResponse *resp, HTTPRequest *req, off_t size,
+	const char *headers, size_t headers_length, size_t entity_offset);
+
+#endif
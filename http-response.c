@@ -0,0 +1,125 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "http-response.h"
+
+#define STATUS(code, text) {code, "HTTP/1.1 " #code " " text "\r\n", \
+	sizeof("HTTP/1.1 " #code " " text "\r\n") - 1}
+
+typedef struct {
+	int code;
+	const char *line;
+	size_t length;
+} StatusLine;
+
+//Pre-rendered status lines
+static const StatusLine status_lines[] = {
+	STATUS(200, "OK"),
+	STATUS(204, "No Content"),
+	STATUS(206, "Partial Content"),
+	STATUS(301, "Moved Permanently"),
+	STATUS(302, "Found"),
+	STATUS(304, "Not Modified"),
+	STATUS(400, "Bad Request"),
+	STATUS(403, "Forbidden"),
+	STATUS(404, "Not Found"),
+	STATUS(405, "Method Not Allowed"),
+	STATUS(413, "Request Entity Too Large"),
+	STATUS(416, "Range Not Satisfiable"),
+	STATUS(500, "Internal Server Error"),
+	STATUS(501, "Not Implemented"),
+	STATUS(502, "Bad Gateway"),
+	STATUS(503, "Service Unavailable"),
+	STATUS(504, "Gateway Timeout")
+};
+
+static const char connection_close[] = "Connection: close\r\n";
+static const char transfer_chunked[] = "Transfer-Encoding: chunked\r\n";
+
+/*
+ * The Date header shared by all responses. It is rendered at
+ * most once per second.
+ */
+static time_t date_time = 0;
+static char date_header[] = "Date: Thu, 01 Jan 1970 00:00:00 GMT\r\n";
+
+static const StatusLine *find_status(int status) {
+	for (size_t i = 0; i < sizeof(status_lines) / sizeof(status_lines[0]); ++i) {
+		if (status_lines[i].code == status) {
+			return status_lines + i;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Writes an RFC 7231 date. The buffer must have room for
+ * HTTP_DATE_LENGTH + 1 bytes.
+ */
+void httpFormatDate(time_t t, char *buffer) {
+	struct tm tm;
+
+	gmtime_r(&t, &tm);
+	strftime(buffer, HTTP_DATE_LENGTH + 1, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+static void refresh_date() {
+	//time() does not enter the kernel on Linux
+	time_t now = time(NULL);
+
+	if (now != date_time) {
+		date_time = now;
+		httpFormatDate(now, date_header + 6);
+		//Undo the NUL written by strftime()
+		date_header[6 + HTTP_DATE_LENGTH] = '\r';
+	}
+}
+
+static char *append(char *p, const char *str, size_t length) {
+	memcpy(p, str, length);
+
+	return p + length;
+}
+
+/*
+ * Assembles a response head from the cached status line, the
+ * shared Date header and the caller's pre-rendered headers.
+ * Connection and Transfer-Encoding headers are added as per flags.
+ * Nothing is formatted here. Returns the length of the head or -1
+ * if the status is unknown or the buffer is too small.
+ */
+int httpBuildHeader(char *buffer, size_t size, int status, int flags,
+	const char *headers, size_t headers_length) {
+	const StatusLine *status_line = find_status(status);
+
+	if (status_line == NULL) {
+		return -1;
+	}
+
+	refresh_date();
+
+	size_t date_length = sizeof(date_header) - 1;
+	size_t close_length = (flags & HTTP_HEADER_CLOSE) ?
+		sizeof(connection_close) - 1 : 0;
+	size_t chunked_length = (flags & HTTP_HEADER_CHUNKED) ?
+		sizeof(transfer_chunked) - 1 : 0;
+	size_t length = status_line->length + date_length +
+		headers_length + close_length + chunked_length + 2;
+
+	if (length > size) {
+		return -1;
+	}
+
+	char *p = buffer;
+
+	p = append(p, status_line->line, status_line->length);
+	p = append(p, date_header, date_length);
+	p = append(p, headers, headers_length);
+	p = append(p, transfer_chunked, chunked_length);
+	p = append(p, connection_close, close_length);
+	p = append(p, "\r\n", 2);
+
+	return p - buffer;
+}
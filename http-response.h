@@ -0,0 +1,23 @@
+#ifndef HTTP_RESPONSE_H
+#define HTTP_RESPONSE_H
+
+#include <stddef.h>
+#include <time.h>
+
+#define HTTP_HEADER_BUFFER_SIZE 1024
+#define HTTP_DATE_LENGTH 29
+
+//Flags for httpBuildHeader()
+#define HTTP_HEADER_CLOSE 1
+#define HTTP_HEADER_CHUNKED 2
+
+//Content codings in order of preference
+#define HTTP_ENCODING_BR 1
+#define HTTP_ENCODING_ZSTD 2
+#define HTTP_ENCODING_GZIP 4
+
+void httpFormatDate(time_t t, char *buffer);
+int httpBuildHeader(char *buffer, size_t size, int status, int flags,
+	const char *headers, size_t headers_length);
+
+#endif
@@ -0,0 +1,595 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+
+#include "http-router.h"
+
+//Largest perfect hash table tried, as a multiple of the key count
+#define MAX_TABLE_FACTOR 64
+
+typedef struct _RouteNode {
+	char *prefix;
+	size_t prefix_length;
+	//First byte of every static child
+	char *indices;
+	struct _RouteNode **children;
+	int child_count;
+	//Matches one path segment
+	struct _RouteNode *param_child;
+	//Matches the rest of the path
+	struct _RouteNode *wildcard_child;
+	HTTPRoute *routes;
+	//Already in the exact route table
+	int exact;
+} RouteNode;
+
+static RouteNode *new_node(const char *prefix, size_t length) {
+	RouteNode *node = calloc(1, sizeof(RouteNode));
+
+	assert(node != NULL);
+
+	node->prefix = malloc(length + 1);
+	assert(node->prefix != NULL);
+	memcpy(node->prefix, prefix, length);
+	node->prefix[length] = '\0';
+	node->prefix_length = length;
+
+	return node;
+}
+
+static void free_node(RouteNode *node) {
+	if (node == NULL) {
+		return;
+	}
+
+	for (int i = 0; i < node->child_count; ++i) {
+		free_node(node->children[i]);
+	}
+
+	free_node(node->param_child);
+	free_node(node->wildcard_child);
+
+	HTTPRoute *route = node->routes;
+
+	while (route != NULL) {
+		HTTPRoute *next = route->next;
+
+		free(route->method);
+		free(route->pattern);
+		free(route);
+
+		route = next;
+	}
+
+	free(node->indices);
+	free(node->children);
+	free(node->prefix);
+	free(node);
+}
+
+static int find_child(RouteNode *node, char c) {
+	if (node->child_count == 0) {
+		return -1;
+	}
+
+	char *index = memchr(node->indices, c, node->child_count);
+
+	return index == NULL ? -1 : index - node->indices;
+}
+
+static void add_child(RouteNode *node, RouteNode *child) {
+	node->indices = realloc(node->indices, node->child_count + 1);
+	node->children = realloc(node->children, (node->child_count + 1) * sizeof(RouteNode*));
+	assert(node->indices != NULL && node->children != NULL);
+
+	node->indices[node->child_count] = child->prefix[0];
+	node->children[node->child_count] = child;
+	node->child_count += 1;
+}
+
+/*
+ * Adds a run of literal characters below node. Edges are split
+ * where the new text differs from an existing prefix. Returns the
+ * node where the text ends.
+ */
+static RouteNode *insert_static(RouteNode *node, const char *text, size_t length) {
+	while (length > 0) {
+		int index = find_child(node, text[0]);
+
+		if (index < 0) {
+			RouteNode *child = new_node(text, length);
+
+			add_child(node, child);
+
+			return child;
+		}
+
+		RouteNode *child = node->children[index];
+		size_t common = 0;
+
+		while (common < length && common < child->prefix_length &&
+			text[common] == child->prefix[common]) {
+			++common;
+		}
+
+		if (common < child->prefix_length) {
+			RouteNode *split = new_node(child->prefix, common);
+
+			child->prefix_length -= common;
+			memmove(child->prefix, child->prefix + common, child->prefix_length + 1);
+			add_child(split, child);
+			node->children[index] = split;
+
+			child = split;
+		}
+
+		node = child;
+		text += common;
+		length -= common;
+	}
+
+	return node;
+}
+
+static int is_param_start(const char *p) {
+	//Only special at the start of a segment
+	return (*p == ':' || *p == '*') && p[-1] == '/';
+}
+
+HTTPRouter *newHTTPRouter() {
+	HTTPRouter *router = calloc(1, sizeof(HTTPRouter));
+
+	assert(router != NULL);
+
+	router->root = new_node("", 0);
+
+	return router;
+}
+
+void deleteHTTPRouter(HTTPRouter *router) {
+	free_node(router->root);
+	free(router->exact);
+	free(router->table);
+	free(router->displacements);
+	free(router);
+}
+
+/*
+ * Registers a handler. method can be NULL to match any method.
+ * Routes are matched in this order: literal text, :param, *wildcard.
+ */
+void httpRouterAdd(HTTPRouter *router, const char *method, const char *pattern,
+	HTTPRouteHandler handler, void *data) {
+	assert(pattern[0] == '/');
+
+	HTTPRoute *route = calloc(1, sizeof(HTTPRoute));
+
+	assert(route != NULL);
+
+	route->method = method != NULL ? strdup(method) : NULL;
+	route->pattern = strdup(pattern);
+	route->handler = handler;
+	route->data = data;
+
+	RouteNode *node = router->root;
+	const char *p = route->pattern;
+
+	while (*p != '\0') {
+		if (is_param_start(p)) {
+			char kind = *p;
+			const char *name = p + 1;
+			const char *end = strchr(name, '/');
+
+			if (end == NULL) {
+				end = name + strlen(name);
+			}
+
+			assert(route->param_count < HTTP_ROUTER_MAX_PARAMS);
+
+			route->param_names[route->param_count].data = name;
+			route->param_names[route->param_count].length = end - name;
+			route->param_count += 1;
+
+			if (kind == ':') {
+				if (node->param_child == NULL) {
+					node->param_child = new_node("", 0);
+				}
+
+				node = node->param_child;
+			} else {
+				//Wildcard must be the last segment
+				assert(*end == '\0');
+
+				if (node->wildcard_child == NULL) {
+					node->wildcard_child = new_node("", 0);
+				}
+
+				node = node->wildcard_child;
+			}
+
+			p = end;
+
+			continue;
+		}
+
+		const char *end = p + 1;
+
+		while (*end != '\0' && !is_param_start(end)) {
+			++end;
+		}
+
+		node = insert_static(node, p, end - p);
+		p = end;
+	}
+
+	//Keep registration order
+	HTTPRoute **tail = &node->routes;
+
+	while (*tail != NULL) {
+		tail = &(*tail)->next;
+	}
+
+	*tail = route;
+
+	if (route->param_count == 0 && !node->exact) {
+		if (router->exact_count == router->exact_capacity) {
+			router->exact_capacity = router->exact_capacity == 0 ?
+				16 : 2 * router->exact_capacity;
+			router->exact = realloc(router->exact,
+				router->exact_capacity * sizeof(ExactRoute));
+			assert(router->exact != NULL);
+		}
+
+		ExactRoute *exact = router->exact + router->exact_count;
+
+		exact->path = route->pattern;
+		exact->path_length = strlen(route->pattern);
+		exact->node = node;
+		node->exact = 1;
+
+		router->exact_count += 1;
+	}
+
+	router->compiled = 0;
+}
+
+static uint64_t hash_path(const char *path, size_t length) {
+	//FNV-1a followed by a mix so that all bits are usable
+	uint64_t hash = 14695981039346656037ull;
+
+	for (size_t i = 0; i < length; ++i) {
+		hash ^= (unsigned char) path[i];
+		hash *= 1099511628211ull;
+	}
+
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdull;
+	hash ^= hash >> 33;
+
+	return hash;
+}
+
+static unsigned int table_slot(uint64_t hash, unsigned int displacement, unsigned int mask) {
+	unsigned int base = (unsigned int) (hash >> 20);
+	//Odd step visits every slot of a power of two table
+	unsigned int step = (unsigned int) (hash >> 40) | 1;
+
+	return (base + displacement * step) & mask;
+}
+
+/*
+ * Places every bucket of keys, largest first, using the first
+ * displacement that puts all its keys in free slots.
+ */
+static int build_table(HTTPRouter *router, unsigned int size, uint64_t *hashes,
+	int *order, int *start, int max_bucket) {
+	unsigned int bucket_count = router->bucket_mask + 1;
+	unsigned int slots[max_bucket];
+
+	memset(router->table, 0, size * sizeof(ExactRoute*));
+	memset(router->displacements, 0, bucket_count * sizeof(unsigned int));
+
+	for (int bucket_size = max_bucket; bucket_size > 0; --bucket_size) {
+		for (unsigned int b = 0; b < bucket_count; ++b) {
+			if (start[b + 1] - start[b] != bucket_size) {
+				continue;
+			}
+
+			unsigned int d;
+
+			for (d = 0; d < size; ++d) {
+				int k;
+
+				for (k = 0; k < bucket_size; ++k) {
+					unsigned int slot = table_slot(hashes[order[start[b] + k]], d, size - 1);
+					int taken = router->table[slot] != NULL;
+
+					for (int j = 0; j < k && !taken; ++j) {
+						taken = slots[j] == slot;
+					}
+					if (taken) {
+						break;
+					}
+
+					slots[k] = slot;
+				}
+
+				if (k == bucket_size) {
+					break;
+				}
+			}
+
+			if (d == size) {
+				return -1;
+			}
+
+			router->displacements[b] = d;
+
+			for (int k = 0; k < bucket_size; ++k) {
+				router->table[slots[k]] = router->exact + order[start[b] + k];
+			}
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Builds the perfect hash table of parameterless routes. Called by
+ * httpRouterDispatch() if routes were added since the last call.
+ * If no perfect hash is found all lookups go through the trie.
+ */
+void httpRouterCompile(HTTPRouter *router) {
+	int n = router->exact_count;
+
+	free(router->table);
+	free(router->displacements);
+	router->table = NULL;
+	router->displacements = NULL;
+	router->compiled = 1;
+
+	if (n == 0) {
+		return;
+	}
+
+	//About four keys per bucket
+	unsigned int bucket_count = 1;
+
+	while (bucket_count < (unsigned int) (n + 3) / 4) {
+		bucket_count *= 2;
+	}
+
+	uint64_t *hashes = malloc(n * sizeof(uint64_t));
+	int *order = malloc(n * sizeof(int));
+	int *start = calloc(bucket_count + 1, sizeof(int));
+	int *fill = calloc(bucket_count, sizeof(int));
+
+	assert(hashes != NULL && order != NULL && start != NULL && fill != NULL);
+
+	//Group the keys by bucket
+	for (int i = 0; i < n; ++i) {
+		hashes[i] = hash_path(router->exact[i].path, router->exact[i].path_length);
+		start[(hashes[i] & (bucket_count - 1)) + 1] += 1;
+	}
+
+	int max_bucket = 0;
+
+	for (unsigned int b = 0; b < bucket_count; ++b) {
+		if (start[b + 1] > max_bucket) {
+			max_bucket = start[b + 1];
+		}
+
+		start[b + 1] += start[b];
+	}
+
+	for (int i = 0; i < n; ++i) {
+		unsigned int b = hashes[i] & (bucket_count - 1);
+
+		order[start[b] + fill[b]] = i;
+		fill[b] += 1;
+	}
+
+	router->bucket_mask = bucket_count - 1;
+	router->displacements = malloc(bucket_count * sizeof(unsigned int));
+	assert(router->displacements != NULL);
+
+	unsigned int size = 1;
+
+	while (size < 2 * (unsigned int) n) {
+		size *= 2;
+	}
+
+	for (; size <= MAX_TABLE_FACTOR * 2 * (unsigned int) n; size *= 2) {
+		router->table = realloc(router->table, size * sizeof(ExactRoute*));
+		assert(router->table != NULL);
+
+		if (build_table(router, size, hashes, order, start, max_bucket) == 0) {
+			router->table_mask = size - 1;
+
+			break;
+		}
+	}
+
+	if (size > MAX_TABLE_FACTOR * 2 * (unsigned int) n) {
+		free(router->table);
+		free(router->displacements);
+		router->table = NULL;
+		router->displacements = NULL;
+	}
+
+	free(hashes);
+	free(order);
+	free(start);
+	free(fill);
+}
+
+static HTTPRoute *find_route(RouteNode *node, HTTPString *method) {
+	HTTPRoute *any = NULL;
+
+	for (HTTPRoute *route = node->routes; route != NULL; route = route->next) {
+		if (route->method == NULL) {
+			if (any == NULL) {
+				any = route;
+			}
+		} else if (httpStringEquals(method, route->method)) {
+			return route;
+		}
+	}
+
+	return any;
+}
+
+static RouteNode *find_exact(HTTPRouter *router, const char *path, size_t length) {
+	if (router->table == NULL) {
+		return NULL;
+	}
+
+	uint64_t hash = hash_path(path, length);
+	unsigned int displacement = router->displacements[hash & router->bucket_mask];
+	ExactRoute *exact = router->table[table_slot(hash, displacement, router->table_mask)];
+
+	if (exact != NULL && exact->path_length == length &&
+		memcmp(exact->path, path, length) == 0) {
+		return exact->node;
+	}
+
+	return NULL;
+}
+
+static HTTPRoute *match_node(RouteNode *node, const char *p, const char *end,
+	HTTPString *method, HTTPRouteMatch *match, int *path_found) {
+	HTTPRoute *route;
+
+	if (p == end) {
+		if (node->routes != NULL) {
+			*path_found = 1;
+
+			route = find_route(node, method);
+			if (route != NULL) {
+				return route;
+			}
+		}
+	} else {
+		int index = find_child(node, *p);
+
+		if (index >= 0) {
+			RouteNode *child = node->children[index];
+
+			if (child->prefix_length <= (size_t) (end - p) &&
+				memcmp(child->prefix, p, child->prefix_length) == 0) {
+				route = match_node(child, p + child->prefix_length, end,
+					method, match, path_found);
+				if (route != NULL) {
+					return route;
+				}
+			}
+		}
+
+		if (node->param_child != NULL && *p != '/') {
+			const char *segment_end = memchr(p, '/', end - p);
+			int param = match->param_count;
+
+			if (segment_end == NULL) {
+				segment_end = end;
+			}
+
+			match->params[param].data = p;
+			match->params[param].length = segment_end - p;
+			match->param_count += 1;
+
+			route = match_node(node->param_child, segment_end, end,
+				method, match, path_found);
+			if (route != NULL) {
+				return route;
+			}
+
+			match->param_count = param;
+		}
+	}
+
+	if (node->wildcard_child != NULL && node->wildcard_child->routes != NULL) {
+		*path_found = 1;
+
+		route = find_route(node->wildcard_child, method);
+		if (route != NULL) {
+			match->params[match->param_count].data = p;
+			match->params[match->param_count].length = end - p;
+			match->param_count += 1;
+
+			return route;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Finds the route for a request. The query string is ignored.
+ * path_found is set if some route matches the path but not the
+ * method. Returns NULL if there is no route.
+ */
+HTTPRoute *httpRouterMatch(HTTPRouter *router, HTTPString *method, HTTPString *path,
+	HTTPRouteMatch *match, int *path_found) {
+	const char *query = memchr(path->data, '?', path->length);
+	size_t length = query != NULL ? (size_t) (query - path->data) : path->length;
+	HTTPRoute *route = NULL;
+
+	if (!router->compiled) {
+		httpRouterCompile(router);
+	}
+
+	*path_found = 0;
+	match->param_count = 0;
+
+	RouteNode *node = find_exact(router, path->data, length);
+
+	if (node != NULL) {
+		route = find_route(node, method);
+	}
+
+	if (route == NULL) {
+		//Parameterized routes or a method only a pattern handles
+		route = match_node(router->root, path->data, path->data + length,
+			method, match, path_found);
+	}
+
+	match->route = route;
+	match->data = route != NULL ? route->data : NULL;
+
+	return route;
+}
+
+/*
+ * Calls the handler of the matching route. Returns
+ * HTTP_ROUTE_DISPATCHED or the status code (404 or 405) that should
+ * be sent.
+ */
+int httpRouterDispatch(HTTPRouter *router, HTTPConnection *conn, HTTPRequest *req) {
+	HTTPRouteMatch match;
+	int path_found;
+	HTTPRoute *route = httpRouterMatch(router, &req->method, &req->path,
+		&match, &path_found);
+
+	if (route == NULL) {
+		return path_found ? 405 : 404;
+	}
+
+	route->handler(conn, req, &match);
+
+	return HTTP_ROUTE_DISPATCHED;
+}
+
+HTTPString *httpRouteParam(HTTPRouteMatch *match, const char *name) {
+	if (match->route == NULL) {
+		return NULL;
+	}
+
+	for (int i = 0; i < match->param_count; ++i) {
+		if (httpStringEquals(&match->route->param_names[i], name)) {
+			return match->params + i;
+		}
+	}
+
+	return NULL;
+}
@@ -0,0 +1,80 @@
+#ifndef HTTP_ROUTER_H
+#define HTTP_ROUTER_H
+
+#include "http-server.h"
+
+#define HTTP_ROUTER_MAX_PARAMS 8
+
+//Returned by httpRouterDispatch() when a handler was called
+#define HTTP_ROUTE_DISPATCHED 0
+
+struct _HTTPRouteMatch;
+
+typedef void (*HTTPRouteHandler)(HTTPConnection *conn, HTTPRequest *req,
+	struct _HTTPRouteMatch *match);
+
+typedef struct _HTTPRoute {
+	//NULL matches any method
+	char *method;
+	char *pattern;
+	HTTPRouteHandler handler;
+	void *data;
+	//Names point into pattern
+	HTTPString param_names[HTTP_ROUTER_MAX_PARAMS];
+	int param_count;
+	struct _HTTPRoute *next;
+} HTTPRoute;
+
+/*
+ * Filled in by the router. Parameter values point into the request
+ * path.
+ */
+typedef struct _HTTPRouteMatch {
+	HTTPRoute *route;
+	void *data;
+	HTTPString params[HTTP_ROUTER_MAX_PARAMS];
+	int param_count;
+} HTTPRouteMatch;
+
+struct _RouteNode;
+
+typedef struct _ExactRoute {
+	const char *path;
+	size_t path_length;
+	struct _RouteNode *node;
+} ExactRoute;
+
+/*
+ * Routes are compiled into a radix trie. A pattern segment of the
+ * form :name matches one path segment and *name matches the rest of
+ * the path. Paths without parameters are also put in a perfect hash
+ * table so that they are found with one probe. Matching does not
+ * allocate.
+ */
+typedef struct _HTTPRouter {
+	struct _RouteNode *root;
+
+	ExactRoute *exact;
+	int exact_count;
+	int exact_capacity;
+
+	//Perfect hash table built by httpRouterCompile()
+	ExactRoute **table;
+	unsigned int table_mask;
+	//Hash and displace. One displacement per bucket of keys.
+	unsigned int *displacements;
+	unsigned int bucket_mask;
+	int compiled;
+} HTTPRouter;
+
+HTTPRouter *newHTTPRouter();
+void deleteHTTPRouter(HTTPRouter *router);
+void httpRouterAdd(HTTPRouter *router, const char *method, const char *pattern,
+	HTTPRouteHandler handler, void *data);
+void httpRouterCompile(HTTPRouter *router);
+HTTPRoute *httpRouterMatch(HTTPRouter *router, HTTPString *method, HTTPString *path,
+	HTTPRouteMatch *match, int *path_found);
+int httpRouterDispatch(HTTPRouter *router, HTTPConnection *conn, HTTPRequest *req);
+HTTPString *httpRouteParam(HTTPRouteMatch *match, const char *name);
+
+#endif
@@ -0,0 +1,628 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "http-server.h"
+
+#define PARSE_INCOMPLETE 0
+#define PARSE_DONE 1
+#define PARSE_BAD_REQUEST -1
+#define PARSE_TOO_LARGE -2
+#define PARSE_NOT_IMPLEMENTED -3
+
+#define STREAM_NONE 0
+#define STREAM_WRITING 1
+#define STREAM_PAUSED 2
+#define STREAM_ENDING 3
+
+//Room for the chunk size line in front of the data
+#define CHUNK_HEADER_SIZE 10
+
+void _trace(const char* fmt, ...);
+
+/*
+ * Canned responses live in static storage so that they stay
+ * valid until the write completes.
+ */
+static char response_bad_request[] =
+	"HTTP/1.1 400 Bad Request\r\n"
+	"Content-Length: 0\r\n"
+	"Connection: close\r\n\r\n";
+static char response_too_large[] =
+	"HTTP/1.1 413 Request Entity Too Large\r\n"
+	"Content-Length: 0\r\n"
+	"Connection: close\r\n\r\n";
+static char response_not_implemented[] =
+	"HTTP/1.1 501 Not Implemented\r\n"
+	"Content-Length: 0\r\n"
+	"Connection: close\r\n\r\n";
+static char last_chunk[] = "0\r\n\r\n";
+
+/*
+ * Free list of streaming buffers. A streaming response holds one
+ * buffer no matter how large the body is.
+ */
+typedef union _ChunkBuffer {
+	union _ChunkBuffer *next;
+	char data[HTTP_CHUNK_BUFFER_SIZE];
+} ChunkBuffer;
+
+static ChunkBuffer *chunk_pool = NULL;
+static int chunk_pool_size = 0;
+
+static char *get_chunk_buffer() {
+	ChunkBuffer *buffer = chunk_pool;
+
+	if (buffer != NULL) {
+		chunk_pool = buffer->next;
+		chunk_pool_size -= 1;
+	} else {
+		buffer = malloc(sizeof(ChunkBuffer));
+		assert(buffer != NULL);
+	}
+
+	return buffer->data;
+}
+
+static void put_chunk_buffer(char *data) {
+	ChunkBuffer *buffer = (ChunkBuffer*) data;
+
+	if (chunk_pool_size == HTTP_CHUNK_POOL_SIZE) {
+		free(buffer);
+
+		return;
+	}
+
+	buffer->next = chunk_pool;
+	chunk_pool = buffer;
+	chunk_pool_size += 1;
+}
+
+HTTPString *httpFindHeader(HTTPRequest *req, const char *name) {
+	for (int i = 0; i < req->header_count; ++i) {
+		if (httpStringEqualsIgnoreCase(&req->headers[i].name, name)) {
+			return &req->headers[i].value;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Returns 1 if the Accept-Encoding parameters in [p, end) carry a
+ * quality value of zero, meaning "not acceptable".
+ */
+static int is_rejected(const char *p, const char *end) {
+	HTTPString param = {p, end - p};
+
+	httpStringTrim(&param);
+
+	if (param.length < 3 || (param.data[0] != 'q' && param.data[0] != 'Q') ||
+		param.data[1] != '=' || param.data[2] != '0') {
+		return 0;
+	}
+
+	for (size_t i = 3; i < param.length; ++i) {
+		if (param.data[i] != '.' && param.data[i] != '0') {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/*
+ * Returns the HTTP_ENCODING_* codings the client accepts. A coding
+ * refused with q=0 is not accepted even if * is.
+ */
+int httpAcceptedEncodings(HTTPRequest *req) {
+	HTTPString *value = httpFindHeader(req, "Accept-Encoding");
+	int accepted = 0;
+	int refused = 0;
+
+	if (value == NULL) {
+		return 0;
+	}
+
+	const char *p = value->data;
+	const char *end = p + value->length;
+
+	while (p < end) {
+		const char *comma = memchr(p, ',', end - p);
+
+		if (comma == NULL) {
+			comma = end;
+		}
+
+		const char *semicolon = memchr(p, ';', comma - p);
+		HTTPString coding = {p, (semicolon != NULL ? semicolon : comma) - p};
+
+		httpStringTrim(&coding);
+
+		int codings = 0;
+
+		if (httpStringEqualsIgnoreCase(&coding, "br")) {
+			codings = HTTP_ENCODING_BR;
+		} else if (httpStringEqualsIgnoreCase(&coding, "zstd")) {
+			codings = HTTP_ENCODING_ZSTD;
+		} else if (httpStringEqualsIgnoreCase(&coding, "gzip")) {
+			codings = HTTP_ENCODING_GZIP;
+		} else if (httpStringEquals(&coding, "*")) {
+			codings = HTTP_ENCODING_BR | HTTP_ENCODING_ZSTD | HTTP_ENCODING_GZIP;
+		}
+
+		if (semicolon == NULL || !is_rejected(semicolon + 1, comma)) {
+			accepted |= codings;
+		} else if (!httpStringEquals(&coding, "*")) {
+			//*;q=0 only refuses codings that are not listed
+			refused |= codings;
+		}
+
+		p = comma + 1;
+	}
+
+	return accepted & ~refused;
+}
+
+static int parse_content_length(HTTPString *str, size_t *length) {
+	size_t value = 0;
+
+	if (str->length == 0) {
+		return -1;
+	}
+
+	for (size_t i = 0; i < str->length; ++i) {
+		char c = str->data[i];
+
+		if (c < '0' || c > '9') {
+			return -1;
+		}
+		if (value > HTTP_READ_BUFFER_SIZE) {
+			//Way too large already. Stop before we overflow.
+			break;
+		}
+
+		value = value * 10 + (c - '0');
+	}
+
+	*length = value;
+
+	return 0;
+}
+
+/*
+ * Parses the request at the start of the read buffer. The head is
+ * parsed incrementally as data arrives. Nothing is copied. The
+ * request fields point into the read buffer.
+ */
+static int parse_request(HTTPConnection *conn) {
+	HTTPRequest *req = &conn->request;
+
+	//request_length is set once the head has been parsed
+	if (conn->request_length == 0) {
+		HTTPParser *parser = &conn->parser;
+		int status = httpParserExecute(parser,
+			conn->read_buffer, conn->read_length);
+
+		if (status == HTTP_PARSE_INCOMPLETE) {
+			return PARSE_INCOMPLETE;
+		}
+		if (status == HTTP_PARSE_TOO_MANY_HEADERS) {
+			return PARSE_TOO_LARGE;
+		}
+		if (status != HTTP_PARSE_DONE) {
+			return PARSE_BAD_REQUEST;
+		}
+
+		req->method = parser->method;
+		req->path = parser->path;
+		req->version = parser->version;
+		req->headers = parser->headers;
+		req->header_count = parser->header_count;
+
+		size_t body_length = 0;
+
+		if (httpFindHeader(req, "Transfer-Encoding") != NULL) {
+			return PARSE_NOT_IMPLEMENTED;
+		}
+
+		HTTPString *content_length = httpFindHeader(req, "Content-Length");
+
+		if (content_length != NULL &&
+			parse_content_length(content_length, &body_length) < 0) {
+			return PARSE_BAD_REQUEST;
+		}
+		if (parser->head_length + body_length > sizeof(conn->read_buffer)) {
+			return PARSE_TOO_LARGE;
+		}
+
+		req->body.data = conn->read_buffer + parser->head_length;
+		req->body.length = body_length;
+		conn->request_length = parser->head_length + body_length;
+	}
+
+	if (conn->read_length < conn->request_length) {
+		return PARSE_INCOMPLETE;
+	}
+
+	return PARSE_DONE;
+}
+
+static int wants_keep_alive(HTTPRequest *req) {
+	HTTPString *connection = httpFindHeader(req, "Connection");
+
+	if (httpStringEquals(&req->version, "HTTP/1.1")) {
+		return connection == NULL ||
+			!httpStringEqualsIgnoreCase(connection, "close");
+	}
+
+	return connection != NULL &&
+		httpStringEqualsIgnoreCase(connection, "keep-alive");
+}
+
+static void schedule_read(HTTPConnection *conn) {
+	int status = clientScheduleRead(conn->client,
+		conn->read_buffer + conn->read_length,
+		sizeof(conn->read_buffer) - conn->read_length);
+
+	assert(status == 0);
+}
+
+static void cancel_read(HTTPConnection *conn) {
+	if (conn->client->read_write_flag & RW_STATE_READ) {
+		clientCancelRead(conn->client);
+	}
+}
+
+static void send_error(HTTPConnection *conn, char *response) {
+	_trace("Sending error response and closing.");
+
+	cancel_read(conn);
+
+	conn->state = HTTP_CONN_CLOSING;
+	conn->keep_alive = 0;
+
+	clientScheduleWrite(conn->client, response, strlen(response));
+}
+
+/*
+ * Tries to parse the next request from the read buffer. If a
+ * complete request is found it is dispatched to the application.
+ * Otherwise more data is read from the client.
+ */
+static void process_input(HTTPConnection *conn) {
+	assert(conn->state == HTTP_CONN_READING);
+
+	int status = parse_request(conn);
+
+	if (status == PARSE_INCOMPLETE) {
+		if (conn->read_length == sizeof(conn->read_buffer)) {
+			send_error(conn, response_too_large);
+		} else if (!(conn->client->read_write_flag & RW_STATE_READ)) {
+			schedule_read(conn);
+		}
+
+		return;
+	}
+	if (status == PARSE_BAD_REQUEST) {
+		send_error(conn, response_bad_request);
+
+		return;
+	}
+	if (status == PARSE_TOO_LARGE) {
+		send_error(conn, response_too_large);
+
+		return;
+	}
+	if (status == PARSE_NOT_IMPLEMENTED) {
+		send_error(conn, response_not_implemented);
+
+		return;
+	}
+
+	//Stop reading while we respond. Pipelined requests
+	//already in the buffer are kept for later.
+	cancel_read(conn);
+
+	conn->state = HTTP_CONN_RESPONDING;
+	conn->keep_alive = wants_keep_alive(&conn->request);
+
+	HTTPServer *http = conn->http_server;
+
+	if (http->on_request != NULL) {
+		http->on_request(http, conn, &conn->request);
+	} else {
+		send_error(conn, response_not_implemented);
+	}
+}
+
+static void on_client_connect(Server *server, Client *client) {
+	HTTPServer *http = server->data;
+	//Freed with the client's arena
+	HTTPConnection *conn = arenaAlloc(&client->arena, sizeof(HTTPConnection));
+
+	conn->http_server = http;
+	conn->client = client;
+	conn->state = HTTP_CONN_READING;
+	conn->keep_alive = 1;
+	conn->request_length = 0;
+	conn->read_length = 0;
+	conn->data = NULL;
+	conn->stream_producer = NULL;
+	conn->stream_buffer = NULL;
+	conn->stream_state = STREAM_NONE;
+	conn->stream_chunked = 0;
+	httpParserInit(&conn->parser);
+
+	client->data = conn;
+
+	if (http->on_connect != NULL) {
+		http->on_connect(http, conn);
+	}
+
+	conn->request_mark = arenaMark(&client->arena);
+
+	schedule_read(conn);
+}
+
+static void on_client_disconnect(Server *server, Client *client) {
+	HTTPServer *http = server->data;
+	HTTPConnection *conn = client->data;
+
+	if (conn == NULL) {
+		return;
+	}
+
+	if (http->on_disconnect != NULL) {
+		http->on_disconnect(http, conn);
+	}
+
+	if (conn->stream_buffer != NULL) {
+		put_chunk_buffer(conn->stream_buffer);
+	}
+
+	client->data = NULL;
+}
+
+static void on_read(Server *server, Client *client, char *buffer, size_t length) {
+	HTTPConnection *conn = client->data;
+
+	conn->read_length += length;
+
+	if (conn->state == HTTP_CONN_READING) {
+		process_input(conn);
+	}
+}
+
+static void end_stream(HTTPConnection *conn) {
+	put_chunk_buffer(conn->stream_buffer);
+
+	conn->stream_buffer = NULL;
+	conn->stream_producer = NULL;
+	conn->stream_state = STREAM_NONE;
+
+	httpResponseCompleted(conn);
+}
+
+/*
+ * Asks the producer for the next piece of the body and writes it as
+ * a chunk. The producer writes straight into the streaming buffer
+ * after the space reserved for the chunk size line.
+ */
+static void write_next_chunk(HTTPConnection *conn) {
+	char *data = conn->stream_buffer + CHUNK_HEADER_SIZE;
+	size_t size = HTTP_CHUNK_BUFFER_SIZE - CHUNK_HEADER_SIZE - 2;
+	ssize_t length = conn->stream_producer(conn, data, size);
+
+	if (length == HTTP_STREAM_PAUSE) {
+		conn->stream_state = STREAM_PAUSED;
+
+		return;
+	}
+	if (length < 0 || (size_t) length > size) {
+		_trace("Stream producer failed.");
+		httpDisconnect(conn);
+
+		return;
+	}
+
+	conn->stream_state = STREAM_WRITING;
+
+	if (length == 0) {
+		if (conn->stream_chunked) {
+			conn->stream_state = STREAM_ENDING;
+			clientScheduleWrite(conn->client, last_chunk, sizeof(last_chunk) - 1);
+		} else {
+			//The body ends when the connection is closed
+			end_stream(conn);
+		}
+
+		return;
+	}
+
+	if (!conn->stream_chunked) {
+		clientScheduleWrite(conn->client, data, length);
+
+		return;
+	}
+
+	//Size line goes right in front of the data
+	char size_line[CHUNK_HEADER_SIZE + 1];
+	int size_length = snprintf(size_line, sizeof(size_line), "%zx\r\n", (size_t) length);
+	char *start = data - size_length;
+
+	memcpy(start, size_line, size_length);
+	data[length] = '\r';
+	data[length + 1] = '\n';
+
+	clientScheduleWrite(conn->client, start, size_length + length + 2);
+}
+
+static void on_write_completed(Server *server, Client *client) {
+	HTTPServer *http = server->data;
+	HTTPConnection *conn = client->data;
+
+	if (conn->state == HTTP_CONN_CLOSING) {
+		httpDisconnect(conn);
+
+		return;
+	}
+
+	if (conn->stream_state == STREAM_WRITING) {
+		write_next_chunk(conn);
+
+		return;
+	}
+	if (conn->stream_state == STREAM_ENDING) {
+		end_stream(conn);
+
+		return;
+	}
+
+	if (http->on_write_completed != NULL) {
+		http->on_write_completed(http, conn);
+	}
+}
+
+HTTPServer *newHTTPServer(int port) {
+	HTTPServer *http = calloc(1, sizeof(HTTPServer));
+
+	assert(http != NULL);
+
+	http->server = newServer(port);
+	http->server->data = http;
+	http->server->on_client_connect = on_client_connect;
+	http->server->on_client_disconnect = on_client_disconnect;
+	http->server->on_read = on_read;
+	http->server->on_write_completed = on_write_completed;
+
+	return http;
+}
+
+void deleteHTTPServer(HTTPServer *http) {
+	//deleteServer() does not fire disconnect events.
+	for (int i = 0; i < MAX_CLIENTS; ++i) {
+		Client *client = http->server->client_state + i;
+
+		if (client->fd >= 0 && client->data != NULL) {
+			on_client_disconnect(http->server, client);
+		}
+	}
+
+	deleteServer(http->server);
+	free(http);
+}
+
+int httpScheduleWrite(HTTPConnection *conn, char *buffer, size_t length) {
+	return clientScheduleWrite(conn->client, buffer, length);
+}
+
+int httpScheduleWriteV(HTTPConnection *conn, struct iovec *iov, int count) {
+	return clientScheduleWriteV(conn->client, iov, count);
+}
+
+/*
+ * Writes the response head. headers holds the pre-rendered
+ * response specific header lines, each ending in CRLF. Date and
+ * Connection headers are added here.
+ */
+static int send_header(HTTPConnection *conn, int status, int flags,
+	const char *headers, size_t length) {
+	if (!conn->keep_alive) {
+		flags |= HTTP_HEADER_CLOSE;
+	}
+
+	int header_length = httpBuildHeader(conn->header_buffer,
+		sizeof(conn->header_buffer), status, flags,
+		headers, length);
+
+	if (header_length < 0) {
+		_trace("Failed to build response header.");
+
+		return -1;
+	}
+
+	return clientScheduleWrite(conn->client, conn->header_buffer, header_length);
+}
+
+int httpSendHeader(HTTPConnection *conn, int status, const char *headers, size_t length) {
+	return send_header(conn, status, 0, headers, length);
+}
+
+/*
+ * Starts a response whose length is not known up front. The body is
+ * pulled from the producer whenever the previous chunk has been
+ * written, so memory use does not depend on the size of the body.
+ * HTTP/1.0 clients get the raw body and the connection is closed
+ * at the end. The response completes on its own after the producer
+ * returns 0.
+ */
+int httpStartStream(HTTPConnection *conn, int status, const char *headers, size_t length,
+	ssize_t (*producer)(HTTPConnection *conn, char *buffer, size_t size)) {
+	assert(conn->state == HTTP_CONN_RESPONDING);
+	assert(conn->stream_state == STREAM_NONE);
+
+	conn->stream_chunked = httpStringEquals(&conn->request.version, "HTTP/1.1");
+
+	if (!conn->stream_chunked) {
+		conn->keep_alive = 0;
+	}
+
+	int status_code = send_header(conn, status,
+		conn->stream_chunked ? HTTP_HEADER_CHUNKED : 0, headers, length);
+
+	if (status_code < 0) {
+		return status_code;
+	}
+
+	conn->stream_producer = producer;
+	conn->stream_buffer = get_chunk_buffer();
+	conn->stream_state = STREAM_WRITING;
+
+	return 0;
+}
+
+/*
+ * Called after a producer returned HTTP_STREAM_PAUSE and now has
+ * more data.
+ */
+void httpResumeStream(HTTPConnection *conn) {
+	assert(conn->stream_state == STREAM_PAUSED);
+
+	write_next_chunk(conn);
+}
+
+/*
+ * Called by the application after the last byte of a response
+ * has been written. The next pipelined request, if any, is
+ * dispatched right away. Otherwise we wait for more data.
+ */
+void httpResponseCompleted(HTTPConnection *conn) {
+	assert(conn->state == HTTP_CONN_RESPONDING);
+
+	if (conn->keep_alive == 0) {
+		_trace("Closing connection after response.");
+		httpDisconnect(conn);
+
+		return;
+	}
+
+	arenaRelease(&conn->client->arena, conn->request_mark);
+
+	size_t remaining = conn->read_length - conn->request_length;
+
+	memmove(conn->read_buffer,
+		conn->read_buffer + conn->request_length, remaining);
+
+	conn->read_length = remaining;
+	conn->request_length = 0;
+	conn->state = HTTP_CONN_READING;
+	httpParserInit(&conn->parser);
+
+	process_input(conn);
+}
+
+void httpDisconnect(HTTPConnection *conn) {
+	serverDisconnect(conn->http_server->server, conn->client);
+}
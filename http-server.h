@@ -0,0 +1,93 @@
+#ifndef HTTP_SERVER_H
+#define HTTP_SERVER_H
+
+#include "socket-framework.h"
+#include "http-parser.h"
+#include "http-response.h"
+
+#define HTTP_READ_BUFFER_SIZE 8192
+#define HTTP_CHUNK_BUFFER_SIZE 16384
+//Streaming buffers kept for reuse
+#define HTTP_CHUNK_POOL_SIZE 64
+
+//Returned by a stream producer that has no data yet
+#define HTTP_STREAM_PAUSE -2
+
+#define HTTP_CONN_READING 1
+#define HTTP_CONN_RESPONDING 2
+#define HTTP_CONN_CLOSING 3
+
+/*
+ * All strings point into the connection's read buffer. They are
+ * only valid until the response to the request is completed.
+ */
+typedef struct _HTTPRequest {
+	HTTPString method;
+	HTTPString path;
+	HTTPString version;
+	HTTPHeader *headers;
+	int header_count;
+	HTTPString body;
+} HTTPRequest;
+
+struct _HTTPServer;
+
+typedef struct _HTTPConnection {
+	struct _HTTPServer *http_server;
+	Client *client;
+	int state;
+	//Set to 0 to close the connection after the current response
+	int keep_alive;
+	HTTPParser parser;
+	HTTPRequest request;
+	//Bytes of the current request (header and body) in read_buffer
+	size_t request_length;
+	//Bytes received so far, including pipelined requests
+	size_t read_length;
+	char read_buffer[HTTP_READ_BUFFER_SIZE];
+	//Owned by the connection so it outlives the write
+	char header_buffer[HTTP_HEADER_BUFFER_SIZE];
+
+	/*
+	 * Streaming response. The producer fills at most size bytes and
+	 * returns the byte count, 0 at the end of the body, -1 on error
+	 * or HTTP_STREAM_PAUSE.
+	 */
+	ssize_t (*stream_producer)(struct _HTTPConnection *conn, char *buffer, size_t size);
+	char *stream_buffer;
+	int stream_state;
+	int stream_chunked;
+
+	/*
+	 * Allocations from client->arena made after on_connect are
+	 * released when the response is completed.
+	 */
+	ArenaMark request_mark;
+
+	void *data;
+} HTTPConnection;
+
+typedef struct _HTTPServer {
+	Server *server;
+	void *data;
+
+	void (*on_connect)(struct _HTTPServer *http, HTTPConnection *conn);
+	void (*on_disconnect)(struct _HTTPServer *http, HTTPConnection *conn);
+	void (*on_request)(struct _HTTPServer *http, HTTPConnection *conn, HTTPRequest *req);
+	void (*on_write_completed)(struct _HTTPServer *http, HTTPConnection *conn);
+} HTTPServer;
+
+HTTPServer *newHTTPServer(int port);
+void deleteHTTPServer(HTTPServer *http);
+int httpScheduleWrite(HTTPConnection *conn, char *buffer, size_t length);
+int httpScheduleWriteV(HTTPConnection *conn, struct iovec *iov, int count);
+int httpSendHeader(HTTPConnection *conn, int status, const char *headers, size_t length);
+void httpResponseCompleted(HTTPConnection *conn);
+int httpStartStream(HTTPConnection *conn, int status, const char *headers, size_t length,
+	ssize_t (*producer)(HTTPConnection *conn, char *buffer, size_t size));
+void httpResumeStream(HTTPConnection *conn);
+void httpDisconnect(HTTPConnection *conn);
+HTTPString *httpFindHeader(HTTPRequest *req, const char *name);
+int httpAcceptedEncodings(HTTPRequest *req);
+
+#endif
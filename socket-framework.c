@@ -11,6 +11,7 @@
 #include <fcntl.h>
 
 #include "socket-framework.h"
+#include "unix-socket.h"
 
 #define DIE(value, message) if (value < 0) {perror(message); exit(value);}
 
@@ -48,12 +49,21 @@ static void reset_client(Client *cstate) {
     cstate->write_buffer = NULL;
     cstate->write_length = 0;
     cstate->write_completed = 0;
+    cstate->write_iov = NULL;
+    cstate->write_iov_count = 0;
+    arenaReset(&cstate->arena);
 }
 
 void populate_fd_set(EventLoop *loop, fd_set *pReadFdSet, fd_set *pWriteFdSet) {
     FD_ZERO(pReadFdSet);
     FD_ZERO(pWriteFdSet);
     
+    for (int j = 0; j < MAX_WATCHES; ++j) {
+        if (loop->watches[j].fd >= 0) {
+            FD_SET(loop->watches[j].fd, pReadFdSet);
+        }
+    }
+    
     for (int j = 0; j < MAX_SERVERS; ++j) {
         Server *state = loop->server_state[j];
         
@@ -108,6 +118,8 @@ add_client_fd(Server *state, int fd) {
             cstate->write_buffer = NULL;
             cstate->write_length = 0;
             cstate->write_completed = 0;
+            cstate->write_iov = NULL;
+            cstate->write_iov_count = 0;
             
             return i;
         }
@@ -176,6 +188,10 @@ handle_client_write(Server* state, Client *cli_state) {
     if (state->on_read) {
         state->on_read(state, cli_state, buffer_start, bytesRead);
     }
+    if (cli_state->fd < 0) {
+        //Application disconnected the client from on_read.
+        return bytesRead;
+    }
     if (cli_state->read_completed == cli_state->read_length) {
         cli_state->read_write_flag = cli_state->read_write_flag & (~RW_STATE_READ);
         
@@ -187,28 +203,27 @@ handle_client_write(Server* state, Client *cli_state) {
     return bytesRead;
 }
 
+/*
+ * Writes as much of the scheduled data as the socket will take.
+ * For scatter-gather writes the iovec array is advanced past the
+ * written bytes. Returns the number of bytes written, 0 if the write
+ * would block or -1 on error.
+ */
 int
-handle_client_read(Server* state, Client *cli_state) {
-    if (!(cli_state->read_write_flag & RW_STATE_WRITE)) {
-        _trace("Socket is not trying to write.");
-        
-        return -1;
-    }
-    if (cli_state->write_buffer == NULL) {
-        _trace("Write buffer not setup.");
-        
-        return -1;
-    }
-    if (cli_state->write_length == cli_state->write_completed) {
-        _trace("Write was already completed.");
-        
-        return -1;
-    }
-    
-    char *buffer_start = cli_state->write_buffer + cli_state->write_completed;
-    int bytesWritten = write(cli_state->fd,
-                             buffer_start,
+write_client_data(Client *cli_state, char **buffer_start) {
+    ssize_t bytesWritten;
+    
+    if (cli_state->write_iov != NULL) {
+        *buffer_start = NULL;
+        bytesWritten = writev(cli_state->fd,
+                              cli_state->write_iov,
+                              cli_state->write_iov_count);
+    } else {
+        *buffer_start = cli_state->write_buffer + cli_state->write_completed;
+        bytesWritten = write(cli_state->fd,
+                             *buffer_start,
                              cli_state->write_length - cli_state->write_completed);
+    }
     
     _trace("Written %d of %d bytes", bytesWritten, cli_state->write_length);
     
@@ -228,12 +243,57 @@ handle_client_read(Server* state, Client *cli_state) {
     
     cli_state->write_completed += bytesWritten;
     
+    if (cli_state->write_iov != NULL) {
+        size_t remaining = bytesWritten;
+        
+        while (cli_state->write_iov_count > 0 &&
+               remaining >= cli_state->write_iov->iov_len) {
+            remaining -= cli_state->write_iov->iov_len;
+            cli_state->write_iov += 1;
+            cli_state->write_iov_count -= 1;
+        }
+        if (remaining > 0) {
+            cli_state->write_iov->iov_base = (char*) cli_state->write_iov->iov_base + remaining;
+            cli_state->write_iov->iov_len -= remaining;
+        }
+    }
+    
+    return bytesWritten;
+}
+
+int
+handle_client_read(Server* state, Client *cli_state) {
+    if (!(cli_state->read_write_flag & RW_STATE_WRITE)) {
+        _trace("Socket is not trying to write.");
+        
+        return -1;
+    }
+    if (cli_state->write_buffer == NULL && cli_state->write_iov == NULL) {
+        _trace("Write buffer not setup.");
+        
+        return -1;
+    }
+    if (cli_state->write_length == cli_state->write_completed) {
+        _trace("Write was already completed.");
+        
+        return -1;
+    }
+    
+    char *buffer_start;
+    int bytesWritten = write_client_data(cli_state, &buffer_start);
+    
+    if (bytesWritten <= 0) {
+        return bytesWritten;
+    }
+    
     if (state->on_write) {
         state->on_write(state, cli_state, buffer_start, bytesWritten);
     }
     
     if (cli_state->write_completed == cli_state->write_length) {
         cli_state->read_write_flag &= ~RW_STATE_WRITE;
+        cli_state->write_iov = NULL;
+        cli_state->write_iov_count = 0;
         
         if (state->on_write_completed) {
             state->on_write_completed(state, cli_state);
@@ -265,7 +325,8 @@ void dispatch_event(Server *state, fd_set *readFdSet, fd_set *writeFdSet) {
         if (position < 0) {
             _trace("Too many clients. Disconnecting...");
             close(clientFd);
-            remove_client_fd(state, clientFd);
+            
+            return;
         }
         
         int status = fcntl(clientFd, F_SETFL, O_NONBLOCK);
@@ -365,6 +426,14 @@ loopStart(EventLoop *loop) {
             continue;
         }
         
+        for (int i = 0; i < MAX_WATCHES; ++i) {
+            Watch *w = loop->watches + i;
+            
+            if (w->fd >= 0 && FD_ISSET(w->fd, &readFdSet)) {
+                w->on_readable(w->fd, w->data);
+            }
+        }
+        
         for (int i = 0; i < MAX_SERVERS; ++i) {
             Server *s = loop->server_state[i];
             
@@ -379,6 +448,16 @@ void
 serverStart(Server *state) {
     int status;
     
+    if (state->unix_type != 0) {
+        int sock = unixListen(state->unix_path, state->unix_type);
+        
+        DIE(sock, "Failed to listen on unix socket.");
+        
+        state->server_socket = sock;
+        
+        return;
+    }
+    
     int sock = socket(PF_INET, SOCK_STREAM, 0);
     
     DIE(sock, "Failed to open socket.");
@@ -422,6 +501,24 @@ Server* newServer(int port) {
     return state;
 }
 
+/*
+ * Server on an AF_UNIX path. A path starting with @ is in the
+ * abstract namespace. type must be SOCK_STREAM. Fixed length reads
+ * would truncate SOCK_SEQPACKET messages. Use an EventPump for those.
+ */
+Server* newUnixServer(const char *path, int type) {
+    assert(type == SOCK_STREAM);
+
+    Server *state = newServer(0);
+    
+    assert(strlen(path) < sizeof(state->unix_path));
+    
+    strcpy(state->unix_path, path);
+    state->unix_type = type;
+    
+    return state;
+}
+
 void deleteServer(Server *state) {
     disconnect_clients(state);
     
@@ -455,6 +552,40 @@ int clientScheduleWrite(Client *cstate, char *buffer, size_t length) {
     cstate->read_write_flag |= RW_STATE_WRITE;
     
     _trace("Scheduling write for socket: %d", cstate->fd);
+    if (cstate->loop != NULL) {
+        clientLoopUpdate(cstate);
+    }
+
+    return 0;
+}
+
+/*
+ * Schedules a scatter-gather write. The iovec array must stay valid
+ * until the write completes. It is modified as data is written.
+ */
+int clientScheduleWriteV(Client *cstate, struct iovec *iov, int count) {
+    assert(cstate->fd >= 0); //Bad socket?
+    assert((cstate->read_write_flag & RW_STATE_WRITE) == 0); //Already writing?
+    assert(count > 0);
+    
+    size_t length = 0;
+    
+    for (int i = 0; i < count; ++i) {
+        length += iov[i].iov_len;
+    }
+    
+    cstate->write_buffer = NULL;
+    cstate->write_iov = iov;
+    cstate->write_iov_count = count;
+    cstate->write_length = length;
+    cstate->write_completed = 0;
+    cstate->read_write_flag |= RW_STATE_WRITE;
+    
+    _trace("Scheduling %d buffer write for socket: %d", count, cstate->fd);
+    if (cstate->loop != NULL) {
+        clientLoopUpdate(cstate);
+    }
+
     return 0;
 }
 
@@ -467,16 +598,27 @@ void clientCancelRead(Client *cstate) {
 }
 void clientCancelWrite(Client *cstate) {
     cstate->write_buffer = NULL;
+    cstate->write_iov = NULL;
+    cstate->write_iov_count = 0;
     cstate->write_length = 0;
     cstate->write_completed = 0;
     cstate->read_write_flag &= ~RW_STATE_WRITE;
     _trace("Cancel write for socket: %d", cstate->fd);
+
+    if (cstate->loop != NULL) {
+        clientLoopUpdate(cstate);
+    }
 }
 
 void loopInit(EventLoop *loop) {
     for (int i = 0; i < MAX_SERVERS; ++i) {
         loop->server_state[i] = NULL;
     }
+    for (int i = 0; i < MAX_WATCHES; ++i) {
+        loop->watches[i].fd = -1;
+        loop->watches[i].data = NULL;
+        loop->watches[i].on_readable = NULL;
+    }
     
     loop->continue_loop = 0;
     loop->idle_timeout = 0;
@@ -508,6 +650,37 @@ int loopRemoveServer(EventLoop *loop, Server *state) {
     return -1;
 }
 
+int loopAddWatch(EventLoop *loop, int fd, void (*on_readable)(int fd, void *data), void *data) {
+    assert(fd >= 0);
+    assert(on_readable != NULL);
+    
+    for (int i = 0; i < MAX_WATCHES; ++i) {
+        if (loop->watches[i].fd < 0) {
+            loop->watches[i].fd = fd;
+            loop->watches[i].data = data;
+            loop->watches[i].on_readable = on_readable;
+            
+            return 0;
+        }
+    }
+    
+    return -1;
+}
+
+int loopRemoveWatch(EventLoop *loop, int fd) {
+    for (int i = 0; i < MAX_WATCHES; ++i) {
+        if (loop->watches[i].fd == fd) {
+            loop->watches[i].fd = -1;
+            loop->watches[i].data = NULL;
+            loop->watches[i].on_readable = NULL;
+            
+            return 0;
+        }
+    }
+    
+    return -1;
+}
+
 void loopEnd(EventLoop *loop) {
     loop->continue_loop = 0;
 }
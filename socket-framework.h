@@ -1,5 +1,13 @@
+#ifndef SOCKET_FRAMEWORK_H
+#define SOCKET_FRAMEWORK_H
+
+#include <sys/uio.h>
+
+#include "arena.h"
+
 #define MAX_CLIENTS 5
 #define MAX_SERVERS 5
+#define MAX_WATCHES 5
 
 #define RW_STATE_NONE 0
 #define RW_STATE_READ 2
@@ -14,13 +22,38 @@ typedef struct _Client {
 	char *write_buffer;
 	size_t write_length;
 	size_t write_completed;
+	//Set instead of write_buffer for scatter-gather writes
+	struct iovec *write_iov;
+	int write_iov_count;
 
+	//Path of an AF_UNIX server when unix_type is set
 	char host[128];
 	int port;
+	//SOCK_STREAM for AF_UNIX. 0 for TCP.
+	int unix_type;
 
 	int read_write_flag;
 	void *data;
 	int is_connected;
+	//Released when the connection ends
+	Arena arena;
+
+	//Set while the client is driven by a ClientLoop
+	struct _ClientLoop *loop;
+	int loop_index;
+	int loop_events;
+	//Connect start or last I/O in milliseconds
+	long long last_activity;
+	struct _Client *timeout_prev;
+	struct _Client *timeout_next;
+	//The loop is running the client's callbacks
+	int dispatching;
+	//deleteClient() was called from a callback
+	int delete_pending;
+	//Addresses still racing the connect. See clientMakeConnection().
+	struct _ConnectRace *race;
+	//Set on the extra sockets of a race. Never seen by callers.
+	struct _Client *race_owner;
 
         void (*on_server_connect)(struct _Client* client_state);
         void (*on_server_disconnect)(struct _Client *client_state);
@@ -33,7 +66,11 @@ typedef struct _Client {
 typedef struct _Server {
 	Client client_state[MAX_CLIENTS];
 	int port;
+	//Listen on this AF_UNIX path instead of port when unix_type is set
+	char unix_path[108];
+	int unix_type;
 	int server_socket;
+	void *data;
 
 	void (*on_loop_start)(struct _Server* state);
 	void (*on_loop_end)(struct _Server* state);
@@ -46,27 +83,79 @@ typedef struct _Server {
 	void (*on_write_completed)(struct _Server* state, Client *client_state);
 } Server;
 
+//A non-socket file descriptor watched for readability by the loop
+typedef struct {
+    int fd;
+    void *data;
+    void (*on_readable)(int fd, void *data);
+} Watch;
+
 typedef struct {
     Server *server_state[MAX_SERVERS];
+    Watch watches[MAX_WATCHES];
     int continue_loop;
     int idle_timeout; //Timeout in seconds. -1 for no timeout.
 } EventLoop;
 
+//Clients ordered by last activity. Oldest first.
+typedef struct {
+    Client *first;
+    Client *last;
+} ClientList;
+
+/*
+ * Drives any number of outbound clients. Uses epoll on Linux and
+ * poll() elsewhere.
+ */
+typedef struct _ClientLoop {
+    int poll_fd;
+    Client **clients;
+    void *poll_events;
+    //Events of the epoll_wait() being dispatched
+    int batch_count;
+    int client_count;
+    int capacity;
+    int continue_loop;
+    int removed;
+    //Milliseconds. -1 for no timeout.
+    int connect_timeout;
+    int idle_timeout;
+    ClientList connecting;
+    ClientList connected;
+    void *data;
+} ClientLoop;
+
 void enableTrace(int flag);
 Server *newServer(int port);
+Server *newUnixServer(const char *path, int type);
 void serverStart(Server* state);
 void deleteServer(Server *state);
 void serverDisconnect(Server *state, Client *cli_state);
 int clientScheduleRead(Client *cli_state, char *buffer, size_t length);
 int clientScheduleWrite(Client *cli_state, char *buffer, size_t length);
+int clientScheduleWriteV(Client *cli_state, struct iovec *iov, int count);
 void clientCancelRead(Client *cstate);
 void clientCancelWrite(Client *cstate);
 void clientLoop(Client *cstate);
+ClientLoop *newClientLoop();
+void deleteClientLoop(ClientLoop *loop);
+int clientLoopAdd(ClientLoop *loop, Client *cstate);
+void clientLoopRemove(ClientLoop *loop, Client *cstate);
+void clientLoopUpdate(Client *cstate);
+void clientLoopRun(ClientLoop *loop);
+void clientLoopStop(ClientLoop *loop);
 Client* newClient(const char *host, int port);
+Client* newUnixClient(const char *path, int type);
 int clientMakeConnection(Client *cstate);
+Client* newClientWithDeadline(const char *host, int port, int timeout);
+int clientConnectWithDeadline(Client *cstate, int timeout);
 void deleteClient(Client *cstate);
 void loopInit(EventLoop *loop);
 int loopAddServer(EventLoop *loop, Server *state);
 int loopRemoveServer(EventLoop *loop, Server *state);
+int loopAddWatch(EventLoop *loop, int fd, void (*on_readable)(int fd, void *data), void *data);
+int loopRemoveWatch(EventLoop *loop, int fd);
 void loopStart(EventLoop *loop);
 void loopEnd(EventLoop *loop);
+
+#endif
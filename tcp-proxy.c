@@ -0,0 +1,361 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+
+#include "tcp-proxy.h"
+
+#define DIE(value, message) if (value < 0) {perror(message); abort();}
+
+#define DEBUG 0
+
+#if DEBUG
+#define _info printf("INFO: "); printf
+#else
+#define _info(...)
+#endif
+
+static void on_readable(SocketRec *rec);
+static void on_writable(SocketRec *rec);
+
+static ProxyStream *stream_from(ProxySession *session, SocketRec *rec) {
+	return rec == session->downstream ? &session->request : &session->response;
+}
+
+static ProxyStream *stream_to(ProxySession *session, SocketRec *rec) {
+	return rec == session->downstream ? &session->response : &session->request;
+}
+
+/*
+ * Arms the pump callbacks for the stream. We read only while the
+ * pipe is empty and wait for the destination to become writable
+ * only while it is not. A slow receiver therefore stops reads
+ * from the sender.
+ */
+static void update_interest(ProxySession *session, ProxyStream *stream) {
+	int can_read = session->connected && !stream->eof && stream->pending == 0;
+
+	stream->from->onReadable = can_read ? on_readable : NULL;
+	stream->to->onWritable = stream->pending > 0 ? on_writable : NULL;
+}
+
+static int open_pipe(int fds[2]) {
+	if (pipe(fds) < 0) {
+		return -1;
+	}
+
+	for (int i = 0; i < 2; ++i) {
+		int status = fcntl(fds[i], F_SETFL, O_NONBLOCK);
+
+		DIE(status, "Failed to set non blocking mode for pipe.");
+	}
+
+#ifdef F_SETPIPE_SZ
+	//Fewer splice() calls per megabyte. Fine if refused.
+	fcntl(fds[1], F_SETPIPE_SZ, PROXY_PIPE_SIZE);
+#endif
+
+	return 0;
+}
+
+static void close_pipe(int fds[2]) {
+	if (fds[0] >= 0) {
+		close(fds[0]);
+		close(fds[1]);
+		fds[0] = fds[1] = -1;
+	}
+}
+
+/*
+ * Passes the source's FIN on once everything before it has been
+ * delivered. The other direction keeps flowing.
+ */
+static void check_half_close(ProxyStream *stream) {
+	if (stream->eof && stream->pending == 0 && !stream->shut) {
+		_info("Half close of %d.\n", stream->to->socket);
+
+		shutdown(stream->to->socket, SHUT_WR);
+		stream->shut = 1;
+	}
+}
+
+/*
+ * Moves data from the pipe to the destination. Returns -1 if the
+ * destination is gone.
+ */
+static int flush_stream(ProxyStream *stream) {
+	while (stream->pending > 0) {
+		ssize_t length = splice(stream->pipe[0], NULL, stream->to->socket, NULL,
+			stream->pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+		if (length < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				//Socket buffer is full
+				return 0;
+			}
+			if (errno == EINTR) {
+				continue;
+			}
+
+			return -1;
+		}
+
+		stream->pending -= length;
+	}
+
+	check_half_close(stream);
+
+	return 0;
+}
+
+static void finish_stream(ProxySession *session, ProxyStream *stream) {
+	update_interest(session, stream);
+
+	if (session->request.shut && session->response.shut) {
+		//Both sides are done
+		proxyEndSession(session);
+	}
+}
+
+static void on_readable(SocketRec *rec) {
+	ProxySession *session = rec->data;
+	ProxyStream *stream = stream_from(session, rec);
+
+	assert(stream->pending == 0);
+
+	ssize_t length = splice(rec->socket, NULL, stream->pipe[1], NULL,
+		PROXY_SPLICE_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+	if (length < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+			return;
+		}
+
+		_info("Receive failed: %s\n", strerror(errno));
+		proxyEndSession(session);
+
+		return;
+	}
+
+	if (length == 0) {
+		stream->eof = 1;
+	}
+
+	stream->pending += length;
+
+	if (flush_stream(stream) < 0) {
+		proxyEndSession(session);
+
+		return;
+	}
+
+	finish_stream(session, stream);
+}
+
+static void on_writable(SocketRec *rec) {
+	ProxySession *session = rec->data;
+	ProxyStream *stream = stream_to(session, rec);
+
+	if (flush_stream(stream) < 0) {
+		proxyEndSession(session);
+
+		return;
+	}
+
+	finish_stream(session, stream);
+}
+
+static void on_connect(SocketRec *rec, int status) {
+	ProxySession *session = rec->data;
+
+	if (status == 0) {
+		proxyEndSession(session);
+
+		return;
+	}
+
+	_info("Upstream connected %d.\n", rec->socket);
+
+	session->connected = 1;
+	update_interest(session, &session->request);
+	update_interest(session, &session->response);
+}
+
+//Stopping the pump frees the records of live sessions
+static void on_session_removed(SocketRec *rec) {
+	ProxySession *session = rec->data;
+
+	close(rec->socket);
+
+	if (rec == session->downstream) {
+		session->downstream = NULL;
+	} else {
+		session->upstream = NULL;
+	}
+
+	proxyEndSession(session);
+}
+
+static void on_listener_removed(SocketRec *rec) {
+	Proxy *proxy = rec->data;
+
+	close(rec->socket);
+	proxy->listener = NULL;
+}
+
+static void init_stream(ProxyStream *stream, SocketRec *from, SocketRec *to) {
+	stream->from = from;
+	stream->to = to;
+	stream->pending = 0;
+	stream->eof = 0;
+	stream->shut = 0;
+}
+
+static void on_accept(SocketRec *listener, int socket) {
+	Proxy *proxy = listener->data;
+
+	if (proxyStartSession(proxy, socket) == NULL) {
+		close(socket);
+	}
+}
+
+/*
+ * Starts a session for an accepted socket. Connects to the upstream
+ * and moves bytes both ways once connected. Returns NULL if the
+ * upstream connection can not be started.
+ */
+ProxySession *proxyStartSession(Proxy *proxy, int socket) {
+	ProxySession *session = calloc(1, sizeof(ProxySession));
+
+	assert(session != NULL);
+
+	session->proxy = proxy;
+	session->request.pipe[0] = session->request.pipe[1] = -1;
+	session->response.pipe[0] = session->response.pipe[1] = -1;
+
+	if (open_pipe(session->request.pipe) < 0 ||
+		open_pipe(session->response.pipe) < 0) {
+		perror("Failed to create pipe.");
+		close_pipe(session->request.pipe);
+		free(session);
+
+		return NULL;
+	}
+
+	if (proxy->pool != NULL) {
+		session->upstream = upstreamConnect(proxy->pool, &session->backend, session);
+	} else {
+		session->upstream = pumpRegisterClient(proxy->pump,
+			proxy->upstream_host, proxy->upstream_port, session);
+	}
+
+	if (session->upstream == NULL) {
+		close_pipe(session->request.pipe);
+		close_pipe(session->response.pipe);
+		free(session);
+
+		return NULL;
+	}
+
+	session->downstream = pumpRegisterSocket(proxy->pump, socket, session);
+	proxy->session_count += 1;
+	session->upstream->onConnect = on_connect;
+	session->upstream->onRemoved = on_session_removed;
+	session->downstream->onRemoved = on_session_removed;
+
+	init_stream(&session->request, session->downstream, session->upstream);
+	init_stream(&session->response, session->upstream, session->downstream);
+
+	if (proxy->onSessionStart != NULL) {
+		proxy->onSessionStart(proxy, session);
+	}
+
+	return session;
+}
+
+/*
+ * Closes both sockets of the session and frees it.
+ */
+void proxyEndSession(ProxySession *session) {
+	Proxy *proxy = session->proxy;
+
+	_info("Ending session %p.\n", session);
+
+	if (proxy->onSessionEnd != NULL) {
+		proxy->onSessionEnd(proxy, session);
+	}
+
+	SocketRec *recs[2] = {session->downstream, session->upstream};
+
+	for (int i = 0; i < 2; ++i) {
+		if (recs[i] == NULL) {
+			//Already freed by the pump
+			continue;
+		}
+
+		//The record may still be visited by the current dispatch
+		recs[i]->onRemoved = NULL;
+		recs[i]->onReadable = NULL;
+		recs[i]->onWritable = NULL;
+		recs[i]->onConnect = NULL;
+		recs[i]->data = NULL;
+
+		close(recs[i]->socket);
+		pumpRemoveSocket(proxy->pump, recs[i]);
+	}
+
+	close_pipe(session->request.pipe);
+	close_pipe(session->response.pipe);
+
+	if (session->backend != NULL) {
+		//A backend that could not be reached counts as failed
+		upstreamRelease(session->backend, session->connected);
+	}
+
+	proxy->session_count -= 1;
+	free(session);
+}
+
+Proxy *newProxy(EventPump *pump, int port, const char *upstream_host, const char *upstream_port) {
+	Proxy *proxy = calloc(1, sizeof(Proxy));
+
+	assert(proxy != NULL);
+
+	//splice() to a closed socket raises SIGPIPE. It has no MSG_NOSIGNAL.
+	signal(SIGPIPE, SIG_IGN);
+
+	proxy->pump = pump;
+	//Can be NULL if a pool is used
+	proxy->upstream_host = upstream_host != NULL ? strdup(upstream_host) : NULL;
+	proxy->upstream_port = upstream_port != NULL ? strdup(upstream_port) : NULL;
+	proxy->listener = pumpRegisterServer(pump, port, proxy);
+	proxy->listener->onAccept = on_accept;
+	proxy->listener->onRemoved = on_listener_removed;
+
+	return proxy;
+}
+
+/*
+ * Stops accepting. All sessions must have ended. Stopping the pump
+ * ends them. Call before deleteEventPump().
+ */
+void deleteProxy(Proxy *proxy) {
+	assert(proxy->session_count == 0);
+
+	if (proxy->listener != NULL) {
+		proxy->listener->onRemoved = NULL;
+		close(proxy->listener->socket);
+		pumpRemoveSocket(proxy->pump, proxy->listener);
+	}
+
+	free(proxy->upstream_host);
+	free(proxy->upstream_port);
+	free(proxy);
+}
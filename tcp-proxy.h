@@ -0,0 +1,67 @@
+#ifndef TCP_PROXY_H
+#define TCP_PROXY_H
+
+#include "event-pump.h"
+#include "upstream-pool.h"
+
+//Bytes moved by one splice() call
+#define PROXY_SPLICE_SIZE (64 * 1024)
+//Requested kernel pipe capacity. Not an error if refused.
+#define PROXY_PIPE_SIZE (256 * 1024)
+
+struct _Proxy;
+struct _ProxySession;
+
+/*
+ * One direction of a session. Data read from the source socket is
+ * spliced into the pipe and from there into the destination socket.
+ * It never enters user memory.
+ */
+typedef struct _ProxyStream {
+	SocketRec *from;
+	SocketRec *to;
+	int pipe[2];
+	//Bytes sitting in the pipe
+	size_t pending;
+	//Source has sent FIN
+	int eof;
+	//FIN has been passed on to the destination
+	int shut;
+} ProxyStream;
+
+typedef struct _ProxySession {
+	struct _Proxy *proxy;
+	SocketRec *downstream;
+	SocketRec *upstream;
+	//NULL unless the proxy has a pool
+	Backend *backend;
+	//downstream to upstream
+	ProxyStream request;
+	//upstream to downstream
+	ProxyStream response;
+	int connected;
+	void *data;
+} ProxySession;
+
+typedef struct _Proxy {
+	EventPump *pump;
+	SocketRec *listener;
+	char *upstream_host;
+	char *upstream_port;
+	//Used instead of upstream_host if not NULL
+	UpstreamPool *pool;
+	int session_count;
+	void *data;
+
+	void (*onSessionStart)(struct _Proxy *proxy, ProxySession *session);
+	//downstream or upstream is NULL if the pump freed it, as
+	//pumpStop() and deleteEventPump() do
+	void (*onSessionEnd)(struct _Proxy *proxy, ProxySession *session);
+} Proxy;
+
+Proxy *newProxy(EventPump *pump, int port, const char *upstream_host, const char *upstream_port);
+void deleteProxy(Proxy *proxy);
+ProxySession *proxyStartSession(Proxy *proxy, int socket);
+void proxyEndSession(ProxySession *session);
+
+#endif
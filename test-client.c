@@ -21,7 +21,7 @@ char req[1024];
 static void onReadable(SocketRec *rec) {
 	char buff[256];
 
-	int len = read(rec->socket, buff, sizeof(buff));
+	int len = pumpRead(rec, buff, sizeof(buff));
 
 	if (len == 0) {
 		_info("Server has disconnected.\n");
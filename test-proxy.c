@@ -0,0 +1,62 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "tcp-proxy.h"
+
+#define _info printf("INFO: "); printf
+
+static void onSessionStart(Proxy *proxy, ProxySession *session) {
+	_info("Session started: %d -> %s:%s\n", session->downstream->socket,
+		session->backend->host, session->backend->port);
+}
+
+static void onSessionEnd(Proxy *proxy, ProxySession *session) {
+	//A record already freed by the pump is NULL
+	_info("Session ended: %d -> %d\n",
+		session->downstream != NULL ? session->downstream->socket : -1,
+		session->upstream != NULL ? session->upstream->socket : -1);
+}
+
+static void onBackendChange(UpstreamPool *pool, Backend *backend) {
+	_info("Backend %s:%s is %s\n", backend->host, backend->port,
+		backend->healthy ? "up" : "down");
+}
+
+int main(int argc, char **argv) {
+	if (argc < 4 || argc % 2 != 0) {
+		puts("Usage: test-proxy port upstream_host upstream_port [upstream_host upstream_port]...");
+		return 1;
+	}
+
+	int port = 0;
+
+	if (sscanf(argv[1], "%d", &port) < 1) {
+		printf("Invalid port: %s\n", argv[1]);
+
+		return 1;
+	}
+
+	EventPump *pump = newEventPump();
+	UpstreamPool *pool = newUpstreamPool(pump, UPSTREAM_LEAST_OUTSTANDING);
+
+	pool->onBackendChange = onBackendChange;
+
+	for (int i = 2; i < argc; i += 2) {
+		upstreamAddBackend(pool, argv[i], argv[i + 1]);
+	}
+
+	Proxy *proxy = newProxy(pump, port, NULL, NULL);
+
+	proxy->pool = pool;
+	proxy->onSessionStart = onSessionStart;
+	proxy->onSessionEnd = onSessionEnd;
+
+	upstreamStartProbes(pool);
+	pumpStart(pump);
+
+	deleteProxy(proxy);
+	deleteUpstreamPool(pool);
+	deleteEventPump(pump);
+
+	return 0;
+}
@@ -2,28 +2,45 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <dirent.h>
 #include <assert.h>
-#include <sys/stat.h>
 
-#include "socket-framework.h"
+#include "http-server.h"
+#include "http-range.h"
+#include "file-cache.h"
+#include "file-reader.h"
 
 #define _info printf
 #define HTTP_PORT 9090
+#define NOT_FOUND_HEADERS "Content-Length: 0\r\n"
+#define LISTING_HEADERS "Content-Type: text/plain\r\n"
+
+FileCache *file_cache;
+//Reads the files so that a slow disk does not stall the loop
+WorkPool *work_pool;
 
 typedef enum {
 	STATE_NONE,
-	STATE_READ_HEADER,
 	WRITE_RESPONSE_HEADER,
 	WRITE_RESPONSE_BODY
 } ParseState;
 
 typedef struct _HTTPState {
 	ParseState parse_state;
-	char verb[128];
 	char file_name[1024];
-	char write_buffer[1024];
-	char read_buffer[1024];
-	FILE *file;
+	//Reads the file segment being written
+	FileReader *reader;
+	FileCacheEntry *file;
+	//The file or its precompressed variant
+	FileCacheEntry *body;
+	HTTPRangeResponse range;
+	//Position in the body being written
+	int segment;
+	size_t segment_offset;
+	//Directory being listed
+	DIR *dir;
+	//Entry that did not fit in the last chunk
+	struct dirent *pending;
 } HTTPState;
 
 void
@@ -31,171 +48,267 @@ init_server(Server* state) {
 	_info("Server listening on %d.\n", HTTP_PORT);
 }
 
-void on_connect(Server *state, Client *cli_state) {
-	_info("Client connected %d\n", cli_state->fd);
-	HTTPState *httpState = (HTTPState*) malloc(sizeof(HTTPState));
+void on_connect(HTTPServer *http, HTTPConnection *conn) {
+	_info("Client connected %d\n", conn->client->fd);
+	//Freed with the connection
+	HTTPState *httpState = arenaAlloc(&conn->client->arena, sizeof(HTTPState));
 
+	httpState->parse_state = STATE_NONE;
 	httpState->file = NULL;
+	httpState->dir = NULL;
+	httpState->reader = NULL;
 
-	cli_state->data = httpState;
-
-	//Start reading protocol line
-	httpState->parse_state = STATE_READ_HEADER;
-	memset(httpState->read_buffer, '\0', sizeof(httpState->read_buffer));
-	int status = clientScheduleRead(cli_state, httpState->read_buffer, 
-		sizeof(httpState->read_buffer));
-
-	assert(status == 0);
+	conn->data = httpState;
 }
 
-void on_disconnect(Server *state, Client *cli_state) {
-	_info("Client disconnected %d\n", cli_state->fd);
+void on_disconnect(HTTPServer *http, HTTPConnection *conn) {
+	_info("Client disconnected %d\n", conn->client->fd);
+
+	HTTPState *httpState = (HTTPState*) conn->data;
 
-	HTTPState *httpState = (HTTPState*) cli_state->data;
+	if (httpState->reader != NULL) {
+		deleteFileReader(httpState->reader);
 
+		httpState->reader = NULL;
+	}
 	if (httpState->file != NULL) {
-		fclose(httpState->file);
+		fileCacheRelease(file_cache, httpState->file);
 
 		httpState->file = NULL;
 	}
+	if (httpState->dir != NULL) {
+		closedir(httpState->dir);
 
-	free(httpState);
+		httpState->dir = NULL;
+	}
 }
 
-void
-write_to_client(HTTPState *http, Client *cli_state, char* line) {
-	char *end = stpncpy(http->write_buffer, line, sizeof(http->write_buffer));
+void on_file_chunk(FileReader *reader, char *data, ssize_t length) {
+	HTTPConnection *conn = reader->data;
+	HTTPState *httpState = (HTTPState*) conn->data;
 
-	clientScheduleWrite(cli_state, http->write_buffer, end - http->write_buffer);
+	if (length > 0) {
+		httpState->segment_offset += length;
+		httpScheduleWrite(conn, data, length);
+	} else {
+		//The file has shrunk or can not be read
+		perror("File read failed.");
+		httpDisconnect(conn);
+	}
 }
 
-void 
-transfer_file_data(Server *state, Client *cli_state) {
-	HTTPState *httpState = (HTTPState*) cli_state->data;
+void
+transfer_file_data(HTTPConnection *conn) {
+	HTTPState *httpState = (HTTPState*) conn->data;
 
 	assert(httpState->file != NULL);
 	assert(httpState->parse_state == WRITE_RESPONSE_BODY);
 
-	int length = fread(httpState->write_buffer, 1, 
-		sizeof(httpState->write_buffer), httpState->file);
+	HTTPRangeResponse *range = &httpState->range;
 
-	if (length > 0) {
-		clientScheduleWrite(cli_state, httpState->write_buffer, length);
-	} else if (feof(httpState->file)) {
+	if (httpState->reader != NULL) {
+		if (httpState->segment_offset < range->segments[httpState->segment].length) {
+			//The next chunk is probably loaded already
+			fileReaderNext(httpState->reader);
+
+			return;
+		}
+
+		deleteFileReader(httpState->reader);
+		httpState->reader = NULL;
+	}
+
+	while (httpState->segment < range->segment_count &&
+		httpState->segment_offset == range->segments[httpState->segment].length) {
+		httpState->segment += 1;
+		httpState->segment_offset = 0;
+	}
+
+	if (httpState->segment == range->segment_count) {
 		//We are done writing
-		fclose(httpState->file);
+		fileCacheRelease(file_cache, httpState->file);
 		httpState->file = NULL;
 
 		//Allow the client to send another request.
-		httpState->parse_state = STATE_READ_HEADER;
-	} else {
-		perror("File read failed.");
-		serverDisconnect(state, cli_state);
+		httpState->parse_state = STATE_NONE;
+		httpResponseCompleted(conn);
+
+		return;
 	}
-}
 
-void on_read(Server *state, Client *cli_state, char *buff, size_t length) {
-	HTTPState *httpState = (HTTPState*) cli_state->data;
+	HTTPSegment *segment = range->segments + httpState->segment;
 
-	if (httpState->parse_state == STATE_READ_HEADER) {
-		//See if we got the verb and file path.
-		//Protocol line will have two spaces: GET /index.php HTTP/1.1
-		int space_count = 0;
+	if (segment->data != NULL) {
+		//Multipart boundary
+		httpState->segment_offset = segment->length;
+		httpScheduleWrite(conn, (char*) segment->data, segment->length);
 
-		for (size_t i = 0; i < cli_state->read_completed; ++i) {
-			if (httpState->read_buffer[i] == ' ') {
-				space_count += 1;
-			}
+		return;
+	}
 
-			if (space_count == 2) {
-				char tmp[1024];
-				
-				sscanf(httpState->read_buffer, "%s %s", httpState->verb, tmp);
-				sprintf(httpState->file_name, ".%s", tmp);
+	//Continued by on_file_chunk()
+	httpState->reader = newFileReader(work_pool, httpState->body->fd,
+		segment->offset, segment->length, on_file_chunk, conn);
 
-				clientCancelRead(cli_state);
+	if (httpState->reader == NULL) {
+		httpDisconnect(conn);
+	}
+}
 
-				_info("Request verb: %s path: %s\n", httpState->verb, httpState->file_name);
+/*
+ * Writes one line per directory entry. The listing can be of any
+ * size. It is streamed in chunks.
+ */
+ssize_t produce_listing(HTTPConnection *conn, char *buffer, size_t size) {
+	HTTPState *httpState = (HTTPState*) conn->data;
+	size_t length = 0;
 
-				httpState->file = fopen(httpState->file_name, "r");
-				httpState->parse_state = WRITE_RESPONSE_HEADER;
+	while (1) {
+		struct dirent *entry = httpState->pending != NULL ?
+			httpState->pending : readdir(httpState->dir);
 
-				if (httpState->file == NULL) {
-					write_to_client(httpState, cli_state, "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n");
-				} else {
-					struct stat st;
+		httpState->pending = NULL;
 
-					int status = stat(httpState->file_name, &st);
+		if (entry == NULL) {
+			break;
+		}
 
-					if (status == 0) {
-						sprintf(tmp, "HTTP/1.1 200 OK\r\nContent-Length: %lld\r\n\r\n", st.st_size);
-					} else {
-						perror("Can not stat file.");
+		size_t name_length = strlen(entry->d_name);
 
-						strcpy(tmp, "HTTP/1.1 500 Internal Server Error\r\nContent-Length: 0\r\n\r\n");
+		if (length + name_length + 1 > size) {
+			//Send it with the next chunk
+			httpState->pending = entry;
 
-						fclose(httpState->file);
-						httpState->file = NULL;
-					}
+			break;
+		}
 
-					write_to_client(httpState, cli_state, tmp);
-				}
+		memcpy(buffer + length, entry->d_name, name_length);
+		length += name_length;
+		buffer[length++] = '\n';
+	}
 
-				break;
-			}
+	if (length == 0) {
+		//Listing is done
+		closedir(httpState->dir);
+		httpState->dir = NULL;
+		httpState->parse_state = STATE_NONE;
+	}
+
+	return length;
+}
+
+void on_request(HTTPServer *http, HTTPConnection *conn, HTTPRequest *req) {
+	HTTPState *httpState = (HTTPState*) conn->data;
+
+	snprintf(httpState->file_name, sizeof(httpState->file_name), ".%.*s",
+		(int) req->path.length, req->path.data);
+
+	_info("Request verb: %.*s path: %s\n", (int) req->method.length,
+		req->method.data, httpState->file_name);
+
+	httpState->file = fileCacheAcquire(file_cache, httpState->file_name,
+		strlen(httpState->file_name));
+	httpState->segment = 0;
+	httpState->segment_offset = 0;
+	httpState->range.segment_count = 0;
+	httpState->parse_state = WRITE_RESPONSE_HEADER;
+
+	//HEAD gets the headers only
+	int head = httpStringEquals(&req->method, "HEAD");
+
+	if (httpState->file == NULL) {
+		httpState->dir = opendir(httpState->file_name);
+
+		if (httpState->dir != NULL && head) {
+			closedir(httpState->dir);
+			httpState->dir = NULL;
+			httpSendHeader(conn, 200, LISTING_HEADERS, strlen(LISTING_HEADERS));
+		} else if (httpState->dir != NULL) {
+			httpState->pending = NULL;
+			httpStartStream(conn, 200, LISTING_HEADERS, strlen(LISTING_HEADERS),
+				produce_listing);
+		} else {
+			httpSendHeader(conn, 404, NOT_FOUND_HEADERS, strlen(NOT_FOUND_HEADERS));
+		}
+	} else {
+		httpState->body = fileCacheSelectVariant(httpState->file,
+			httpAcceptedEncodings(req));
+
+		int status = httpPrepareRangeResponse(&httpState->range, req,
+			httpState->body->st.st_size, httpState->body->headers,
+			httpState->body->headers_length, httpState->body->entity_offset);
+
+		if (head) {
+			//transfer_file_data() completes the response at once
+			httpState->range.segment_count = 0;
 		}
+
+		httpSendHeader(conn, status, httpState->range.headers,
+			httpState->range.headers_length);
 	}
 }
 
-void on_write_completed(Server *state, Client *cli_state) {
-	HTTPState *httpState = (HTTPState*) cli_state->data;
+void on_write_completed(HTTPServer *http, HTTPConnection *conn) {
+	HTTPState *httpState = (HTTPState*) conn->data;
 
 	if (httpState->parse_state == WRITE_RESPONSE_HEADER) {
 		if (httpState->file != NULL) {
 			//Initiate file transfer
 			httpState->parse_state = WRITE_RESPONSE_BODY;
 
-			transfer_file_data(state, cli_state);
+			transfer_file_data(conn);
+		} else {
+			//Error response has no body
+			httpState->parse_state = STATE_NONE;
+			httpResponseCompleted(conn);
 		}
 	} else if (httpState->parse_state == WRITE_RESPONSE_BODY) {
 		if (httpState->file != NULL) {
 			//Continue file transfer
-			transfer_file_data(state, cli_state);
+			transfer_file_data(conn);
 		}
 	}
 }
 
-void on_read_completed(Server *state, Client *cli_state) {
-	HTTPState *httpState = (HTTPState*) cli_state->data;
-
-	//If we are still parsing request then request is too long
-	if (httpState->parse_state == STATE_READ_HEADER) {
-		_info("Request larger than %ld\n", sizeof(httpState->read_buffer));
+void on_file_change(int fd, void *data) {
+	fileCacheProcessEvents((FileCache*) data);
+}
 
-		serverDisconnect(state, cli_state);
-	}
+void on_work_completed(int fd, void *data) {
+	workPoolProcessCompletions((WorkPool*) data);
 }
 
 int main() {
-	Server *state = newServer(HTTP_PORT);
-
-	state->on_loop_start = init_server;
-	state->on_client_connect = on_connect;
-	state->on_client_disconnect = on_disconnect;
-	state->on_read = on_read;
-	state->on_read_completed = on_read_completed;
-	//state->on_write = on_write;
-	state->on_write_completed = on_write_completed;
-
-	serverStart(state);
-    
+	file_cache = newFileCache(1024 * 1024, 256);
+	//The body is read in chunks. No need to map the files.
+	file_cache->map_files = 0;
+	work_pool = newWorkPool(WORK_POOL_DEFAULT_THREADS);
+
+	HTTPServer *http = newHTTPServer(HTTP_PORT);
+
+	http->server->on_loop_start = init_server;
+	http->on_connect = on_connect;
+	http->on_disconnect = on_disconnect;
+	http->on_request = on_request;
+	http->on_write_completed = on_write_completed;
+
+	serverStart(http->server);
+
     EventLoop loop;
-    
+
     loopInit(&loop);
-    
-    loopAddServer(&loop, state);
-    
+
+    loopAddServer(&loop, http->server);
+
+    if (fileCacheNotifyFd(file_cache) >= 0) {
+        loopAddWatch(&loop, fileCacheNotifyFd(file_cache), on_file_change, file_cache);
+    }
+
+    loopAddWatch(&loop, workPoolNotifyFd(work_pool), on_work_completed, work_pool);
+
     loopStart(&loop);
 
-	deleteServer(state);
+	deleteHTTPServer(http);
+	deleteWorkPool(work_pool);
+	deleteFileCache(file_cache);
 }
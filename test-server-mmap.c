@@ -1,194 +1,214 @@
 #include <stdio.h>
-#include <sys/mman.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <assert.h>
-#include <sys/stat.h>
-#include <fcntl.h>
 
-#include "socket-framework.h"
+#include "http-server.h"
+#include "http-range.h"
+#include "http-router.h"
+#include "file-cache.h"
 
 #define _info printf
+#define HTTP_PORT 9090
+#define FILE_NAME "image.png"
+#define ERROR_HEADERS "Content-Length: 0\r\n"
+
+FileCache *file_cache;
+HTTPRouter *router;
 
 typedef enum {
 	STATE_NONE,
-	STATE_READING_PROTOCOL_LINE,
-	STATE_PROTOCOL_DONE,
-	STATE_READING_HEADER,
-	STATE_HEADER_DONE,
-	STATE_READING_BODY,
-	HEADER_READ_COMPLETED,
 	WRITING_RESPONSE_HEADER,
-	WRITING_RESPONSE_BODY,
-	RESPONSE_COMPLETED
-} ParseState;
+	WRITING_RESPONSE_BODY
+} ResponseState;
 
 typedef struct _HTTPState {
-	ParseState parse_state;
-	char buffer[1024];
-	char io_buffer[1024];
-	int position;
-	int file;
-	off_t file_size;
-	void *file_map;
+	ResponseState response_state;
+	FileCacheEntry *file;
+	//The file or its precompressed variant
+	FileCacheEntry *body;
+	HTTPRangeResponse range;
+	struct iovec iov[HTTP_MAX_SEGMENTS];
 } HTTPState;
 
 void
 init_server(Server* state) {
-	_info("Server loop is starting");
+	_info("Server listening on %d.\n", HTTP_PORT);
 }
 
-void on_connect(Server *state, Client *cli_state) {
-	_info("Client connected %d", cli_state->fd);
-	HTTPState *httpState = (HTTPState*) malloc(sizeof(HTTPState));
-	httpState->parse_state = STATE_READING_PROTOCOL_LINE;
-	httpState->position = 0;
-	httpState->file = -1;
-	httpState->file_map = NULL;
+void on_connect(HTTPServer *http, HTTPConnection *conn) {
+	_info("Client connected %d\n", conn->client->fd);
+	//Freed with the connection
+	HTTPState *httpState = arenaAlloc(&conn->client->arena, sizeof(HTTPState));
+	httpState->response_state = STATE_NONE;
+	httpState->file = NULL;
+	httpState->body = NULL;
 
-	cli_state->data = httpState;
+	conn->data = httpState;
+}
 
-	//Start reading request
-	int status = clientScheduleRead(cli_state, httpState->io_buffer, 
-		sizeof(httpState->io_buffer));
-	assert(status == 0);
+void
+release_file(HTTPState *httpState) {
+	if (httpState->file != NULL) {
+		fileCacheRelease(file_cache, httpState->file);
+		httpState->file = NULL;
+		httpState->body = NULL;
+	}
 }
 
-void on_disconnect(Server *state, Client *cli_state) {
-	_info("Client disconnected %d", cli_state->fd);
+void on_disconnect(HTTPServer *http, HTTPConnection *conn) {
+	_info("Client disconnected %d\n", conn->client->fd);
+
+	HTTPState *httpState = (HTTPState*) conn->data;
+
+	release_file(httpState);
+}
+
+void send_error(HTTPConnection *conn, int status) {
+	HTTPState *httpState = (HTTPState*) conn->data;
+
+	httpState->range.segment_count = 0;
+	httpState->response_state = WRITING_RESPONSE_HEADER;
+
+	httpSendHeader(conn, status, ERROR_HEADERS, strlen(ERROR_HEADERS));
+}
 
-	HTTPState *httpState = (HTTPState*) cli_state->data;
+void serve_file(HTTPConnection *conn, HTTPRequest *req, const char *path, size_t length) {
+	HTTPState *httpState = (HTTPState*) conn->data;
 
-	if (httpState->file_map != NULL) {
-		_info("Unmapping file.");
-		int status = munmap(httpState->file_map, httpState->file_size);
-		assert(status == 0);
-		httpState->file_map = NULL;
+	//Held until the response is written
+	httpState->file = fileCacheAcquire(file_cache, path, length);
+
+	if (httpState->file == NULL) {
+		send_error(conn, 404);
+
+		return;
 	}
-	if (httpState->file > 0) {
-		_info("Closing file.");
-		close(httpState->file);
+
+	httpState->body = fileCacheSelectVariant(httpState->file,
+		httpAcceptedEncodings(req));
+
+	if (httpState->body->map == NULL && httpState->body->st.st_size > 0) {
+		//Larger than the cache budget or the mapping failed
+		release_file(httpState);
+		send_error(conn, 503);
+
+		return;
 	}
 
-	free(httpState);
-}
+	httpState->response_state = WRITING_RESPONSE_HEADER;
+	_info("Scheduling response header.\n");
 
-void
-stuff_request_byte(HTTPState *state, char c) {
-	if (state->parse_state == STATE_READING_PROTOCOL_LINE) {
-		if (c == '\r') {
-		} else if (c == '\n') {
-			state->buffer[state->position] = '\0';
-			_info("Protocol line [%s]", state->buffer);
-			state->parse_state = STATE_PROTOCOL_DONE;
-			state->position = 0;
-		} else {
-			state->buffer[state->position] = c;
-			state->position += 1;
-		}	
-	} else if (state->parse_state == STATE_READING_HEADER) {
-		if (c == '\r') {
-		} else if (c == '\n') {
-			state->buffer[state->position] = '\0';
-			_info("Header line [%s]", state->buffer);
-			if (state->position == 0) {
-				state->parse_state = HEADER_READ_COMPLETED;
-			} else {
-				state->parse_state = STATE_HEADER_DONE;
-			}
-			state->position = 0;
-		} else {
-			state->buffer[state->position] = c;
-			state->position += 1;
-		}	
+	int status = httpPrepareRangeResponse(&httpState->range, req,
+		httpState->body->st.st_size, httpState->body->headers,
+		httpState->body->headers_length, httpState->body->entity_offset);
+
+	if (httpState->body->st.st_size == 0 || httpStringEquals(&req->method, "HEAD")) {
+		//No body to write
+		httpState->range.segment_count = 0;
 	}
-}
 
+	httpSendHeader(conn, status, httpState->range.headers,
+		httpState->range.headers_length);
+}
 
-void
-start_response(Client *cli_state) {
-	_info("Starting response.");
-	struct stat st;
-
-	int status = stat("image.png", &st);
-	assert(status == 0);
-
-	char str[1024];
-	sprintf(str, "HTTP/1.1 200 OK\r\nContent-Length: %lld\r\n\r\n",
-		st.st_size);
-	
-	HTTPState *httpState = (HTTPState*) cli_state->data;
-	httpState->file_size = st.st_size;
-	httpState->parse_state = WRITING_RESPONSE_HEADER;
-	_info("Scheduling response header.");
-	clientScheduleWrite(cli_state, str, strlen(str));
+void on_image(HTTPConnection *conn, HTTPRequest *req, HTTPRouteMatch *match) {
+	serve_file(conn, req, FILE_NAME, strlen(FILE_NAME));
 }
 
-void on_read(Server *state, Client *cli_state, char *buff, int length) {
-	HTTPState *httpState = (HTTPState*) cli_state->data;
+void on_static_file(HTTPConnection *conn, HTTPRequest *req, HTTPRouteMatch *match) {
+	HTTPString *name = httpRouteParam(match, "name");
+	char path[1024];
+	int length = snprintf(path, sizeof(path), "./%.*s", (int) name->length, name->data);
 
-	for (int i = 0; i < length; ++i) {
-		stuff_request_byte(httpState, buff[i]);
+	//Stay inside the current directory
+	if (name->length == 0 || strstr(path, "..") != NULL || length >= (int) sizeof(path)) {
+		send_error(conn, 404);
 
-		if (httpState->parse_state == STATE_PROTOCOL_DONE) {
-			httpState->parse_state = STATE_READING_HEADER;
-		} else if (httpState->parse_state == STATE_HEADER_DONE) {
-			httpState->parse_state = STATE_READING_HEADER;
-		} else if (httpState->parse_state == HEADER_READ_COMPLETED) {
-			//Send response
-			clientCancelRead(cli_state);
-			start_response(cli_state);
-		}
+		return;
 	}
+
+	serve_file(conn, req, path, length);
 }
 
-void on_write_completed(Server *state, Client *cli_state) {
-	HTTPState *httpState = (HTTPState*) cli_state->data;
-
-	if (httpState->parse_state == WRITING_RESPONSE_HEADER) {
-		httpState->file = open("image.png", O_RDONLY);
-		assert(httpState->file > 0);
-		httpState->file_map = mmap(
-			NULL, httpState->file_size, 
-			PROT_READ, MAP_SHARED,
-			httpState->file, 0);
-		assert(httpState->file_map != MAP_FAILED);
-		httpState->parse_state = WRITING_RESPONSE_BODY;
-		_info("Dumping mmap buffer.");
-		clientScheduleWrite(cli_state, httpState->file_map, 
-			httpState->file_size);
-	} else if (httpState->parse_state == WRITING_RESPONSE_BODY) {
-		_info("Done writing response. Disconnecting...");
-		httpState->parse_state = RESPONSE_COMPLETED;
-		//We are done. Disconnect.
-		serverDisconnect(state, cli_state);
+void on_request(HTTPServer *http, HTTPConnection *conn, HTTPRequest *req) {
+	_info("Request %.*s %.*s\n", (int) req->method.length, req->method.data,
+		(int) req->path.length, req->path.data);
+
+	int status = httpRouterDispatch(router, conn, req);
+
+	if (status != HTTP_ROUTE_DISPATCHED) {
+		send_error(conn, status);
 	}
 }
 
-void on_read_completed(Server *state, Client *cli_state) {
-	//If we are still parsing request, keep reading
-	HTTPState *httpState = (HTTPState*) cli_state->data;
-	if (httpState->parse_state < HEADER_READ_COMPLETED) {
-		_info("Still need to read header.");
-		int status = clientScheduleRead(cli_state, httpState->io_buffer, 
-			sizeof(httpState->io_buffer));
-		assert(status == 0);
+void on_write_completed(HTTPServer *http, HTTPConnection *conn) {
+	HTTPState *httpState = (HTTPState*) conn->data;
+
+	if (httpState->response_state == WRITING_RESPONSE_HEADER &&
+		httpState->range.segment_count > 0) {
+		HTTPRangeResponse *range = &httpState->range;
+
+		//Part headers and slices of the mapped file go out in one writev()
+		for (int i = 0; i < range->segment_count; ++i) {
+			HTTPSegment *segment = range->segments + i;
+
+			httpState->iov[i].iov_base = segment->data != NULL ?
+				(void*) segment->data :
+				(char*) httpState->body->map + segment->offset;
+			httpState->iov[i].iov_len = segment->length;
+		}
+
+		httpState->response_state = WRITING_RESPONSE_BODY;
+		_info("Dumping mmap buffer.\n");
+		httpScheduleWriteV(conn, httpState->iov, range->segment_count);
+	} else {
+		_info("Done writing response.\n");
+		httpState->response_state = STATE_NONE;
+		release_file(httpState);
+		//Wait for the next request on this connection
+		httpResponseCompleted(conn);
 	}
 }
 
+void on_file_change(int fd, void *data) {
+	fileCacheProcessEvents((FileCache*) data);
+}
+
 int main() {
-	Server *state = newServer(9090);
+	file_cache = newFileCache(64 * 1024 * 1024, 64);
+	router = newHTTPRouter();
+
+	httpRouterAdd(router, "GET", "/", on_image, NULL);
+	httpRouterAdd(router, "HEAD", "/", on_image, NULL);
+	httpRouterAdd(router, "GET", "/" FILE_NAME, on_image, NULL);
+	httpRouterAdd(router, "GET", "/files/*name", on_static_file, NULL);
+	httpRouterCompile(router);
+
+	HTTPServer *http = newHTTPServer(HTTP_PORT);
+
+	http->server->on_loop_start = init_server;
+	http->on_connect = on_connect;
+	http->on_disconnect = on_disconnect;
+	http->on_request = on_request;
+	http->on_write_completed = on_write_completed;
 
-	state->on_loop_start = init_server;
-	state->on_client_connect = on_connect;
-	state->on_client_disconnect = on_disconnect;
-	state->on_read = on_read;
-	state->on_read_completed = on_read_completed;
-	//state->on_write = on_write;
-	state->on_write_completed = on_write_completed;
+	serverStart(http->server);
+
+	EventLoop loop;
+
+	loopInit(&loop);
+
+	loopAddServer(&loop, http->server);
+
+	if (fileCacheNotifyFd(file_cache) >= 0) {
+		loopAddWatch(&loop, fileCacheNotifyFd(file_cache), on_file_change, file_cache);
+	}
 
-	serverStart(state);
+	loopStart(&loop);
 
-	deleteServer(state);
+	deleteHTTPServer(http);
+	deleteHTTPRouter(router);
+	deleteFileCache(file_cache);
 }
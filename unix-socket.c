@@ -0,0 +1,218 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "unix-socket.h"
+
+/*
+ * Fills addr for path. Returns -1 with ENAMETOOLONG if it does not fit.
+ */
+int unixAddress(const char *path, struct sockaddr_un *addr, socklen_t *length) {
+	size_t path_length = strlen(path);
+
+	if (path_length == 0 || path_length >= sizeof(addr->sun_path)) {
+		errno = path_length == 0 ? EINVAL : ENAMETOOLONG;
+
+		return -1;
+	}
+
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	memcpy(addr->sun_path, path, path_length);
+
+	if (path[0] == '@') {
+		//Abstract names are not NUL terminated
+		addr->sun_path[0] = '\0';
+		*length = offsetof(struct sockaddr_un, sun_path) + path_length;
+	} else {
+		*length = offsetof(struct sockaddr_un, sun_path) + path_length + 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Unlinks path if it is a socket file nobody listens on. Anything
+ * else is left for bind() to fail on.
+ */
+static void remove_stale(const char *path, struct sockaddr_un *addr, socklen_t length, int type) {
+	struct stat st;
+
+	if (lstat(path, &st) < 0 || !S_ISSOCK(st.st_mode)) {
+		return;
+	}
+
+	int probe = socket(AF_UNIX, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+	if (probe < 0) {
+		return;
+	}
+
+	if (connect(probe, (struct sockaddr*) addr, length) < 0 && errno == ECONNREFUSED) {
+		unlink(path);
+	}
+
+	close(probe);
+}
+
+/*
+ * Returns a listening socket or -1. A stale socket file left at path
+ * by an earlier run is replaced. A live one fails with EADDRINUSE.
+ */
+int unixListen(const char *path, int type) {
+	struct sockaddr_un addr;
+	socklen_t length;
+
+	if (unixAddress(path, &addr, &length) < 0) {
+		return -1;
+	}
+
+	int sock = socket(AF_UNIX, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+	if (sock < 0) {
+		return -1;
+	}
+
+	if (path[0] != '@') {
+		remove_stale(path, &addr, length, type);
+	}
+
+	if (bind(sock, (struct sockaddr*) &addr, length) < 0 ||
+		listen(sock, UNIX_LISTEN_BACKLOG) < 0) {
+		int error = errno;
+
+		close(sock);
+		errno = error;
+
+		return -1;
+	}
+
+	return sock;
+}
+
+/*
+ * Returns a connected socket or -1. Unlike TCP a local connect
+ * completes at once or fails. EAGAIN means the listener's backlog
+ * is full.
+ */
+int unixConnect(const char *path, int type) {
+	struct sockaddr_un addr;
+	socklen_t length;
+
+	if (unixAddress(path, &addr, &length) < 0) {
+		return -1;
+	}
+
+	int sock = socket(AF_UNIX, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+	if (sock < 0) {
+		return -1;
+	}
+
+	if (connect(sock, (struct sockaddr*) &addr, length) < 0 && errno != EINPROGRESS) {
+		int error = errno;
+
+		close(sock);
+		errno = error;
+
+		return -1;
+	}
+
+	return sock;
+}
+
+/*
+ * Connected pair of non-blocking sockets. Close-on-exec is not set so
+ * one end can be inherited by a child process.
+ */
+int unixSocketPair(int type, int fds[2]) {
+	return socketpair(AF_UNIX, type | SOCK_NONBLOCK, 0, fds);
+}
+
+/*
+ * Sends fd along with data using SCM_RIGHTS. At least one byte of
+ * data is needed to carry it. Returns the bytes sent or -1.
+ */
+ssize_t unixSendFd(int sock, int fd, const void *data, size_t length) {
+	assert(length > 0);
+
+	union {
+		struct cmsghdr header;
+		char buffer[CMSG_SPACE(sizeof(int))];
+	} control;
+	struct iovec iov = {(void*) data, length};
+	struct msghdr msg;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(&control, 0, sizeof(control));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buffer;
+	msg.msg_controllen = sizeof(control.buffer);
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+	return sendmsg(sock, &msg, MSG_NOSIGNAL);
+}
+
+/*
+ * Receives data and a descriptor if one came with it. *fd is -1
+ * otherwise. Extra descriptors are closed. Received descriptors are
+ * close-on-exec. Returns the bytes received or -1.
+ */
+ssize_t unixReceiveFd(int sock, void *data, size_t length, int *fd) {
+	union {
+		struct cmsghdr header;
+		char buffer[CMSG_SPACE(4 * sizeof(int))];
+	} control;
+	struct iovec iov = {data, length};
+	struct msghdr msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buffer;
+	msg.msg_controllen = sizeof(control.buffer);
+
+	*fd = -1;
+
+	ssize_t result = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+
+	if (result < 0) {
+		return -1;
+	}
+
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+		cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+			continue;
+		}
+
+		int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+		for (int i = 0; i < count; ++i) {
+			int received;
+
+			memcpy(&received, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+
+			if (*fd < 0) {
+				*fd = received;
+			} else {
+				close(received);
+			}
+		}
+	}
+
+	return result;
+}
@@ -0,0 +1,23 @@
+#ifndef UNIX_SOCKET_H
+#define UNIX_SOCKET_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define UNIX_LISTEN_BACKLOG 64
+
+/*
+ * AF_UNIX helpers shared by Server, Client and EventPump. type is
+ * SOCK_STREAM or SOCK_SEQPACKET. A path starting with @ names an
+ * address in the Linux abstract namespace. Such addresses need no
+ * file and vanish with the last socket. Sockets are non-blocking.
+ */
+int unixAddress(const char *path, struct sockaddr_un *addr, socklen_t *length);
+int unixListen(const char *path, int type);
+int unixConnect(const char *path, int type);
+int unixSocketPair(int type, int fds[2]);
+ssize_t unixSendFd(int sock, int fd, const void *data, size_t length);
+ssize_t unixReceiveFd(int sock, void *data, size_t length, int *fd);
+
+#endif
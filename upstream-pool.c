@@ -0,0 +1,546 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <netdb.h>
+
+#include "upstream-pool.h"
+
+#define DEBUG 0
+
+#if DEBUG
+#define _info printf("INFO: "); printf
+#else
+#define _info(...)
+#endif
+
+static void start_probe(Backend *backend);
+
+typedef struct _BackendResolve {
+	//NULL once the probe has ended
+	Backend *backend;
+	char *host;
+	char *port;
+	struct sockaddr_storage address;
+	socklen_t address_length;
+} BackendResolve;
+
+/*
+ * Resolves to the first address. Returns the address length or 0.
+ * Blocks.
+ */
+static socklen_t resolve(const char *host, const char *port,
+	struct sockaddr_storage *address) {
+	struct addrinfo hints, *res;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if (getaddrinfo(host, port, &hints, &res) != 0) {
+		return 0;
+	}
+
+	socklen_t length = res->ai_addrlen;
+
+	memcpy(address, res->ai_addr, length);
+	freeaddrinfo(res);
+
+	return length;
+}
+
+static unsigned int next_random(UpstreamPool *pool) {
+	//xorshift32
+	unsigned int x = pool->random_state;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+
+	pool->random_state = x;
+
+	return x;
+}
+
+static int backend_index(Backend *backend) {
+	UpstreamPool *pool = backend->pool;
+
+	for (int i = 0; i < pool->backend_count; ++i) {
+		if (pool->backends[i] == backend) {
+			return i;
+		}
+	}
+
+	abort();
+}
+
+static void notify(Backend *backend) {
+	UpstreamPool *pool = backend->pool;
+
+	if (pool->onBackendChange != NULL) {
+		pool->onBackendChange(pool, backend);
+	}
+}
+
+static void eject(Backend *backend) {
+	UpstreamPool *pool = backend->pool;
+	int index = backend_index(backend);
+
+	_info("Ejecting %s:%s\n", backend->host, backend->port);
+
+	for (int i = 0; i < pool->healthy_count; ++i) {
+		if (pool->healthy[i] == index) {
+			pool->healthy[i] = pool->healthy[pool->healthy_count - 1];
+			pool->healthy_count -= 1;
+
+			break;
+		}
+	}
+
+	backend->healthy = 0;
+	backend->backoff = pool->min_backoff;
+
+	notify(backend);
+}
+
+static void reinstate(Backend *backend) {
+	UpstreamPool *pool = backend->pool;
+
+	_info("Reinstating %s:%s\n", backend->host, backend->port);
+
+	pool->healthy[pool->healthy_count] = backend_index(backend);
+	pool->healthy_count += 1;
+
+	backend->healthy = 1;
+	backend->backoff = 0;
+
+	notify(backend);
+}
+
+static void mark_success(Backend *backend) {
+	backend->failures = 0;
+
+	if (!backend->healthy) {
+		reinstate(backend);
+	}
+}
+
+static void mark_failure(Backend *backend) {
+	backend->failures += 1;
+
+	if (backend->healthy && backend->failures >= backend->pool->failure_threshold) {
+		eject(backend);
+	}
+}
+
+static void on_probe_timer(PumpTimer *timer) {
+	Backend *backend = timer->data;
+
+	//The pump frees the timer
+	backend->timer = NULL;
+
+	start_probe(backend);
+}
+
+static void schedule_probe(Backend *backend, long delay) {
+	backend->probe_state = BACKEND_PROBE_IDLE;
+	backend->timer = pumpAddTimer(backend->pool->pump, delay, on_probe_timer, backend);
+}
+
+static void end_probe(Backend *backend) {
+	if (backend->resolve != NULL) {
+		//Freed when the resolution completes
+		backend->resolve->backend = NULL;
+		backend->resolve = NULL;
+	}
+
+	if (backend->probe != NULL) {
+		SocketRec *rec = backend->probe;
+
+		rec->onConnect = NULL;
+		rec->onReadable = NULL;
+		rec->onRemoved = NULL;
+		rec->data = NULL;
+		pumpCancelWrite(rec);
+
+		close(rec->socket);
+		pumpRemoveSocket(backend->pool->pump, rec);
+
+		backend->probe = NULL;
+	}
+
+	if (backend->timer != NULL) {
+		pumpCancelTimer(backend->timer);
+
+		backend->timer = NULL;
+	}
+}
+
+static void probe_succeeded(Backend *backend) {
+	end_probe(backend);
+	mark_success(backend);
+	schedule_probe(backend, backend->pool->probe_interval);
+}
+
+static void probe_failed(Backend *backend) {
+	UpstreamPool *pool = backend->pool;
+
+	_info("Probe failed for %s:%s\n", backend->host, backend->port);
+
+	end_probe(backend);
+	mark_failure(backend);
+
+	if (backend->healthy) {
+		schedule_probe(backend, pool->probe_interval);
+
+		return;
+	}
+
+	//Exponential backoff while ejected
+	long delay = backend->backoff;
+
+	backend->backoff = backend->backoff * 2 > pool->max_backoff ?
+		pool->max_backoff : backend->backoff * 2;
+
+	schedule_probe(backend, delay);
+}
+
+static void on_probe_timeout(PumpTimer *timer) {
+	Backend *backend = timer->data;
+
+	backend->timer = NULL;
+
+	probe_failed(backend);
+}
+
+static void on_probe_readable(SocketRec *rec) {
+	Backend *backend = rec->data;
+	size_t space = sizeof(backend->probe_response) - backend->probe_response_length;
+	ssize_t length = read(rec->socket,
+		backend->probe_response + backend->probe_response_length, space);
+
+	if (length < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		return;
+	}
+	if (length <= 0) {
+		probe_failed(backend);
+
+		return;
+	}
+
+	backend->probe_response_length += length;
+
+	//Wait for "HTTP/1.x NNN"
+	if (backend->probe_response_length < 12) {
+		return;
+	}
+
+	if (memcmp(backend->probe_response, "HTTP/1.", 7) == 0 &&
+		backend->probe_response[9] == '2') {
+		probe_succeeded(backend);
+	} else {
+		probe_failed(backend);
+	}
+}
+
+static void on_probe_connect(SocketRec *rec, int status) {
+	Backend *backend = rec->data;
+	UpstreamPool *pool = backend->pool;
+
+	if (status == 0) {
+		probe_failed(backend);
+
+		return;
+	}
+
+	if (pool->probe_request == NULL) {
+		//Connecting is enough
+		probe_succeeded(backend);
+
+		return;
+	}
+
+	backend->probe_state = BACKEND_PROBE_WAITING;
+	backend->probe_response_length = 0;
+
+	rec->onReadable = on_probe_readable;
+	pumpScheduleWrite(rec, pool->probe_request, strlen(pool->probe_request));
+}
+
+//Stopping the pump frees the probe
+static void on_probe_removed(SocketRec *rec) {
+	Backend *backend = rec->data;
+
+	close(rec->socket);
+	backend->probe = NULL;
+}
+
+static void connect_probe(Backend *backend) {
+	UpstreamPool *pool = backend->pool;
+
+	backend->probe = pumpRegisterAddress(pool->pump, (struct sockaddr*) &backend->address,
+		backend->address_length, backend);
+
+	if (backend->probe == NULL) {
+		probe_failed(backend);
+
+		return;
+	}
+
+	backend->probe_state = BACKEND_PROBE_CONNECTING;
+	backend->probe->onConnect = on_probe_connect;
+	backend->probe->onRemoved = on_probe_removed;
+}
+
+//Work pool thread
+static void resolve_work(void *arg) {
+	BackendResolve *job = arg;
+
+	job->address_length = resolve(job->host, job->port, &job->address);
+}
+
+static void resolve_done(void *arg) {
+	BackendResolve *job = arg;
+	Backend *backend = job->backend;
+
+	if (backend != NULL) {
+		backend->resolve = NULL;
+
+		if (job->address_length == 0) {
+			_info("Failed to resolve %s\n", backend->host);
+			probe_failed(backend);
+		} else {
+			memcpy(&backend->address, &job->address, job->address_length);
+			backend->address_length = job->address_length;
+			connect_probe(backend);
+		}
+	}
+
+	free(job->host);
+	free(job->port);
+	free(job);
+}
+
+static void start_probe(Backend *backend) {
+	UpstreamPool *pool = backend->pool;
+
+	backend->timer = pumpAddTimer(pool->pump, pool->probe_timeout, on_probe_timeout, backend);
+
+	if (backend->address_length > 0) {
+		connect_probe(backend);
+
+		return;
+	}
+
+	//Retry the name lookup off the pump thread
+	BackendResolve *job = calloc(1, sizeof(BackendResolve));
+
+	assert(job != NULL);
+
+	job->backend = backend;
+	job->host = strdup(backend->host);
+	job->port = strdup(backend->port);
+
+	backend->resolve = job;
+	backend->probe_state = BACKEND_PROBE_RESOLVING;
+	pumpSubmitWork(pool->pump, resolve_work, resolve_done, job);
+}
+
+UpstreamPool *newUpstreamPool(EventPump *pump, int policy) {
+	UpstreamPool *pool = calloc(1, sizeof(UpstreamPool));
+
+	assert(pool != NULL);
+
+	pool->pump = pump;
+	pool->policy = policy;
+	pool->random_state = (unsigned int) time(NULL) ^ (unsigned int) getpid();
+	if (pool->random_state == 0) {
+		pool->random_state = 1;
+	}
+
+	pool->probe_interval = 5000;
+	pool->probe_timeout = 2000;
+	pool->min_backoff = 1000;
+	pool->max_backoff = 60000;
+	pool->failure_threshold = 3;
+
+	return pool;
+}
+
+/*
+ * Call before deleteEventPump(). Probes may be running.
+ */
+void deleteUpstreamPool(UpstreamPool *pool) {
+	for (int i = 0; i < pool->backend_count; ++i) {
+		Backend *backend = pool->backends[i];
+
+		end_probe(backend);
+
+		free(backend->host);
+		free(backend->port);
+		free(backend);
+	}
+
+	free(pool->backends);
+	free(pool->healthy);
+	free(pool->probe_request);
+	free(pool);
+}
+
+/*
+ * Resolves host once, blocking the caller. A backend that resolves
+ * starts out healthy. One that does not starts out ejected and its
+ * probes retry the lookup on the pump's work pool.
+ */
+Backend *upstreamAddBackend(UpstreamPool *pool, const char *host, const char *port) {
+	Backend *backend = calloc(1, sizeof(Backend));
+
+	assert(backend != NULL);
+
+	backend->pool = pool;
+	backend->host = strdup(host);
+	backend->port = strdup(port);
+	backend->address_length = resolve(host, port, &backend->address);
+	backend->healthy = backend->address_length > 0;
+	backend->backoff = backend->healthy ? 0 : pool->min_backoff;
+
+	pool->backends = realloc(pool->backends, (pool->backend_count + 1) * sizeof(Backend*));
+	pool->healthy = realloc(pool->healthy, (pool->backend_count + 1) * sizeof(int));
+	assert(pool->backends != NULL && pool->healthy != NULL);
+
+	pool->backends[pool->backend_count] = backend;
+	pool->backend_count += 1;
+
+	if (backend->healthy) {
+		pool->healthy[pool->healthy_count] = pool->backend_count - 1;
+		pool->healthy_count += 1;
+	}
+
+	return backend;
+}
+
+void upstreamStartProbes(UpstreamPool *pool) {
+	for (int i = 0; i < pool->backend_count; ++i) {
+		Backend *backend = pool->backends[i];
+
+		if (backend->timer == NULL && backend->probe == NULL && backend->resolve == NULL) {
+			schedule_probe(backend, 0);
+		}
+	}
+}
+
+static Backend *least_outstanding(UpstreamPool *pool, int *indices, int count) {
+	Backend *best = NULL;
+
+	//Rotate the starting point so that ties are spread out
+	for (int i = 0; i < count; ++i) {
+		Backend *backend = pool->backends[indices[(pool->next + i) % count]];
+
+		if (best == NULL || backend->outstanding < best->outstanding) {
+			best = backend;
+		}
+	}
+
+	pool->next = (pool->next + 1) % count;
+
+	return best;
+}
+
+static Backend *two_choices(UpstreamPool *pool) {
+	int count = pool->healthy_count;
+
+	if (count == 1) {
+		return pool->backends[pool->healthy[0]];
+	}
+
+	int a = next_random(pool) % count;
+	int b = next_random(pool) % (count - 1);
+
+	if (b >= a) {
+		b += 1;
+	}
+
+	Backend *first = pool->backends[pool->healthy[a]];
+	Backend *second = pool->backends[pool->healthy[b]];
+
+	return second->outstanding < first->outstanding ? second : first;
+}
+
+/*
+ * Picks a backend for a request and counts it as outstanding until
+ * upstreamRelease() is called. If every backend is ejected we still
+ * pick one rather than fail all traffic.
+ */
+Backend *upstreamAcquire(UpstreamPool *pool) {
+	Backend *backend;
+
+	if (pool->backend_count == 0) {
+		return NULL;
+	}
+
+	if (pool->healthy_count == 0) {
+		int all[pool->backend_count];
+
+		for (int i = 0; i < pool->backend_count; ++i) {
+			all[i] = i;
+		}
+
+		backend = least_outstanding(pool, all, pool->backend_count);
+	} else if (pool->policy == UPSTREAM_TWO_CHOICES) {
+		backend = two_choices(pool);
+	} else {
+		backend = least_outstanding(pool, pool->healthy, pool->healthy_count);
+	}
+
+	backend->outstanding += 1;
+
+	return backend;
+}
+
+/*
+ * Ends a request. Failures count towards ejecting the backend just
+ * like failed probes.
+ */
+void upstreamRelease(Backend *backend, int success) {
+	assert(backend->outstanding > 0);
+
+	backend->outstanding -= 1;
+
+	if (success) {
+		mark_success(backend);
+	} else {
+		mark_failure(backend);
+	}
+}
+
+/*
+ * Acquires a backend and starts connecting to it. Returns NULL if
+ * no connection could be started.
+ */
+SocketRec *upstreamConnect(UpstreamPool *pool, Backend **backend, void *data) {
+	Backend *selected = upstreamAcquire(pool);
+
+	if (selected == NULL) {
+		return NULL;
+	}
+
+	SocketRec *rec = NULL;
+
+	if (selected->address_length > 0) {
+		rec = pumpRegisterAddress(pool->pump, (struct sockaddr*) &selected->address,
+			selected->address_length, data);
+	}
+
+	if (rec == NULL) {
+		upstreamRelease(selected, 0);
+
+		return NULL;
+	}
+
+	*backend = selected;
+
+	return rec;
+}
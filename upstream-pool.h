@@ -0,0 +1,86 @@
+#ifndef UPSTREAM_POOL_H
+#define UPSTREAM_POOL_H
+
+#include <sys/socket.h>
+
+#include "event-pump.h"
+
+#define UPSTREAM_LEAST_OUTSTANDING 0
+#define UPSTREAM_TWO_CHOICES 1
+
+#define BACKEND_PROBE_IDLE 0
+#define BACKEND_PROBE_CONNECTING 1
+#define BACKEND_PROBE_WAITING 2
+#define BACKEND_PROBE_RESOLVING 3
+
+struct _UpstreamPool;
+struct _BackendResolve;
+
+typedef struct _Backend {
+	struct _UpstreamPool *pool;
+	char *host;
+	char *port;
+	//Connections go here. address_length is 0 until resolved.
+	struct sockaddr_storage address;
+	socklen_t address_length;
+	//Resolution running on the pump's work pool
+	struct _BackendResolve *resolve;
+	//Requests or connections handed out and not yet released
+	int outstanding;
+	int healthy;
+	//Consecutive failures
+	int failures;
+	//Delay before probing an ejected backend again
+	long backoff;
+
+	int probe_state;
+	SocketRec *probe;
+	//Next probe or probe timeout
+	PumpTimer *timer;
+	char probe_response[16];
+	size_t probe_response_length;
+
+	void *data;
+} Backend;
+
+/*
+ * Spreads requests over a set of backends. Backends are probed from
+ * pump timers and never block the pump. A backend that fails too
+ * often is ejected and probed again after a delay that doubles every
+ * time the probe fails.
+ */
+typedef struct _UpstreamPool {
+	EventPump *pump;
+	int policy;
+	Backend **backends;
+	int backend_count;
+	//Indices of the healthy backends
+	int *healthy;
+	int healthy_count;
+	unsigned int random_state;
+	int next;
+
+	//All times in milliseconds
+	long probe_interval;
+	long probe_timeout;
+	long min_backoff;
+	long max_backoff;
+	//Consecutive failures before a backend is ejected
+	int failure_threshold;
+	//Owned by the pool. Sent after connecting if not NULL.
+	//A 2xx reply is success.
+	char *probe_request;
+
+	void *data;
+	void (*onBackendChange)(struct _UpstreamPool *pool, Backend *backend);
+} UpstreamPool;
+
+UpstreamPool *newUpstreamPool(EventPump *pump, int policy);
+void deleteUpstreamPool(UpstreamPool *pool);
+Backend *upstreamAddBackend(UpstreamPool *pool, const char *host, const char *port);
+void upstreamStartProbes(UpstreamPool *pool);
+Backend *upstreamAcquire(UpstreamPool *pool);
+void upstreamRelease(Backend *backend, int success);
+SocketRec *upstreamConnect(UpstreamPool *pool, Backend **backend, void *data);
+
+#endif
@@ -0,0 +1,204 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "work-pool.h"
+
+#define DIE(value, message) if (value < 0) {perror(message); abort();}
+
+static void queue_add(WorkQueue *queue, WorkItem *item) {
+	item->next = NULL;
+
+	if (queue->last == NULL) {
+		queue->first = item;
+	} else {
+		queue->last->next = item;
+	}
+	queue->last = item;
+}
+
+static WorkItem *queue_take(WorkQueue *queue) {
+	WorkItem *item = queue->first;
+
+	if (item != NULL) {
+		queue->first = item->next;
+		if (queue->first == NULL) {
+			queue->last = NULL;
+		}
+	}
+
+	return item;
+}
+
+static void *worker_main(void *data) {
+	WorkPool *pool = data;
+
+	pthread_mutex_lock(&pool->lock);
+
+	while (1) {
+		WorkItem *item = queue_take(&pool->pending);
+
+		if (item == NULL) {
+			if (pool->stopping) {
+				break;
+			}
+
+			pthread_cond_wait(&pool->has_work, &pool->lock);
+
+			continue;
+		}
+
+		pthread_mutex_unlock(&pool->lock);
+
+		item->work(item->arg);
+
+		pthread_mutex_lock(&pool->lock);
+
+		int was_empty = pool->completed.first == NULL;
+
+		queue_add(&pool->completed, item);
+
+		if (was_empty) {
+			//One byte wakes the loop for any number of completions
+			char ch = 0;
+
+			if (write(pool->notify_pipe[1], &ch, 1) < 0 && errno != EAGAIN) {
+				perror("Failed to notify work completion.");
+			}
+		}
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+WorkPool *newWorkPool(int thread_count) {
+	WorkPool *pool = calloc(1, sizeof(WorkPool));
+
+	assert(pool != NULL);
+	assert(thread_count > 0);
+
+	int status = pipe(pool->notify_pipe);
+	DIE(status, "Failed to create notification pipe.");
+
+	for (int i = 0; i < 2; ++i) {
+		status = fcntl(pool->notify_pipe[i], F_SETFL, O_NONBLOCK);
+		DIE(status, "Failed to set non blocking mode for pipe.");
+	}
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->has_work, NULL);
+
+	pool->threads = calloc(thread_count, sizeof(pthread_t));
+	assert(pool->threads != NULL);
+	pool->thread_count = thread_count;
+
+	for (int i = 0; i < thread_count; ++i) {
+		status = pthread_create(&pool->threads[i], NULL, worker_main, pool);
+
+		if (status != 0) {
+			errno = status;
+			DIE(-1, "Failed to start worker thread.");
+		}
+	}
+
+	return pool;
+}
+
+/*
+ * Waits for submitted work to finish. Done functions that have not
+ * run yet are not called.
+ */
+void deleteWorkPool(WorkPool *pool) {
+	pthread_mutex_lock(&pool->lock);
+	pool->stopping = 1;
+	pthread_cond_broadcast(&pool->has_work);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (int i = 0; i < pool->thread_count; ++i) {
+		pthread_join(pool->threads[i], NULL);
+	}
+
+	WorkItem *item;
+
+	while ((item = queue_take(&pool->completed)) != NULL) {
+		free(item);
+	}
+
+	close(pool->notify_pipe[0]);
+	close(pool->notify_pipe[1]);
+	pthread_cond_destroy(&pool->has_work);
+	pthread_mutex_destroy(&pool->lock);
+
+	free(pool->threads);
+	free(pool);
+}
+
+/*
+ * Queues work. done may be NULL. Call from the loop thread.
+ */
+void workPoolSubmit(WorkPool *pool, void (*work)(void *arg),
+	void (*done)(void *arg), void *arg) {
+	WorkItem *item = malloc(sizeof(WorkItem));
+
+	assert(item != NULL);
+
+	item->work = work;
+	item->done = done;
+	item->arg = arg;
+
+	pool->outstanding += 1;
+
+	pthread_mutex_lock(&pool->lock);
+	queue_add(&pool->pending, item);
+	pthread_cond_signal(&pool->has_work);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * The descriptor becomes readable when work completes. Call
+ * workPoolProcessCompletions() then.
+ */
+int workPoolNotifyFd(WorkPool *pool) {
+	return pool->notify_pipe[0];
+}
+
+/*
+ * Runs the done functions of completed work in completion order.
+ * Returns the number run.
+ */
+int workPoolProcessCompletions(WorkPool *pool) {
+	char buffer[64];
+
+	while (read(pool->notify_pipe[0], buffer, sizeof(buffer)) > 0) {
+		//Drain
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	WorkItem *item = pool->completed.first;
+	pool->completed.first = pool->completed.last = NULL;
+	pthread_mutex_unlock(&pool->lock);
+
+	int count = 0;
+
+	while (item != NULL) {
+		WorkItem *next = item->next;
+
+		pool->outstanding -= 1;
+
+		if (item->done != NULL) {
+			item->done(item->arg);
+		}
+
+		free(item);
+		item = next;
+		count += 1;
+	}
+
+	return count;
+}
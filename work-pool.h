@@ -0,0 +1,48 @@
+#ifndef WORK_POOL_H
+#define WORK_POOL_H
+
+#include <pthread.h>
+
+#define WORK_POOL_DEFAULT_THREADS 4
+
+typedef struct _WorkItem {
+	//Runs on a worker thread
+	void (*work)(void *arg);
+	//Runs on the loop thread once work has returned
+	void (*done)(void *arg);
+	void *arg;
+	struct _WorkItem *next;
+} WorkItem;
+
+typedef struct _WorkQueue {
+	WorkItem *first;
+	WorkItem *last;
+} WorkQueue;
+
+/*
+ * Runs blocking or CPU heavy work on a fixed set of threads. Work
+ * functions must not touch loop state. Completions are reported
+ * through a pipe that the loop watches. The done functions run on
+ * the loop thread in workPoolProcessCompletions().
+ */
+typedef struct _WorkPool {
+	pthread_t *threads;
+	int thread_count;
+	pthread_mutex_t lock;
+	pthread_cond_t has_work;
+	WorkQueue pending;
+	WorkQueue completed;
+	int stopping;
+	//Submitted and done not yet run. Used by the loop thread only.
+	int outstanding;
+	int notify_pipe[2];
+} WorkPool;
+
+WorkPool *newWorkPool(int thread_count);
+void deleteWorkPool(WorkPool *pool);
+void workPoolSubmit(WorkPool *pool, void (*work)(void *arg),
+	void (*done)(void *arg), void *arg);
+int workPoolNotifyFd(WorkPool *pool);
+int workPoolProcessCompletions(WorkPool *pool);
+
+#endif